@@ -0,0 +1,31 @@
+/** @file */
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+
+#ifndef CCACHE_H
+#define CCACHE_H
+
+#define CCACHE_DIRNAME "ctld"             ///< sub-directory of $XDG_CACHE_HOME (or ~/.cache) with the cached indexes
+
+/**
+ * @details A context loaded from a PSL file through the on-disk cache.
+ *
+ * The rule index of a PSL file is written to the cache directory the first
+ * time the file is used. The name of the cached file has a hash of the
+ * content of the list, the version of the index and the sections, so a
+ * changed list (or a new version of the library) gets a new file and later
+ * runs only map the index in memory instead of parsing the list.
+ */
+typedef struct _CCACHE{
+    struct ctld_ctx * ctx;      ///< the context (libctld.h), NULL on failure
+    void * map;                 ///< the cached index mapped in memory (NULL if ctx owns its index)
+    size_t map_len;             ///< size of map
+    int from_cache;             ///< 1 if the index was read from the cache
+} ccache_ctx;
+
+char * ccache_default_dir(void);
+ccache_ctx * ccache_open(const char * psl_file, int sections, const char * dir);
+void ccache_free(ccache_ctx * cache);
+
+#endif
@@ -0,0 +1,39 @@
+/** @file */
+#include <stdlib.h>
+#include <stdint.h>
+
+#ifndef CCOUNTER_H
+#define CCOUNTER_H
+
+#define CCOUNTER_INITIAL_SIZE 0x400     ///< default number of slots of a new counter (power of 2)
+
+/**
+ * @details One entry of the counter. Returned by ccounter_top() as an array.
+ */
+typedef struct _CCOUNTER_ITEM{
+    char * key;                 ///< null-terminated key (owned by the counter)
+    uint64_t count;             ///< number of times the key has been added
+} CCOUNTER_ITEM, *PCCOUNTER_ITEM;
+
+typedef struct _CCOUNTER ccounter_ctx;
+
+/**
+ * @details Open-addressing hash map from string keys to 64-bit counters.
+ *
+ * Unlike cdict, the table grows with the number of keys so the cost of
+ * ccounter_add() stays constant no matter how many distinct keys we see.
+ */
+struct _CCOUNTER{
+    CCOUNTER_ITEM * table;      ///< array of slots, a slot is empty if key is NULL
+    uint64_t * hashes;          ///< cached hash value of every slot
+    size_t size;                ///< number of slots (always a power of 2)
+    size_t len;                 ///< number of distinct keys stored
+};
+
+ccounter_ctx * ccounter_init(size_t size);
+void ccounter_free(ccounter_ctx * ctx);
+int ccounter_add(ccounter_ctx * ctx, const char * key, uint64_t n);
+uint64_t ccounter_get(ccounter_ctx * ctx, const char * key);
+PCCOUNTER_ITEM ccounter_top(ccounter_ctx * ctx, size_t k, size_t * out_len);
+
+#endif
@@ -0,0 +1,20 @@
+/** @file */
+#include <stdio.h>
+#include <stdlib.h>
+
+#ifndef CHOST_H
+#define CHOST_H
+
+#define CHOST_OK 0                  ///< a rule matched the host
+#define CHOST_EMPTY 1               ///< nothing left after trimming the input
+#define CHOST_IDN_FAILED 2          ///< the host is an IDN which can not be converted to ASCII
+#define CHOST_NO_MATCH 3            ///< no rule matched the host (or out of memory)
+
+struct ctld_ctx;
+struct ctld_result;
+
+size_t chost_trim(const char ** input, size_t len);
+struct ctld_result * chost_lookup(struct ctld_ctx * ctx, const char * input, size_t len,
+                                  int use_private, int * status);
+
+#endif
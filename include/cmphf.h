@@ -0,0 +1,65 @@
+/** @file */
+#include <stdlib.h>
+#include <stdint.h>
+
+#ifndef CMPHF_H
+#define CMPHF_H
+
+#define CMPHF_BUCKET_SIZE 4             ///< average number of keys per bucket
+#define CMPHF_MAX_DISPLACEMENT 0x100000 ///< displacements tried per bucket before changing the seed
+#define CMPHF_MAX_SEEDS 16              ///< seeds tried before giving up
+
+typedef struct _CMPHF cmphf;
+
+/**
+ * @details Minimal perfect hash function (hash and displace).
+ *
+ * The keys are given as 64-bit hashes. Each key goes to a bucket and each
+ * bucket has a displacement which moves all of its keys to free slots, so
+ * the n keys map to n different slots in [0, n) with one table access.
+ * A key which was not in the set maps to some slot too; the caller must
+ * compare the key stored in that slot.
+ *
+ * The structure has no pointer other than disp, which can point into a
+ * larger (e.g. memory-mapped) buffer.
+ */
+struct _CMPHF{
+    uint32_t n;                 ///< number of keys (and slots)
+    uint32_t buckets;           ///< number of buckets
+    uint64_t seed;              ///< seed mixed into the hashes
+    const uint32_t * disp;      ///< displacement of each bucket
+};
+
+
+/**
+ * @brief final mixer of the 64-bit hashes (from MurmurHash3)
+ */
+static inline uint64_t cmphf_mix(uint64_t h){
+    h ^= h >> 33;
+    h *= 0xff51afd7ed558ccdULL;
+    h ^= h >> 33;
+    h *= 0xc4ceb9fe1a85ec53ULL;
+    h ^= h >> 33;
+    return h;
+}
+
+static inline uint32_t cmphf_bucket(const cmphf * ctx, uint64_t h){
+    return (uint32_t)(((cmphf_mix(h ^ ctx->seed) >> 32) * ctx->buckets) >> 32);
+}
+
+static inline uint32_t cmphf_slot_of(const cmphf * ctx, uint64_t h, uint32_t disp){
+    uint64_t m = cmphf_mix(h ^ ctx->seed ^ ((uint64_t)(disp + 1) * 0x9e3779b97f4a7c15ULL));
+    return (uint32_t)(((m & 0xffffffffULL) * ctx->n) >> 32);
+}
+
+/**
+ * @brief returns the slot of a key hash (only meaningful if n > 0)
+ */
+static inline uint32_t cmphf_lookup(const cmphf * ctx, uint64_t h){
+    return cmphf_slot_of(ctx, h, ctx->disp[cmphf_bucket(ctx, h)]);
+}
+
+int cmphf_build(cmphf * ctx, const uint64_t * hashes, uint32_t n, uint32_t * disp, uint32_t * slots, uint64_t seed);
+uint32_t cmphf_buckets(uint32_t n);
+
+#endif
@@ -0,0 +1,74 @@
+/** @file */
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <sys/types.h>
+#include <pthread.h>
+#include <zlib.h>
+
+#ifndef CREADER_H
+#define CREADER_H
+
+#define CREADER_DEFAULT_SIZE 0x400000     ///< default size of the decoded buffer (4 MB)
+#define CREADER_CHUNKS 4                  ///< number of chunks between the decoding thread and the reader
+#define CREADER_BGZF_BLOCK 0x10000        ///< maximum size of a BGZF block (compressed or not)
+
+#define CREADER_PLAIN 0                   ///< the input is not compressed
+#define CREADER_GZIP 1                    ///< gzip (or zlib) input, one or more members
+#define CREADER_BGZF 2                    ///< blocked gzip (bgzip), blocks are decoded in parallel
+#define CREADER_ZSTD 3                    ///< zstd input (needs HAVE_ZSTD)
+
+typedef struct _CREADER creader_ctx;
+
+/**
+ * @details One buffer filled by the decoding thread.
+ */
+typedef struct _CREADER_CHUNK{
+    char * data;                ///< decoded bytes
+    ssize_t len;                ///< number of bytes in data, 0 at the end of input and -1 on error
+    int ready;                  ///< 1 if the chunk is filled and not consumed yet
+} CREADER_CHUNK, *PCREADER_CHUNK;
+
+/**
+ * @details Buffered line reader on top of a FILE stream.
+ *
+ * Compressed input (gzip, BGZF and zstd) is detected from its first bytes
+ * and decoded in large blocks. Lines are returned from the internal buffer
+ * without copying. With more than one thread, decoding runs in its own
+ * thread while the caller parses the lines, and the blocks of a BGZF file
+ * are decoded in parallel.
+ */
+struct _CREADER{
+    FILE * fp;                  ///< the stream to read from
+    int format;                 ///< one of CREADER_PLAIN, CREADER_GZIP, CREADER_BGZF or CREADER_ZSTD
+    int threads;                ///< number of threads used for decoding
+    int err;                    ///< 1 if reading or decoding failed
+    int eof;                    ///< 1 if all the input is decoded
+    int partial;                ///< 1 if the decoder is in the middle of a gzip member or a zstd frame
+    unsigned char * in;         ///< compressed input
+    size_t in_size;             ///< size of in
+    size_t in_pos;              ///< first byte of in not consumed yet
+    size_t in_len;              ///< number of bytes in in
+    int in_eof;                 ///< 1 if the stream has no more bytes
+    char * buf;                 ///< decoded input, lines are returned from here
+    size_t size;                ///< size of buf
+    size_t pos;                 ///< start of the next line in buf
+    size_t len;                 ///< number of decoded bytes in buf
+    size_t scanned;             ///< bytes after pos already searched for a newline
+    z_stream * zs;              ///< gzip decoder
+    void * zstd;                ///< zstd decoder (ZSTD_DStream)
+    int pipelined;              ///< 1 if a thread decodes the input into chunks
+    pthread_t producer;         ///< the decoding thread
+    pthread_mutex_t lock;       ///< protects chunks and stop
+    pthread_cond_t cond;        ///< signaled when a chunk is filled or consumed
+    CREADER_CHUNK chunks[CREADER_CHUNKS];   ///< ring of decoded chunks
+    size_t chunk_size;          ///< size of each chunk
+    size_t next_chunk;          ///< the next chunk the reader consumes
+    int stop;                   ///< asks the decoding thread to stop
+};
+
+creader_ctx * creader_init(FILE * fp, size_t size, int threads);
+ssize_t creader_getline(creader_ctx * ctx, char ** line);
+int creader_free(creader_ctx * ctx);
+
+#endif
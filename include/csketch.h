@@ -0,0 +1,107 @@
+/** @file */
+#include <stdlib.h>
+#include <stdint.h>
+
+#ifndef CSKETCH_H
+#define CSKETCH_H
+
+#define CSKETCH_HLL_DEFAULT_PRECISION 14    ///< 2^14 registers (16 KB), ~0.8% standard error
+#define CSKETCH_HLL_MIN_PRECISION 4
+#define CSKETCH_HLL_MAX_PRECISION 18
+#define CSKETCH_FPSET_INITIAL_SIZE 0x1000   ///< default number of slots of a new fingerprint set
+#define CSKETCH_BLOOM_HASHES 7              ///< number of bits set per key in the Bloom filter
+#define CSKETCH_FNV_OFFSET 0xcbf29ce484222325ULL    ///< initial value of the 64-bit FNV-1a hash
+#define CSKETCH_FNV_PRIME 0x100000001b3ULL          ///< multiplier of the 64-bit FNV-1a hash
+/// adds one byte to a 64-bit FNV-1a hash, for callers that transform the bytes (e.g. lower-case them)
+#define CSKETCH_FNV_STEP(h, c) (((h) ^ (uint64_t)(unsigned char)(c)) * CSKETCH_FNV_PRIME)
+
+/**
+ * @details One monitored key of the top-k sketch.
+ */
+typedef struct _CSKETCH_ITEM{
+    char * key;                 ///< null-terminated key (owned by the sketch)
+    uint64_t count;             ///< estimated count (never lower than the real count)
+    uint64_t error;             ///< maximum over-estimation of count
+} CSKETCH_ITEM, *PCSKETCH_ITEM;
+
+typedef struct _CSKETCH_TOPK csketch_topk;
+typedef struct _CSKETCH_HLL csketch_hll;
+typedef struct _CSKETCH_FPSET csketch_fpset;
+typedef struct _CSKETCH_BLOOM csketch_bloom;
+
+/**
+ * @details Space-Saving heavy-hitter sketch with a fixed number of counters.
+ *
+ * The sketch monitors at most `capacity` keys. When a new key arrives and all
+ * the counters are in use, the key with the minimum count is replaced. Any key
+ * whose real frequency is above N/capacity is guaranteed to be monitored.
+ */
+struct _CSKETCH_TOPK{
+    PCSKETCH_ITEM items;        ///< monitored keys
+    size_t * key_size;          ///< allocated size of each key buffer
+    uint64_t * hashes;          ///< hash value of each monitored key
+    size_t * heap;              ///< min-heap (by count) of indexes into items
+    size_t * heap_pos;          ///< position of each item inside heap
+    int64_t * index;            ///< open-addressing table from key hash to item index (-1 is empty)
+    size_t index_size;          ///< number of slots of index (power of 2)
+    size_t capacity;            ///< maximum number of monitored keys
+    size_t len;                 ///< current number of monitored keys
+    uint64_t total;             ///< sum of all the counts added to the sketch
+};
+
+/**
+ * @details HyperLogLog distinct-count estimator.
+ */
+struct _CSKETCH_HLL{
+    uint8_t * registers;        ///< 2^precision registers
+    int precision;              ///< number of bits used to choose the register
+};
+
+/**
+ * @details Set of 64-bit key fingerprints (open addressing).
+ *
+ * Only 8 bytes are stored per key instead of the key itself. Two different
+ * keys are treated as the same key with a probability of about n^2/2^65.
+ */
+struct _CSKETCH_FPSET{
+    uint64_t * table;           ///< fingerprints, 0 means the slot is empty
+    size_t size;                ///< number of slots (always a power of 2)
+    size_t len;                 ///< number of fingerprints stored
+};
+
+/**
+ * @details Bloom filter with a fixed size.
+ *
+ * A key which was never added may be reported as seen (false positive),
+ * but a key which was added is never reported as new.
+ */
+struct _CSKETCH_BLOOM{
+    uint8_t * bits;             ///< bit array
+    uint64_t nbits;             ///< number of bits in the array
+    int hashes;                 ///< number of bits set per key
+};
+
+csketch_topk * csketch_topk_init(size_t capacity);
+void csketch_topk_free(csketch_topk * ctx);
+int csketch_topk_add(csketch_topk * ctx, const char * key, uint64_t n);
+PCSKETCH_ITEM csketch_topk_list(csketch_topk * ctx, size_t k, size_t * out_len);
+
+csketch_hll * csketch_hll_init(int precision);
+void csketch_hll_free(csketch_hll * ctx);
+int csketch_hll_add(csketch_hll * ctx, const char * key);
+int csketch_hll_merge(csketch_hll * dst, const csketch_hll * src);
+uint64_t csketch_hll_count(const csketch_hll * ctx);
+
+csketch_fpset * csketch_fpset_init(size_t size);
+void csketch_fpset_free(csketch_fpset * ctx);
+int csketch_fpset_add(csketch_fpset * ctx, const char * key);
+
+csketch_bloom * csketch_bloom_init(size_t bytes, int hashes);
+void csketch_bloom_free(csketch_bloom * ctx);
+int csketch_bloom_add(csketch_bloom * ctx, const char * key);
+
+uint64_t csketch_hash(const char * key);
+uint64_t csketch_fnv1a(const void * data, size_t len);
+uint64_t csketch_fnv1a_str(const char * key);
+
+#endif
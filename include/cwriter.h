@@ -0,0 +1,73 @@
+/** @file */
+#include <stdio.h>
+#include <stdlib.h>
+#include <pthread.h>
+
+#ifndef CWRITER_H
+#define CWRITER_H
+
+#define CWRITER_DEFAULT_SIZE 0x100000     ///< default buffer size of a writer (1 MB)
+
+typedef struct _CWRITER cwriter_ctx;
+typedef struct _CWRITER_POOL cwriter_pool;
+
+/**
+ * @details Buffered writer on top of a FILE stream.
+ *
+ * Data is collected in a large buffer and written with a single fwrite()
+ * call whenever the buffer is full, instead of one stdio call per field.
+ *
+ * An async writer has two buffers: a full buffer is handed to the threads
+ * of a cwriter_pool while the caller fills the other one, so many writers
+ * can write to their files at the same time. cwriter_init_async() gives the
+ * writer a pool of its own with one thread and cwriter_init_pooled() lets
+ * many writers share a few threads.
+ *
+ * A line-buffered writer (cwriter_set_line_buffered()) writes every complete
+ * line at once, for terminals and other readers waiting for each record.
+ */
+struct _CWRITER{
+    FILE * fp;                  ///< the stream to write to
+    char * buf;                 ///< the buffer
+    size_t size;                ///< size of the buffer
+    size_t len;                 ///< number of bytes waiting in the buffer
+    int err;                    ///< 1 if any write to the stream failed
+    int async;                  ///< 1 if the threads of pool write the full buffers
+    int line_buffered;          ///< 1 to write the buffer after each complete line (interactive output)
+    char * pending;             ///< the buffer being written by the pool
+    size_t pending_len;         ///< number of bytes in pending, 0 when nothing is queued or being written
+    cwriter_pool * pool;        ///< the threads which write pending (NULL for a synchronous writer)
+    int owns_pool;              ///< 1 if the pool was created by cwriter_init_async()
+    cwriter_ctx * next;         ///< next writer in the queue of the pool
+};
+
+/**
+ * @details Threads which write the full buffers of async writers.
+ *
+ * Writers with a full buffer are queued and the first idle thread writes
+ * it, so the number of threads does not grow with the number of files.
+ * A writer has at most one buffer in the queue, which keeps its data in
+ * order.
+ */
+struct _CWRITER_POOL{
+    pthread_t * threads;        ///< the writing threads
+    int nthreads;               ///< number of threads running (0 if none could start)
+    cwriter_ctx * head;         ///< first writer waiting for a thread
+    cwriter_ctx * tail;         ///< last writer waiting for a thread
+    int stop;                   ///< asks the threads to exit
+    pthread_mutex_t lock;       ///< protects the queue, stop and the pending, pending_len and err of the writers
+    pthread_cond_t work;        ///< signaled when a writer is queued or on stop
+    pthread_cond_t done;        ///< signaled when a buffer is written
+};
+
+cwriter_pool * cwriter_pool_init(int nthreads);
+void cwriter_pool_free(cwriter_pool * pool);
+cwriter_ctx * cwriter_init(FILE * fp, size_t size);
+cwriter_ctx * cwriter_init_async(FILE * fp, size_t size);
+cwriter_ctx * cwriter_init_pooled(FILE * fp, size_t size, cwriter_pool * pool);
+void cwriter_set_line_buffered(cwriter_ctx * ctx, int line_buffered);
+int cwriter_write(cwriter_ctx * ctx, const void * data, size_t len);
+int cwriter_flush(cwriter_ctx * ctx);
+int cwriter_free(cwriter_ctx * ctx);
+
+#endif
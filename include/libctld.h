@@ -1,4 +1,5 @@
 /** @file */
+#include <stdint.h>
 #include <cdict.h>
 
 #define CTLD_ERROR_MALLOC_FAILED 1
@@ -8,6 +9,43 @@
 #define CTLD_LIST_SPLIT_FAILED 5
 #define CTLD_PARSE_LIST_FAILED 6
 #define CTLD_NO_MATCH_FOUND 7
+#define CTLD_CONTEXT_REPLICATED 8     ///< the rules of a context with NUMA replicas can not change
+
+#define CTLD_FIELD_SUFFIX 1         ///< select ctld_result.suffix
+#define CTLD_FIELD_RD 2             ///< select ctld_result.registered_domain
+#define CTLD_FIELD_DOMAIN 3         ///< select ctld_result.domain
+#define CTLD_FIELD_FQDN 4           ///< select ctld_result.fqdn
+
+#define CTLD_OVERLAY_INITIAL_SIZE 16    ///< default number of slots of a new overlay (power of 2)
+
+#define CTLD_INDEX_MAGIC 0x58444c43     ///< "CLDX", first bytes of a rule index
+#define CTLD_INDEX_VERSION 3            ///< changes whenever the layout of the index changes
+
+#define CTLD_TLD2_SIZE (26 * 26)        ///< slots of the table of two-letter top-level labels
+#define CTLD_GTLD_SLOTS 64              ///< slots of the table of common generic top-level labels (power of 2)
+#define CTLD_GTLD_MAX_LEN 7             ///< longest label of the generic top-level table
+#define CTLD_TLD_FLAGS_MASK 0xff        ///< TLD slot value: CTLD_RULE_* flags of the label itself (0 if it is not a rule)
+#define CTLD_TLD_ICANN_SHIFT 24         ///< TLD slot value: deepest ICANN rule under the label (4 bits)
+#define CTLD_TLD_ALL_SHIFT 28           ///< TLD slot value: deepest rule of any section under the label (4 bits)
+#define CTLD_TLD_NO_LIMIT 15            ///< depth value meaning "use the depth of the whole index"
+
+#define CTLD_SECTION_ICANN 0x01        ///< the ICANN section of the PSL
+#define CTLD_SECTION_PRIVATE 0x02      ///< the PRIVATE section of the PSL
+#define CTLD_SECTION_ALL 0x03          ///< both sections
+
+#define CTLD_LAYOUT_HASH 0              ///< rule index layout: minimal perfect hash table (fastest)
+#define CTLD_LAYOUT_COMPACT 1           ///< rule index layout: front-coded sorted names (smallest)
+#define CTLD_COMPACT_BLOCK 16           ///< names per front-coded block of the compact layout
+#define CTLD_COMPACT_MAX_NAME 255       ///< longest name of the compact layout (longer ones need the hash layout)
+
+#define CTLD_NUMA_MAX_NODES 64          ///< highest number of NUMA nodes ctld_ctx_replicate_numa() places copies on
+#define CTLD_PARALLEL_CHUNK 128         ///< hosts per chunk of ctld_parse_parallel(), the unit of work stealing
+#define CTLD_PARALLEL_MAX_THREADS 256   ///< most threads used by ctld_parse_parallel()
+
+#define CTLD_RULE_EXACT 0x01            ///< the name is a rule ("example.com")
+#define CTLD_RULE_WILDCARD 0x02         ///< "*." followed by the name is a rule ("*.example.com")
+#define CTLD_RULE_EXCEPTION 0x04        ///< "!" followed by the name is a rule ("!www.example.com")
+#define CTLD_RULE_PRIVATE_SHIFT 3       ///< the flags of the PRIVATE section are shifted by this
 
 /**
  * @details This is an internal structure for each entry of PSL data.
@@ -29,6 +67,12 @@ struct ctld_result{
     char * registered_domain;       ///< Registered domain based on the suffix
     char * domain;                  ///< domain name part of the registered domain(without suffix)
     char * fqdn;                    ///< fully-qualified domain name of the given record
+    char * rule;                    ///< the PSL rule that matched (e.g. "com", "*.ck" or "!www.ck")
+    int is_private;                 ///< 1 if the rule comes from the PRIVATE section else 0
+    int is_wildcard;                ///< 1 if the rule is a wildcard rule else 0
+    int is_exception;               ///< 1 if the rule is an exception rule else 0
+    char * icann_suffix;            ///< suffix when only the ICANN section is used (NULL if no ICANN rule matches)
+    char * icann_registered_domain; ///< registered domain when only the ICANN section is used
 };
 
 
@@ -46,6 +90,113 @@ typedef struct ctld_node ctld_node;
 
 
 
+/**
+ * @details Header of a rule index.
+ *
+ * The index is one position-independent block of memory: the header, the
+ * displacements of the minimal perfect hash function, one entry per name
+ * and the names themselves, all addressed by offsets from the start of the
+ * block.
+ *
+ * The compact layout (CTLD_LAYOUT_COMPACT) has no hash function and no
+ * entries: the names are reversed ("ku.oc"), sorted and front-coded in
+ * blocks of CTLD_COMPACT_BLOCK names, and entries gives the offset of
+ * each block in the names. The first name of a block is stored as its
+ * length, its bytes and its flags; the others as the number of bytes
+ * shared with the previous name, the length of the rest, the rest and the
+ * flags. A lookup is a binary search over the first names of the blocks
+ * followed by a scan of one block.
+ *
+ * The index is embedded in the binary at build time
+ * (include/psl_index.h) and built at runtime for other lists, so it can
+ * also be written to a file and mapped back as it is. Integers are stored
+ * in the byte order of the machine which built the index.
+ */
+struct ctld_index_header{
+    uint32_t magic;                     ///< CTLD_INDEX_MAGIC
+    uint32_t version;                   ///< CTLD_INDEX_VERSION
+    uint64_t size;                      ///< size of the whole index in bytes
+    uint64_t seed;                      ///< seed of the perfect hash function
+    uint32_t count;                     ///< number of entries
+    uint32_t buckets;                   ///< number of displacements
+    uint32_t max_depth;                 ///< maximum number of labels in a rule
+    uint32_t disp;                      ///< offset of the displacements (uint32_t)
+    uint32_t entries;                   ///< offset of the entries (ctld_index_entry) or of the blocks (uint32_t, compact layout)
+    uint32_t names;                     ///< offset of the names (front-coded in the compact layout)
+    uint32_t names_len;                 ///< size of the names in bytes
+    uint32_t tld2;                      ///< offset of the two-letter table (CTLD_TLD2_SIZE uint32_t), 0 if none
+    uint32_t gtld;                      ///< offset of the generic table (CTLD_GTLD_SLOTS ctld_gtld_slot), 0 if none
+    uint32_t layout;                    ///< CTLD_LAYOUT_*
+    uint64_t gtld_seed;                 ///< seed of the perfect hash of the generic table
+};
+
+/**
+* @details Type definition of the struct ctld_index_header
+*/
+typedef struct ctld_index_header ctld_index_header;
+
+
+/**
+ * @details One name of the rule index. All the rules with the same labels
+ * (e.g. "ck", "*.ck" and "!ck") share one entry; wildcard rules are stored
+ * under their parent name so one probe per label answers both questions.
+ */
+struct ctld_index_entry{
+    uint64_t hash;                      ///< hash of the name, checked before the name itself
+    uint32_t name;                      ///< offset of the lower-cased, null-terminated name in the names
+    uint16_t len;                       ///< length of the name
+    uint8_t flags;                      ///< CTLD_RULE_* flags, the PRIVATE ones shifted by CTLD_RULE_PRIVATE_SHIFT
+    uint8_t reserved;                   ///< always 0
+};
+
+/**
+* @details Type definition of the struct ctld_index_entry
+*/
+typedef struct ctld_index_entry ctld_index_entry;
+
+
+/**
+ * @details One slot of the table of common generic top-level labels.
+ *
+ * Most lookups end in a few top-level labels, so the index starts with two
+ * small direct tables: one slot per two-letter label ("aa" to "zz") and a
+ * perfect hash table of common generic labels ("com", "net", ...). A slot
+ * gives the flags of the label and the depth of the deepest rule under it
+ * (see CTLD_TLD_*), so the first step of a lookup is one access to a table
+ * which stays in the L1 cache, and labels without deep rules stop early.
+ */
+struct ctld_gtld_slot{
+    char name[CTLD_GTLD_MAX_LEN + 1];   ///< lower-cased label, empty if the slot is free
+    uint32_t value;                     ///< flags and depths (see CTLD_TLD_*)
+    uint32_t reserved;                  ///< always 0
+};
+
+/**
+* @details Type definition of the struct ctld_gtld_slot
+*/
+typedef struct ctld_gtld_slot ctld_gtld_slot;
+
+
+/**
+ * @details Options of ctld_ctx_create(). Call ctld_options_init() first to
+ * get the defaults, then change what you need.
+ */
+struct ctld_options{
+    const char * filename;              ///< PSL file to load (used if data is NULL)
+    const char * data;                  ///< PSL data to load
+    size_t len;                         ///< length of data in bytes (0 if data is null-terminated)
+    int sections;                       ///< CTLD_SECTION_* to load (default: CTLD_SECTION_ALL)
+    int unicode_rules;                  ///< 1 (default) to also index IDNA rules in Unicode, 0 for the ASCII form only
+    int layout;                         ///< CTLD_LAYOUT_* of the rule index (default: CTLD_LAYOUT_HASH)
+    uint64_t hash_seed;                 ///< seed of the perfect hash function (default: 0)
+};
+
+/**
+* @details Type definition of the struct ctld_options
+*/
+typedef struct ctld_options ctld_options;
+
+
 /**
  * @details This structure is the main context of libctld library.
  * The structure returns by either calling ctld_parse_file() or
@@ -53,8 +204,21 @@ typedef struct ctld_node ctld_node;
  * 
  */
 struct ctld_ctx{
-    cdict_ctx * list_private;           ///< contains the private part of the suffix list
-    cdict_ctx * list_public;            ///< contains the public part of the suffix list
+    const ctld_index_header * index;    ///< rules of both sections (see ctld_index_header)
+    int owns_index;                     ///< 1 if index is freed by ctld_free()
+    uint32_t mph_n;                     ///< number of names of the index with a perfect hash function (0 for the compact layout)
+    uint32_t mph_buckets;               ///< buckets of the perfect hash function
+    uint64_t mph_seed;                  ///< seed of the perfect hash function
+    const uint32_t * mph_disp;          ///< displacements of the perfect hash function (inside index)
+    int max_depth;                      ///< maximum number of labels in a rule (lookups never look further)
+    int layout;                         ///< CTLD_LAYOUT_* of the indexes built for this context
+    int sections;                       ///< CTLD_SECTION_* loaded from lists
+    int unicode_rules;                  ///< 1 if the Unicode form of IDNA rules is indexed next to the ASCII form
+    uint64_t hash_seed;                 ///< seed of the perfect hash function of the indexes built for this context
+    struct ctld_ctx ** replicas;        ///< read-only copy of the context per NUMA node (see ctld_ctx_replicate_numa()), NULL if none
+    int replica_nodes;                  ///< number of entries of replicas (highest node + 1)
+    int * cpu_node;                     ///< NUMA node of each CPU, used to pick the local replica
+    int cpu_count;                      ///< number of entries of cpu_node
     int errcode;                        ///< any possible error code returned by library
 };
 
@@ -64,11 +228,110 @@ struct ctld_ctx{
 typedef struct ctld_ctx ctld_ctx;
 
 
+/**
+ * @details A string column in the Apache Arrow layout (utf8 or large_utf8).
+ * Row i is data[offsets[offset + i]] .. data[offsets[offset + i + 1]] and
+ * is null if bit (offset + i) of the validity bitmap is 0.
+ */
+struct ctld_column{
+    int64_t length;                     ///< number of rows
+    int64_t offset;                     ///< first row in the buffers (the Arrow array offset)
+    const uint8_t * validity;           ///< validity bitmap (LSB first) or NULL if no row is null
+    const void * offsets;               ///< offset + length + 1 offsets into data (int32_t or int64_t)
+    int large_offsets;                  ///< 1 if offsets are int64_t (large_utf8) and 0 if int32_t (utf8)
+    const char * data;                  ///< the bytes of all the strings
+};
+
+/**
+* @details Type definition of the struct ctld_column
+*/
+typedef struct ctld_column ctld_column;
+
+
+/**
+ * @details Position of an output value inside the data buffer of the input column.
+ */
+struct ctld_span{
+    int64_t start;                      ///< byte offset into ctld_column.data
+    int64_t len;                        ///< length in bytes or -1 if the value is null
+};
+
+/**
+* @details Type definition of the struct ctld_span
+*/
+typedef struct ctld_span ctld_span;
+
+
+/**
+ * @details One slot of the overlay table.
+ */
+typedef struct ctld_overlay_rule{
+    char * name;                        ///< lower-cased rule name (without "!"), NULL if the slot is empty
+    uint64_t hash;                      ///< hash of name
+    ctld_node * node;                   ///< the rule or NULL if the overlay removes this name
+} ctld_overlay_rule;
+
+
+/**
+ * @details Rules of one tenant on top of an immutable base context.
+ * The structure returns by calling ctld_overlay_init()
+ *
+ * The overlay only stores its own rules (in an open-addressing table which
+ * grows with the number of rules) and a pointer to the base context.
+ */
+struct ctld_overlay{
+    ctld_ctx * base;                    ///< shared context, never modified through the overlay
+    ctld_overlay_rule * rules;          ///< rules added or removed by this overlay
+    size_t size;                        ///< number of slots in rules (always a power of 2)
+    size_t len;                         ///< number of names stored in rules
+    int max_depth;                      ///< maximum number of labels in a rule of the overlay
+    int errcode;                        ///< any possible error code of the last overlay lookup
+};
+
+/**
+* @details Type definition of the struct ctld_overlay
+*/
+typedef struct ctld_overlay ctld_overlay;
+
+
+// sketches of csketch.h (only pointers are used here)
+struct _CSKETCH_TOPK;
+struct _CSKETCH_HLL;
+
+
 void ctld_print_error(ctld_ctx * ctx);
 ctld_ctx * ctld_parse_string(char * data);
 void ctld_result_free(ctld_result*);
 int ctld_is_domain_valid(char * domain);
 void ctld_free(ctld_ctx*);
 ctld_ctx * ctld_parse_file(char * filename);
+void ctld_options_init(ctld_options * options);
+ctld_ctx * ctld_ctx_create(const ctld_options * options);
+size_t ctld_ctx_memory_usage(const ctld_ctx * ctx);
+int ctld_ctx_replicate_numa(ctld_ctx * ctx);
+ctld_ctx * ctld_load_index(const void * data, size_t len);
+const void * ctld_index_data(const ctld_ctx * ctx, size_t * len);
 ctld_result * ctld_parse(ctld_ctx * ctx, char * domain, int use_private_suffix);
+ctld_result * ctld_parse_r(ctld_ctx * ctx, const char * domain, int use_private_suffix);
+long ctld_parse_parallel(ctld_ctx * ctx, const char ** hosts, size_t n, int use_private_suffix,
+                         ctld_result ** out, int nthreads);
 int ctld_add_custom_suffix(ctld_ctx * ctx, char * suffix);
+int ctld_add_rules_from_string(ctld_ctx * ctx, const char * data);
+int ctld_add_rules_from_buffer(ctld_ctx * ctx, const char * data, size_t len);
+int ctld_add_rules_from_file(ctld_ctx * ctx, char * filename);
+const char * ctld_result_field(const ctld_result * res, int field);
+int ctld_topk_add(struct _CSKETCH_TOPK * sketch, const ctld_result * res, int field);
+int ctld_distinct_add(struct _CSKETCH_HLL * sketch, const ctld_result * res, int field);
+int ctld_is_public_suffix(ctld_ctx * ctx, const char * domain, int use_private_suffix);
+int ctld_same_registered_domain(ctld_ctx * ctx, const char * domain1, const char * domain2, int use_private_suffix);
+long ctld_same_registered_domain_batch(ctld_ctx * ctx, const char ** domains1, const char ** domains2,
+                                       size_t n, int use_private_suffix, int * out);
+long ctld_parse_column(ctld_ctx * ctx, const ctld_column * column, int use_private_suffix,
+                       ctld_span * suffix, ctld_span * registered_domain, ctld_span * domain);
+int64_t ctld_column_gather(const ctld_column * column, const ctld_span * spans,
+                           int32_t * offsets, char * data, uint8_t * validity);
+ctld_overlay * ctld_overlay_init(ctld_ctx * base);
+void ctld_overlay_free(ctld_overlay * overlay);
+int ctld_overlay_add_rule(ctld_overlay * overlay, const char * rule, int is_private);
+int ctld_overlay_remove_rule(ctld_overlay * overlay, const char * rule);
+ctld_result * ctld_overlay_parse(ctld_overlay * overlay, char * domain, int use_private_suffix);
@@ -0,0 +1,82 @@
+# Tests pyctld (make python), then compares it with tldextract and measures
+# the speedup if a file is given.
+# Usage: PYTHONPATH=bin python3 pytest/test_pyctld.py [file-name]
+import os
+import sys
+import tempfile
+import time
+import pyctld
+
+
+def read_hosts(name):
+    with open(name) as f:
+        return [line.strip() for line in f if line.strip()]
+    # end with
+
+
+def test_parse():
+    result = pyctld.parse("https://www.google.co.uk/search")
+    assert result.registered_domain == "google.co.uk"
+    assert result.suffix == "co.uk"
+    assert pyctld.parse("co.uk").registered_domain is None
+    assert pyctld.parse("a.b.blogspot.com", private=True).is_private
+
+
+def test_parse_many():
+    hosts = ["www.bbc.co.uk", "x.y.ck", "www.city.kawasaki.jp"]
+    assert [r.registered_domain for r in pyctld.parse_many(hosts)] == [pyctld.parse(h).registered_domain for h in hosts]
+
+
+def test_parse_file():
+    with tempfile.NamedTemporaryFile("w", suffix=".txt", delete=False) as f:
+        f.write("www.google.co.uk\n\n  https://a.b.blogspot.com/x \r\nnosuchtld\n")
+    # end with
+    try:
+        results = list(pyctld.parse_file(f.name, private=True))
+    finally:
+        os.unlink(f.name)
+    # end try
+    assert [line for line, _ in results] == ["www.google.co.uk", "  https://a.b.blogspot.com/x", "nosuchtld"]
+    assert [r and r.registered_domain for _, r in results] == ["google.co.uk", "b.blogspot.com", None]
+
+
+if __name__ == "__main__":
+    if (len(sys.argv) > 2):
+        print("Usage: {} [file-name]".format(sys.argv[0]))
+        exit(1)
+    # end if
+    test_parse()
+    test_parse_many()
+    test_parse_file()
+    print("pyctld tests passed")
+    if (len(sys.argv) == 1):
+        exit(0)
+    # end if
+    hosts = read_hosts(sys.argv[1])
+    start = time.time()
+    results = pyctld.parse_many(hosts)
+    ctld_time = time.time() - start
+    print("pyctld.parse_many: {} hosts in {:.3f}s".format(len(hosts), ctld_time))
+    streamed = sum(1 for _ in pyctld.parse_file(sys.argv[1]))
+    assert streamed == len(hosts)
+    try:
+        import tldextract
+    except ImportError:
+        print("tldextract is not installed, skipping the comparison")
+        exit(0)
+    # end try
+    start = time.time()
+    expected = [tldextract.extract(h).registered_domain for h in hosts]
+    tldextract_time = time.time() - start
+    print("tldextract: {:.3f}s ({:.1f}x slower)".format(tldextract_time, tldextract_time / ctld_time))
+    mismatch = 0
+    for host, result, rd in zip(hosts, results, expected):
+        mine = result.registered_domain if result is not None else None
+        if (mine or "") != rd:
+            mismatch += 1
+            print("MISMATCH {}: {} != {}".format(host, mine, rd))
+        # end if
+    # end for
+    print("{} mismatches".format(mismatch))
+    exit(1 if mismatch else 0)
+# end if
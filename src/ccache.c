@@ -0,0 +1,225 @@
+///@file ccache.c
+
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <libctld.h>
+#include <csketch.h>
+#include <ccache.h>
+
+/****************Static declaration********************/
+static void * ccache_map(const char * filename, size_t * len, int * mapped);
+static void ccache_unmap(void * data, size_t len, int mapped);
+static char * ccache_path(const char * dir, uint64_t hash, int sections);
+static void ccache_store(const char * path, const ctld_ctx * ctx);
+
+
+/*
+ * Maps a file in memory (read-only). Files which can not be mapped (pipes,
+ * empty files) are read into a buffer instead; mapped tells which one
+ * ccache_unmap() must undo.
+ *
+ * Returns the data or NULL on failure.
+ */
+static void * ccache_map(const char * filename, size_t * len, int * mapped){
+    int fd = open(filename, O_RDONLY);
+    if (fd < 0)
+        return NULL;
+    struct stat st;
+    char * data = NULL;
+    *len = 0;
+    *mapped = 0;
+    if (fstat(fd, &st) == 0 && S_ISREG(st.st_mode) && st.st_size > 0){
+        data = (char*) mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (data != MAP_FAILED){
+            *len = st.st_size;
+            *mapped = 1;
+            close(fd);
+            return data;
+        }
+        data = NULL;
+    }
+    size_t size = 0;
+    for (;;){
+        if (*len == size){
+            size = size?size * 2:65536;
+            char * tmp = (char*) realloc(data, size);
+            if (!tmp)
+                break;
+            data = tmp;
+        }
+        ssize_t n = read(fd, data + *len, size - *len);
+        if (n == 0){
+            close(fd);
+            return data?data:malloc(1);
+        }
+        if (n < 0)
+            break;
+        *len += n;
+    }
+    free(data);
+    close(fd);
+    return NULL;
+}
+
+
+static void ccache_unmap(void * data, size_t len, int mapped){
+    if (mapped)
+        munmap(data, len);
+    else
+        free(data);
+}
+
+
+/*
+ * Name of the cached index of a list: <dir>/<hash>-<index version>-<sections>.idx
+ */
+static char * ccache_path(const char * dir, uint64_t hash, int sections){
+    size_t size = strlen(dir) + 64;
+    char * path = (char*) malloc(size);
+    if (!path)
+        return NULL;
+    snprintf(path, size, "%s/%016llx-%d-%d.idx", dir, (unsigned long long) hash, CTLD_INDEX_VERSION, sections);
+    return path;
+}
+
+
+/*
+ * Writes the index of ctx to path. The index goes to a temporary file which
+ * is renamed at the end, so concurrent runs never map a partial file.
+ * Errors are ignored: the cache is only an optimization.
+ */
+static void ccache_store(const char * path, const ctld_ctx * ctx){
+    size_t len = 0;
+    const void * data = ctld_index_data(ctx, &len);
+    if (!data)
+        return;
+    size_t size = strlen(path) + 32;
+    char * tmp = (char*) malloc(size);
+    if (!tmp)
+        return;
+    snprintf(tmp, size, "%s.%ld.tmp", path, (long) getpid());
+    FILE * fp = fopen(tmp, "wb");
+    if (fp){
+        int err = fwrite(data, 1, len, fp) != len;
+        err = fclose(fp) || err;
+        if (err || rename(tmp, path) != 0)
+            unlink(tmp);
+    }
+    free(tmp);
+}
+
+
+/**
+ * @brief returns the cache directory and creates it if needed.
+ *
+ * The directory is $XDG_CACHE_HOME/ctld or ~/.cache/ctld if XDG_CACHE_HOME
+ * is not set.
+ *
+ * @return the path (to be freed by the caller) or NULL if there is no
+ * usable cache directory.
+ */
+char * ccache_default_dir(void){
+    const char * base = getenv("XDG_CACHE_HOME");
+    const char * sub = "";
+    if (!base || base[0] == '\0'){
+        base = getenv("HOME");
+        sub = "/.cache";
+        if (!base || base[0] == '\0')
+            return NULL;
+    }
+    size_t size = strlen(base) + strlen(sub) + strlen(CCACHE_DIRNAME) + 2;
+    char * dir = (char*) malloc(size);
+    if (!dir)
+        return NULL;
+    // the parent may not exist yet either (e.g. a fresh ~/.cache)
+    snprintf(dir, size, "%s%s", base, sub);
+    if (mkdir(dir, 0700) != 0 && errno != EEXIST){
+        free(dir);
+        return NULL;
+    }
+    snprintf(dir, size, "%s%s/%s", base, sub, CCACHE_DIRNAME);
+    if (mkdir(dir, 0700) != 0 && errno != EEXIST){
+        free(dir);
+        return NULL;
+    }
+    return dir;
+}
+
+
+/**
+ * @brief creates a context from a PSL file, using the on-disk cache.
+ *
+ * @param psl_file the public suffix list (PSL syntax)
+ * @param sections the sections of the list to load (CTLD_SECTION_*)
+ * @param dir the cache directory or NULL to parse the list without the cache
+ *
+ * If the cache has a valid index of the same list, it is mapped in memory
+ * and nothing is parsed. Otherwise the list is parsed and its index is
+ * written to the cache for the next run.
+ *
+ * @return the cache context (free it with ccache_free()) or NULL on failure.
+ */
+ccache_ctx * ccache_open(const char * psl_file, int sections, const char * dir){
+    ccache_ctx * cache = (ccache_ctx*) calloc(1, sizeof(ccache_ctx));
+    if (!cache)
+        return NULL;
+    size_t len = 0;
+    int mapped = 0;
+    void * data = ccache_map(psl_file, &len, &mapped);
+    if (!data){
+        perror("ERROR");
+        free(cache);
+        return NULL;
+    }
+    char * path = dir?ccache_path(dir, csketch_fnv1a(data, len), sections):NULL;
+    if (path){
+        int cache_mapped = 0;
+        cache->map = ccache_map(path, &cache->map_len, &cache_mapped);
+        // a short read would not be aligned like the index needs
+        if (cache->map && cache_mapped)
+            cache->ctx = ctld_load_index(cache->map, cache->map_len);
+        if (cache->ctx){
+            cache->from_cache = 1;
+        }else if (cache->map){
+            // stale or damaged file: build the index again and replace it
+            ccache_unmap(cache->map, cache->map_len, cache_mapped);
+            cache->map = NULL;
+            cache->map_len = 0;
+        }
+    }
+    if (!cache->ctx){
+        ctld_options options;
+        ctld_options_init(&options);
+        options.data = (const char*) data;
+        options.len = len;
+        options.sections = sections;
+        if (len > 0)
+            cache->ctx = ctld_ctx_create(&options);
+        if (cache->ctx && path)
+            ccache_store(path, cache->ctx);
+    }
+    free(path);
+    ccache_unmap(data, len, mapped);
+    if (!cache->ctx){
+        ccache_free(cache);
+        return NULL;
+    }
+    return cache;
+}
+
+
+/**
+ * @brief frees the context and unmaps the cached index.
+ */
+void ccache_free(ccache_ctx * cache){
+    if (!cache)
+        return;
+    ctld_free(cache->ctx);
+    if (cache->map)
+        munmap(cache->map, cache->map_len);
+    free(cache);
+}
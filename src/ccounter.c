@@ -0,0 +1,223 @@
+///@file ccounter.c
+
+#include <string.h>
+#include <ccounter.h>
+#include <csketch.h>
+
+/*declare static functions*/
+static int ccounter_grow(ccounter_ctx * ctx);
+static int ccounter_item_cmp(const void * a, const void * b);
+static void ccounter_sift_down(PCCOUNTER_ITEM heap, size_t len, size_t i);
+/*****************************************/
+
+
+/**
+ * @brief orders items by descending count and then by key
+ */
+static int ccounter_item_cmp(const void * a, const void * b){
+    const CCOUNTER_ITEM * x = (const CCOUNTER_ITEM*) a;
+    const CCOUNTER_ITEM * y = (const CCOUNTER_ITEM*) b;
+    if (x->count != y->count)
+        return x->count > y->count?-1:1;
+    return strcmp(x->key, y->key);
+}
+
+
+/**
+ * @brief Initializes a new counter.
+ * @param size initial number of slots. Pass 0 to use #CCOUNTER_INITIAL_SIZE.
+ *
+ * The size is rounded up to a power of two. The table doubles whenever it
+ * becomes more than half full.
+ *
+ * @return A pointer to the counter context on success or NULL on failure
+ */
+ccounter_ctx * ccounter_init(size_t size){
+    size_t real_size = CCOUNTER_INITIAL_SIZE;
+    if (size){
+        real_size = 1;
+        while (real_size < size)
+            real_size <<= 1;
+    }
+    ccounter_ctx * ctx = (ccounter_ctx*) malloc(sizeof(ccounter_ctx));
+    if (!ctx)
+        return NULL;
+    ctx->table = (PCCOUNTER_ITEM) calloc(real_size, sizeof(CCOUNTER_ITEM));
+    ctx->hashes = (uint64_t*) calloc(real_size, sizeof(uint64_t));
+    if (!ctx->table || !ctx->hashes){
+        free(ctx->table);
+        free(ctx->hashes);
+        free(ctx);
+        return NULL;
+    }
+    ctx->size = real_size;
+    ctx->len = 0;
+    return ctx;
+}
+
+
+/**
+ * @brief Frees the counter and all the keys stored in it.
+ * @param ctx context returned by ccounter_init()
+ */
+void ccounter_free(ccounter_ctx * ctx){
+    if (!ctx)
+        return;
+    for (size_t i=0; i< ctx->size; ++i)
+        free(ctx->table[i].key);
+    free(ctx->table);
+    free(ctx->hashes);
+    free(ctx);
+    return;
+}
+
+
+/**
+ * @brief doubles the size of the table and re-inserts all the keys
+ */
+static int ccounter_grow(ccounter_ctx * ctx){
+    size_t new_size = ctx->size << 1;
+    PCCOUNTER_ITEM table = (PCCOUNTER_ITEM) calloc(new_size, sizeof(CCOUNTER_ITEM));
+    uint64_t * hashes = (uint64_t*) calloc(new_size, sizeof(uint64_t));
+    if (!table || !hashes){
+        free(table);
+        free(hashes);
+        return 1;
+    }
+    for (size_t i=0; i< ctx->size; ++i){
+        if (!ctx->table[i].key)
+            continue;
+        size_t pos = ctx->hashes[i] & (new_size - 1);
+        while (table[pos].key)
+            pos = (pos + 1) & (new_size - 1);
+        table[pos] = ctx->table[i];
+        hashes[pos] = ctx->hashes[i];
+    }
+    free(ctx->table);
+    free(ctx->hashes);
+    ctx->table = table;
+    ctx->hashes = hashes;
+    ctx->size = new_size;
+    return 0;
+}
+
+
+/**
+ * @brief Adds n to the counter of the given key.
+ * @param ctx context returned by ccounter_init()
+ * @param key null-terminated key. The key is copied on first insertion.
+ * @param n value to add to the counter
+ *
+ * @return 0 on success or 1 on failure
+ */
+int ccounter_add(ccounter_ctx * ctx, const char * key, uint64_t n){
+    if (!ctx || !key)
+        return 1;
+    uint64_t h = csketch_fnv1a_str(key);
+    size_t mask = ctx->size - 1;
+    size_t pos = h & mask;
+    while (ctx->table[pos].key){
+        if (ctx->hashes[pos] == h && strcmp(ctx->table[pos].key, key) == 0){
+            ctx->table[pos].count += n;
+            return 0;
+        }
+        pos = (pos + 1) & mask;
+    }
+    // new key
+    char * clone_key = strdup(key);
+    if (!clone_key)
+        return 1;
+    ctx->table[pos].key = clone_key;
+    ctx->table[pos].count = n;
+    ctx->hashes[pos] = h;
+    ctx->len++;
+    if (ctx->len * 2 > ctx->size)
+        return ccounter_grow(ctx);
+    return 0;
+}
+
+
+/**
+ * @brief Returns the current counter of the key (0 if the key does not exist)
+ */
+uint64_t ccounter_get(ccounter_ctx * ctx, const char * key){
+    if (!ctx || !key)
+        return 0;
+    uint64_t h = csketch_fnv1a_str(key);
+    size_t mask = ctx->size - 1;
+    size_t pos = h & mask;
+    while (ctx->table[pos].key){
+        if (ctx->hashes[pos] == h && strcmp(ctx->table[pos].key, key) == 0)
+            return ctx->table[pos].count;
+        pos = (pos + 1) & mask;
+    }
+    return 0;
+}
+
+
+static void ccounter_sift_down(PCCOUNTER_ITEM heap, size_t len, size_t i){
+    // min-heap where the "smallest" item is the one that sorts last
+    CCOUNTER_ITEM tmp;
+    while (1){
+        size_t l = 2 * i + 1, r = l + 1, m = i;
+        if (l < len && ccounter_item_cmp(&heap[l], &heap[m]) > 0)
+            m = l;
+        if (r < len && ccounter_item_cmp(&heap[r], &heap[m]) > 0)
+            m = r;
+        if (m == i)
+            return;
+        tmp = heap[i];
+        heap[i] = heap[m];
+        heap[m] = tmp;
+        i = m;
+    }
+}
+
+
+/**
+ * @brief Returns the k most frequent keys sorted by descending count.
+ * @param ctx context returned by ccounter_init()
+ * @param k number of items to return. Pass 0 to get all the items.
+ * @param out_len receives the number of items in the returned array
+ *
+ * When k is smaller than the number of keys, a min-heap of size k is used
+ * so we don't sort the whole table.
+ *
+ * The keys in the returned array still belong to the counter, so the caller
+ * must only free() the array itself and must not use it after ccounter_free().
+ *
+ * @return An array of items or NULL on failure (or if the counter is empty)
+ */
+PCCOUNTER_ITEM ccounter_top(ccounter_ctx * ctx, size_t k, size_t * out_len){
+    if (out_len)
+        *out_len = 0;
+    if (!ctx || ctx->len == 0)
+        return NULL;
+    if (k == 0 || k > ctx->len)
+        k = ctx->len;
+    PCCOUNTER_ITEM heap = (PCCOUNTER_ITEM) malloc(k * sizeof(CCOUNTER_ITEM));
+    if (!heap)
+        return NULL;
+    size_t len = 0;
+    for (size_t i=0; i< ctx->size; ++i){
+        if (!ctx->table[i].key)
+            continue;
+        if (len < k){
+            heap[len++] = ctx->table[i];
+            if (len == k){
+                // heapify
+                for (size_t j = k/2; j > 0; --j)
+                    ccounter_sift_down(heap, k, j - 1);
+            }
+            continue;
+        }
+        if (ccounter_item_cmp(&ctx->table[i], &heap[0]) < 0){
+            heap[0] = ctx->table[i];
+            ccounter_sift_down(heap, k, 0);
+        }
+    }
+    qsort(heap, len, sizeof(CCOUNTER_ITEM), ccounter_item_cmp);
+    if (out_len)
+        *out_len = len;
+    return heap;
+}
@@ -8,6 +8,7 @@ static int cto_lower(int c);
 static WORD * init_hash_table(void);
 static void shuffle(WORD * table, unsigned int);
 static unsigned int hashme(cdict_ctx*, char *);
+static unsigned int hashme_nocase(cdict_ctx*, const char *);
 static int cstr_ccmp(const char * str1, const char * str2);
 /*****************************************/
 
@@ -145,13 +146,30 @@ static unsigned int hashme(cdict_ctx * ctx, char * key){
     }
     unsigned long long int j;
     j=1;
-    for (unsigned int i=0; i< strlen(key); ++i){
+    for (unsigned int i=0; key[i]; ++i){
         j *= (WORD)key[i];
         j = (j % (TABLE_SIZE)) & 0xFFFF;
     }
     return ctx->hash_table[j];
 }
 
+
+/**
+ * @brief This is an internal function. You should never call this function.
+ *
+ * Same as hashme() but the key is lower-cased on the fly, so the result is
+ * the same as hashing a lower-case copy of the key.
+ */
+static unsigned int hashme_nocase(cdict_ctx * ctx, const char * key){
+    unsigned long long int j;
+    j=1;
+    for (unsigned int i=0; key[i]; ++i){
+        j *= (WORD)cto_lower(key[i]);
+        j = (j % (TABLE_SIZE)) & 0xFFFF;
+    }
+    return ctx->hash_table[j];
+}
+
 /**
  * @brief 
  * @param dict
@@ -207,32 +225,15 @@ void * cdict_get_nocase(cdict_ctx* ctx, char * key){
         strcpy(ctx->errmsg, "The key can not be null for a dictionary!");
         return NULL;
     }
-    // make sure you lower case the key first
-    char * clone_key  = strdup(key);
-    for (int i=0; clone_key[i]; i++)
-        clone_key[i] = cto_lower(clone_key[i]);
-
-    WORD index = hashme(ctx, clone_key);
-    if (ctx->err != ERROR_OK){
-        free(clone_key);
-        return NULL;
-    }
+    // hash the key as if it was lower case (without copying it)
+    WORD index = hashme_nocase(ctx, key);
     PNODE tmp = &(ctx->table[index]);
-    if (NULL == tmp){
-        free(clone_key);
-        return NULL;
-    }
     while(1){
-        if (NULL == tmp){
-            free(clone_key);
+        if (NULL == tmp)
             return NULL;
-        }
-        if (tmp->key == NULL){
-            free(clone_key);
+        if (tmp->key == NULL)
             return NULL;
-        }
-        if (cstr_ccmp(tmp->key, clone_key) == 0){
-            free(clone_key);
+        if (cstr_ccmp(tmp->key, key) == 0){
             return (void*)tmp->value;
         }else{
             tmp = tmp->next;
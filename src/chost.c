@@ -0,0 +1,95 @@
+///@file chost.c
+
+#include <string.h>
+#include <idn2.h>
+#include <libctld.h>
+#include <url_parser.h>
+#include <chost.h>
+
+#define CHOST_STACK_SIZE 256        ///< shorter inputs are copied to the stack
+
+/****************Static declaration********************/
+static int chost_is_ascii(const char * str);
+
+
+static int chost_is_ascii(const char * str){
+    while (*str){
+        if ((unsigned char)*str++ > 0x7F)
+            return 0;
+    }
+    return 1;
+}
+
+
+/**
+ * @brief removes leading spaces and tabs and trailing CR, LF, spaces, tabs
+ * and dots of a host.
+ *
+ * @param input the host, moved to the first kept character
+ * @param len length of the host
+ *
+ * @return the length of the trimmed host.
+ */
+size_t chost_trim(const char ** input, size_t len){
+    const char * str = *input;
+    while (len > 0 && (str[len-1] == '\r' || str[len-1] == '\n' || str[len-1] == ' ' ||
+                       str[len-1] == '\t' || str[len-1] == '.'))
+        len--;
+    while (len > 0 && (*str == ' ' || *str == '\t')){
+        str++;
+        len--;
+    }
+    *input = str;
+    return len;
+}
+
+
+/**
+ * @brief looks up the host of one input line, URL or field.
+ *
+ * @param ctx the context
+ * @param input the host, IDN or URL (not null-terminated, not modified)
+ * @param len length of input
+ * @param use_private 1 to use the private section of the PSL
+ * @param status set to one of CHOST_* (can be NULL)
+ *
+ * This is the lookup the command line tool, the Python module and the
+ * SQLite extension share: the input is trimmed with chost_trim(), the host is taken from the URL and
+ * IDNs are converted to ASCII. It uses ctld_parse_r(), so threads can share
+ * the context.
+ *
+ * @return the result (free it with ctld_result_free()) or NULL.
+ */
+struct ctld_result * chost_lookup(struct ctld_ctx * ctx, const char * input, size_t len,
+                                  int use_private, int * status){
+    int dummy;
+    if (!status)
+        status = &dummy;
+    len = chost_trim(&input, len);
+    *status = CHOST_EMPTY;
+    if (len == 0)
+        return NULL;
+    char stack_host[CHOST_STACK_SIZE];
+    char * host = len < sizeof(stack_host)?stack_host:(char*) malloc(len + 1);
+    *status = CHOST_NO_MATCH;
+    if (!host)
+        return NULL;
+    memcpy(host, input, len);
+    host[len] = '\0';
+    struct parsed_url * purl = parse_url(host);
+    char * name = purl?purl->host:host;
+    char * idn_out = NULL;
+    ctld_result * result = NULL;
+    if (!chost_is_ascii(name) && idna_to_ascii_8z(name, &idn_out, IDN2_NONTRANSITIONAL) != IDN2_OK){
+        *status = CHOST_IDN_FAILED;
+    }else{
+        result = ctld_parse_r(ctx, idn_out?idn_out:name, use_private);
+        *status = result?CHOST_OK:CHOST_NO_MATCH;
+    }
+    free(idn_out);
+    if (purl)
+        parsed_url_free(purl);
+    if (host != stack_host)
+        free(host);
+    return result;
+}
@@ -0,0 +1,147 @@
+///@file cmphf.c
+
+#include <string.h>
+#include <cmphf.h>
+
+/*declare static functions*/
+static int cmphf_u64_cmp(const void * a, const void * b);
+static int cmphf_place(cmphf * ctx, const uint64_t * hashes, const uint32_t * keys, uint32_t len,
+                       uint8_t * taken, uint32_t * slots, uint32_t * disp);
+/*****************************************/
+
+
+static int cmphf_u64_cmp(const void * a, const void * b){
+    uint64_t x = *(const uint64_t*) a;
+    uint64_t y = *(const uint64_t*) b;
+    return x < y?-1:x > y;
+}
+
+
+/*
+ * Finds a displacement which moves all the keys of one bucket to free
+ * slots and marks the slots as taken. Returns 0 on success.
+ */
+static int cmphf_place(cmphf * ctx, const uint64_t * hashes, const uint32_t * keys, uint32_t len,
+                       uint8_t * taken, uint32_t * slots, uint32_t * disp){
+    for (uint32_t d=0; d< CMPHF_MAX_DISPLACEMENT; ++d){
+        uint32_t i;
+        for (i=0; i< len; ++i){
+            uint32_t s = cmphf_slot_of(ctx, hashes[keys[i]], d);
+            if (taken[s])
+                break;
+            taken[s] = 1;
+            slots[keys[i]] = s;
+        }
+        if (i == len){
+            *disp = d;
+            return 0;
+        }
+        // undo the keys of this bucket already placed
+        while (i-- > 0)
+            taken[slots[keys[i]]] = 0;
+    }
+    return 1;
+}
+
+
+/**
+ * @brief number of buckets (and displacements) used for n keys
+ */
+uint32_t cmphf_buckets(uint32_t n){
+    return n / CMPHF_BUCKET_SIZE + 1;
+}
+
+
+/**
+ * @brief Builds a minimal perfect hash function over n distinct key hashes.
+ * @param ctx receives the function (ctx->disp is set to disp)
+ * @param hashes 64-bit hash of each key
+ * @param n number of keys
+ * @param disp array of cmphf_buckets(n) displacements filled by the function
+ * @param slots array of n integers which receives the slot of each key (can be NULL)
+ * @param seed first seed tried (0 gives the default sequence of seeds)
+ *
+ * Buckets are placed from the largest to the smallest, so the expected
+ * work is about n log n slot computations.
+ *
+ * @return 0 on success, 1 if malloc() fails and 2 if two keys have the
+ * same hash (or no seed works).
+ */
+int cmphf_build(cmphf * ctx, const uint64_t * hashes, uint32_t n, uint32_t * disp, uint32_t * slots, uint64_t seed){
+    if (!ctx || !disp || (n && !hashes))
+        return 2;
+    ctx->n = n;
+    ctx->buckets = cmphf_buckets(n);
+    ctx->seed = 0;
+    ctx->disp = disp;
+    memset(disp, 0, ctx->buckets * sizeof(uint32_t));
+    if (n == 0)
+        return 0;
+    uint64_t * sorted = (uint64_t*) malloc(n * sizeof(uint64_t));
+    uint32_t * bucket_of = (uint32_t*) malloc(n * sizeof(uint32_t));
+    uint32_t * keys = (uint32_t*) malloc(n * sizeof(uint32_t));
+    uint32_t * start = (uint32_t*) calloc(ctx->buckets + 1, sizeof(uint32_t));
+    uint32_t * order = (uint32_t*) malloc(ctx->buckets * sizeof(uint32_t));
+    uint32_t * key_slots = slots?slots:(uint32_t*) malloc(n * sizeof(uint32_t));
+    uint8_t * taken = (uint8_t*) malloc(n);
+    int ret = 1;
+    if (!sorted || !bucket_of || !keys || !start || !order || !key_slots || !taken)
+        goto done;
+    memcpy(sorted, hashes, n * sizeof(uint64_t));
+    qsort(sorted, n, sizeof(uint64_t), cmphf_u64_cmp);
+    ret = 2;
+    for (uint32_t i=1; i< n; ++i){
+        if (sorted[i] == sorted[i - 1])
+            goto done;
+    }
+    for (uint32_t attempt=0; attempt< CMPHF_MAX_SEEDS; ++attempt){
+        ctx->seed = cmphf_mix(seed + attempt + 1);
+        // group the keys by bucket (counting sort)
+        memset(start, 0, (ctx->buckets + 1) * sizeof(uint32_t));
+        uint32_t max_len = 0;
+        for (uint32_t i=0; i< n; ++i){
+            bucket_of[i] = cmphf_bucket(ctx, hashes[i]);
+            start[bucket_of[i] + 1]++;
+        }
+        for (uint32_t b=0; b< ctx->buckets; ++b){
+            if (start[b + 1] > max_len)
+                max_len = start[b + 1];
+            start[b + 1] += start[b];
+        }
+        for (uint32_t i=0; i< n; ++i)
+            keys[start[bucket_of[i]]++] = i;
+        for (uint32_t b=ctx->buckets; b> 0; --b)
+            start[b] = start[b - 1];
+        start[0] = 0;
+        // buckets from the largest to the smallest
+        uint32_t len = 0;
+        for (uint32_t size=max_len; size> 0; --size){
+            for (uint32_t b=0; b< ctx->buckets; ++b){
+                if (start[b + 1] - start[b] == size)
+                    order[len++] = b;
+            }
+        }
+        memset(taken, 0, n);
+        memset(disp, 0, ctx->buckets * sizeof(uint32_t));
+        uint32_t i;
+        for (i=0; i< len; ++i){
+            uint32_t b = order[i];
+            if (cmphf_place(ctx, hashes, keys + start[b], start[b + 1] - start[b], taken, key_slots, &disp[b]))
+                break;
+        }
+        if (i == len){
+            ret = 0;
+            break;
+        }
+    }
+done:
+    free(sorted);
+    free(bucket_of);
+    free(keys);
+    free(start);
+    free(order);
+    if (key_slots != slots)
+        free(key_slots);
+    free(taken);
+    return ret;
+}
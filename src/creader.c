@@ -0,0 +1,545 @@
+///@file creader.c
+
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <creader.h>
+#ifdef HAVE_ZSTD
+#include <zstd.h>
+#endif
+
+// number of BGZF blocks decoded together (the raw buffer holds one more block)
+#define CREADER_BGZF_BATCH (CREADER_DEFAULT_SIZE / CREADER_BGZF_BLOCK)
+
+/**
+ * @details One BGZF block of a batch.
+ */
+typedef struct _CREADER_BLOCK{
+    const unsigned char * src;  ///< deflate data of the block
+    size_t src_len;             ///< size of src
+    char * dst;                 ///< where the decoded block goes
+    size_t dst_len;             ///< decoded size of the block (ISIZE)
+    uint32_t crc;               ///< CRC32 of the decoded block
+} CREADER_BLOCK;
+
+/**
+ * @details Work of one thread in a BGZF batch: blocks first, first + step, ...
+ */
+typedef struct _CREADER_WORKER{
+    CREADER_BLOCK * blocks;
+    size_t nblocks;
+    size_t first;
+    size_t step;
+    int err;
+} CREADER_WORKER;
+
+/*declare static functions*/
+static ssize_t creader_read(creader_ctx * ctx, void * dst, size_t cap);
+static int creader_raw_need(creader_ctx * ctx, size_t n);
+static void creader_raw_compact(creader_ctx * ctx);
+static void creader_detect(creader_ctx * ctx);
+static ssize_t creader_decode(creader_ctx * ctx, char * dst, size_t cap);
+static ssize_t creader_decode_plain(creader_ctx * ctx, char * dst, size_t cap);
+static ssize_t creader_decode_gzip(creader_ctx * ctx, char * dst, size_t cap);
+static ssize_t creader_decode_bgzf(creader_ctx * ctx, char * dst, size_t cap);
+static ssize_t creader_decode_zstd(creader_ctx * ctx, char * dst, size_t cap);
+static void * creader_bgzf_worker(void * arg);
+static void * creader_producer(void * arg);
+static int creader_fill(creader_ctx * ctx);
+/*****************************************/
+
+
+/**
+ * @brief reads at most cap bytes from the stream (whatever is available)
+ */
+static ssize_t creader_read(creader_ctx * ctx, void * dst, size_t cap){
+    ssize_t n;
+    do{
+        n = read(fileno(ctx->fp), dst, cap);
+    }while (n < 0 && errno == EINTR);
+    if (n < 0)
+        ctx->err = 1;
+    if (n <= 0)
+        ctx->in_eof = 1;
+    return n < 0?0:n;
+}
+
+
+/**
+ * @brief moves the bytes not consumed yet to the start of the raw buffer
+ */
+static void creader_raw_compact(creader_ctx * ctx){
+    if (ctx->in_pos == 0)
+        return;
+    memmove(ctx->in, ctx->in + ctx->in_pos, ctx->in_len - ctx->in_pos);
+    ctx->in_len -= ctx->in_pos;
+    ctx->in_pos = 0;
+}
+
+
+/**
+ * @brief makes sure at least n bytes after in_pos are in the raw buffer.
+ *
+ * The buffer is only compacted if the bytes don't fit after in_len, so
+ * pointers into the raw buffer stay valid as long as there is room.
+ *
+ * @return 1 if the n bytes are available and 0 otherwise
+ */
+static int creader_raw_need(creader_ctx * ctx, size_t n){
+    while (ctx->in_len - ctx->in_pos < n && !ctx->in_eof){
+        if (ctx->in_pos + n > ctx->in_size)
+            creader_raw_compact(ctx);
+        if (ctx->in_len == ctx->in_size)
+            return 0;
+        ctx->in_len += creader_read(ctx, ctx->in + ctx->in_len, ctx->in_size - ctx->in_len);
+    }
+    return ctx->in_len - ctx->in_pos >= n;
+}
+
+
+/**
+ * @brief finds the format of the input from its first bytes
+ */
+static void creader_detect(creader_ctx * ctx){
+    const unsigned char * p = ctx->in + ctx->in_pos;
+    size_t n = ctx->in_len - ctx->in_pos;
+    ctx->format = CREADER_PLAIN;
+    if (n >= 4 && p[0] == 0x28 && p[1] == 0xb5 && p[2] == 0x2f && p[3] == 0xfd){
+        ctx->format = CREADER_ZSTD;
+    }else if (n >= 2 && p[0] == 0x1f && p[1] == 0x8b){
+        ctx->format = CREADER_GZIP;
+        // BGZF: FEXTRA with a "BC" subfield of 2 bytes first
+        if (n >= 18 && (p[3] & 4) && (p[10] | p[11] << 8) >= 6 && p[12] == 'B' && p[13] == 'C' && p[14] == 2 && p[15] == 0)
+            ctx->format = CREADER_BGZF;
+    }
+}
+
+
+/**
+ * @brief Initializes a reader.
+ * @param fp the stream to read from (the reader does not close it)
+ * @param size size of the decoded buffer. Pass 0 to use #CREADER_DEFAULT_SIZE.
+ * @param threads number of threads for decoding. With 1 (or less) the input
+ * is decoded in the calling thread.
+ *
+ * The format of the input is detected here, so this function reads the
+ * first bytes of the stream.
+ *
+ * @return A pointer to the reader on success or NULL on failure (including
+ * zstd input without zstd support)
+ */
+creader_ctx * creader_init(FILE * fp, size_t size, int threads){
+    if (!fp)
+        return NULL;
+    creader_ctx * ctx = (creader_ctx*) calloc(1, sizeof(creader_ctx));
+    if (!ctx)
+        return NULL;
+    ctx->fp = fp;
+    ctx->threads = threads < 1?1:threads;
+    ctx->size = size?size:CREADER_DEFAULT_SIZE;
+    // the raw buffer must hold a whole batch of BGZF blocks
+    ctx->in_size = (CREADER_BGZF_BATCH + 1) * CREADER_BGZF_BLOCK;
+    ctx->in = (unsigned char*) malloc(ctx->in_size);
+    ctx->buf = (char*) malloc(ctx->size);
+    if (!ctx->in || !ctx->buf){
+        creader_free(ctx);
+        return NULL;
+    }
+    // plain text is known from its first byte, so a short first line typed
+    // (or piped) interactively is not held back waiting for more input
+    if (creader_raw_need(ctx, 1) && (ctx->in[ctx->in_pos] == 0x1f || ctx->in[ctx->in_pos] == 0x28))
+        creader_raw_need(ctx, 18);
+    creader_detect(ctx);
+    if (ctx->format == CREADER_GZIP || ctx->format == CREADER_BGZF){
+        ctx->zs = (z_stream*) calloc(1, sizeof(z_stream));
+        // 15 + 32: gzip or zlib header
+        if (!ctx->zs || inflateInit2(ctx->zs, 15 + 32) != Z_OK){
+            free(ctx->zs);
+            ctx->zs = NULL;
+            creader_free(ctx);
+            return NULL;
+        }
+    }
+    if (ctx->format == CREADER_ZSTD){
+#ifdef HAVE_ZSTD
+        ctx->zstd = ZSTD_createDStream();
+        if (!ctx->zstd || ZSTD_isError(ZSTD_initDStream((ZSTD_DStream*)ctx->zstd))){
+            creader_free(ctx);
+            return NULL;
+        }
+#else
+        creader_free(ctx);
+        return NULL;
+#endif
+    }
+    if (ctx->threads > 1 && ctx->format != CREADER_PLAIN){
+        // decode in a separate thread while the caller parses the lines
+        ctx->chunk_size = ctx->size;
+        for (int i=0; i< CREADER_CHUNKS; ++i){
+            ctx->chunks[i].data = (char*) malloc(ctx->chunk_size);
+            if (!ctx->chunks[i].data){
+                creader_free(ctx);
+                return NULL;
+            }
+        }
+        pthread_mutex_init(&ctx->lock, NULL);
+        pthread_cond_init(&ctx->cond, NULL);
+        if (pthread_create(&ctx->producer, NULL, creader_producer, ctx) != 0){
+            pthread_mutex_destroy(&ctx->lock);
+            pthread_cond_destroy(&ctx->cond);
+            creader_free(ctx);
+            return NULL;
+        }
+        ctx->pipelined = 1;
+    }
+    return ctx;
+}
+
+
+/**
+ * @brief copies what is left in the raw buffer and then reads the stream
+ */
+static ssize_t creader_decode_plain(creader_ctx * ctx, char * dst, size_t cap){
+    size_t left = ctx->in_len - ctx->in_pos;
+    if (left){
+        if (left > cap)
+            left = cap;
+        memcpy(dst, ctx->in + ctx->in_pos, left);
+        ctx->in_pos += left;
+        return left;
+    }
+    if (ctx->in_eof)
+        return 0;
+    return creader_read(ctx, dst, cap);
+}
+
+
+/**
+ * @brief decodes gzip members one after the other
+ */
+static ssize_t creader_decode_gzip(creader_ctx * ctx, char * dst, size_t cap){
+    z_stream * zs = ctx->zs;
+    while (1){
+        if (ctx->in_pos == ctx->in_len && !creader_raw_need(ctx, 1)){
+            if (ctx->partial)
+                return -1;      // truncated member
+            return 0;
+        }
+        zs->next_in = ctx->in + ctx->in_pos;
+        zs->avail_in = ctx->in_len - ctx->in_pos;
+        zs->next_out = (unsigned char*) dst;
+        zs->avail_out = cap;
+        int ret = inflate(zs, Z_NO_FLUSH);
+        if (zs->next_in != ctx->in + ctx->in_pos)
+            ctx->partial = 1;
+        ctx->in_pos = zs->next_in - ctx->in;
+        if (ret == Z_STREAM_END){
+            // the next member (if any) starts right after this one
+            inflateReset(zs);
+            ctx->partial = 0;
+        }else if (ret != Z_OK && ret != Z_BUF_ERROR){
+            return -1;
+        }
+        size_t produced = cap - zs->avail_out;
+        if (produced)
+            return produced;
+    }
+}
+
+
+static void * creader_bgzf_worker(void * arg){
+    CREADER_WORKER * w = (CREADER_WORKER*) arg;
+    z_stream zs;
+    memset(&zs, 0, sizeof(zs));
+    // raw deflate, the headers are parsed by the caller
+    if (inflateInit2(&zs, -15) != Z_OK){
+        w->err = 1;
+        return NULL;
+    }
+    for (size_t i = w->first; i < w->nblocks; i += w->step){
+        CREADER_BLOCK * b = &w->blocks[i];
+        inflateReset(&zs);
+        zs.next_in = (unsigned char*) b->src;
+        zs.avail_in = b->src_len;
+        zs.next_out = (unsigned char*) b->dst;
+        zs.avail_out = b->dst_len;
+        if (inflate(&zs, Z_FINISH) != Z_STREAM_END || zs.avail_out != 0 ||
+            crc32(0, (unsigned char*) b->dst, b->dst_len) != b->crc){
+            w->err = 1;
+            break;
+        }
+    }
+    inflateEnd(&zs);
+    return NULL;
+}
+
+
+/**
+ * @brief decodes a batch of BGZF blocks with ctx->threads threads.
+ *
+ * Every block has its compressed and decoded sizes in its header and
+ * trailer, so the blocks are independent and each one is written directly
+ * to its final place in dst.
+ */
+static ssize_t creader_decode_bgzf(creader_ctx * ctx, char * dst, size_t cap){
+    CREADER_BLOCK blocks[CREADER_BGZF_BATCH];
+    size_t max_blocks = cap / CREADER_BGZF_BLOCK;
+    size_t nblocks = 0, out_len = 0;
+    if (max_blocks > CREADER_BGZF_BATCH)
+        max_blocks = CREADER_BGZF_BATCH;
+    // pointers into the raw buffer must not move during the batch
+    creader_raw_compact(ctx);
+    while (nblocks < max_blocks && creader_raw_need(ctx, 18)){
+        const unsigned char * p = ctx->in + ctx->in_pos;
+        size_t xlen = p[10] | p[11] << 8;
+        if (p[0] != 0x1f || p[1] != 0x8b || p[2] != 8 || !(p[3] & 4) || xlen < 6 || p[12] != 'B' || p[13] != 'C')
+            return -1;      // not a BGZF block
+        size_t block_len = (p[16] | p[17] << 8) + 1;
+        size_t hdr_len = 12 + xlen;
+        if (block_len < hdr_len + 8 || !creader_raw_need(ctx, block_len))
+            return -1;
+        p = ctx->in + ctx->in_pos;
+        const unsigned char * trailer = p + block_len - 8;
+        blocks[nblocks].src = p + hdr_len;
+        blocks[nblocks].src_len = block_len - hdr_len - 8;
+        blocks[nblocks].crc = trailer[0] | trailer[1] << 8 | trailer[2] << 16 | (uint32_t)trailer[3] << 24;
+        blocks[nblocks].dst_len = trailer[4] | trailer[5] << 8 | trailer[6] << 16 | (uint32_t)trailer[7] << 24;
+        if (blocks[nblocks].dst_len > CREADER_BGZF_BLOCK)
+            return -1;
+        blocks[nblocks].dst = dst + out_len;
+        out_len += blocks[nblocks].dst_len;
+        ctx->in_pos += block_len;
+        nblocks++;
+    }
+    if (nblocks == 0)
+        return ctx->in_pos == ctx->in_len?0:-1;
+    int nworkers = ctx->threads < (int)nblocks?ctx->threads:(int)nblocks;
+    CREADER_WORKER workers[nworkers];
+    pthread_t tids[nworkers];
+    int started[nworkers];
+    for (int i=0; i< nworkers; ++i){
+        workers[i] = (CREADER_WORKER){blocks, nblocks, i, nworkers, 0};
+        started[i] = i && pthread_create(&tids[i], NULL, creader_bgzf_worker, &workers[i]) == 0;
+        // do this part in the current thread instead
+        if (i && !started[i])
+            creader_bgzf_worker(&workers[i]);
+    }
+    creader_bgzf_worker(&workers[0]);
+    int err = workers[0].err;
+    for (int i=1; i< nworkers; ++i){
+        if (started[i])
+            pthread_join(tids[i], NULL);
+        err |= workers[i].err;
+    }
+    return err?-1:(ssize_t)out_len;
+}
+
+
+/**
+ * @brief decodes zstd frames one after the other
+ */
+static ssize_t creader_decode_zstd(creader_ctx * ctx, char * dst, size_t cap){
+#ifdef HAVE_ZSTD
+    while (1){
+        if (ctx->in_pos == ctx->in_len && !creader_raw_need(ctx, 1)){
+            if (ctx->partial)
+                return -1;      // truncated frame
+            return 0;
+        }
+        ZSTD_inBuffer input = {ctx->in + ctx->in_pos, ctx->in_len - ctx->in_pos, 0};
+        ZSTD_outBuffer output = {dst, cap, 0};
+        size_t ret = ZSTD_decompressStream((ZSTD_DStream*)ctx->zstd, &output, &input);
+        if (ZSTD_isError(ret))
+            return -1;
+        ctx->in_pos += input.pos;
+        ctx->partial = ret != 0;    // 0 means the frame is complete
+        if (output.pos)
+            return output.pos;
+    }
+#else
+    return -1;
+#endif
+}
+
+
+/**
+ * @brief decodes the next part of the input into dst
+ * @return number of bytes written to dst, 0 at the end of input and -1 on error
+ */
+static ssize_t creader_decode(creader_ctx * ctx, char * dst, size_t cap){
+    switch (ctx->format){
+        case CREADER_GZIP:
+            return creader_decode_gzip(ctx, dst, cap);
+        case CREADER_BGZF:
+            // one member at a time is the same as plain gzip
+            if (ctx->threads > 1)
+                return creader_decode_bgzf(ctx, dst, cap);
+            return creader_decode_gzip(ctx, dst, cap);
+        case CREADER_ZSTD:
+            return creader_decode_zstd(ctx, dst, cap);
+        default:
+            return creader_decode_plain(ctx, dst, cap);
+    }
+}
+
+
+/**
+ * @brief the decoding thread: fills the chunks in order until the end of input
+ */
+static void * creader_producer(void * arg){
+    creader_ctx * ctx = (creader_ctx*) arg;
+    for (size_t i=0; ; i = (i + 1) % CREADER_CHUNKS){
+        PCREADER_CHUNK chunk = &ctx->chunks[i];
+        pthread_mutex_lock(&ctx->lock);
+        while (chunk->ready && !ctx->stop)
+            pthread_cond_wait(&ctx->cond, &ctx->lock);
+        int stop = ctx->stop;
+        pthread_mutex_unlock(&ctx->lock);
+        if (stop)
+            break;
+        ssize_t n = creader_decode(ctx, chunk->data, ctx->chunk_size);
+        pthread_mutex_lock(&ctx->lock);
+        chunk->len = n;
+        chunk->ready = 1;
+        pthread_cond_broadcast(&ctx->cond);
+        pthread_mutex_unlock(&ctx->lock);
+        if (n <= 0)
+            break;
+    }
+    return NULL;
+}
+
+
+/**
+ * @brief adds more decoded bytes to the buffer
+ * @return 0 on success and 1 at the end of input (or on error)
+ */
+static int creader_fill(creader_ctx * ctx){
+    if (ctx->eof)
+        return 1;
+    // keep the current (partial) line at the start of the buffer
+    if (ctx->pos){
+        memmove(ctx->buf, ctx->buf + ctx->pos, ctx->len - ctx->pos);
+        ctx->len -= ctx->pos;
+        ctx->pos = 0;
+    }
+    size_t need = ctx->pipelined?ctx->chunk_size:CREADER_BGZF_BLOCK;
+    if (ctx->size - ctx->len < need + 1){
+        // a long line, one byte is kept for the null terminator
+        size_t new_size = ctx->len + need + 1;
+        if (new_size < ctx->size * 2)
+            new_size = ctx->size * 2;
+        char * tmp = (char*) realloc(ctx->buf, new_size);
+        if (!tmp){
+            ctx->err = 1;
+            ctx->eof = 1;
+            return 1;
+        }
+        ctx->buf = tmp;
+        ctx->size = new_size;
+    }
+    ssize_t n;
+    if (ctx->pipelined){
+        PCREADER_CHUNK chunk = &ctx->chunks[ctx->next_chunk];
+        pthread_mutex_lock(&ctx->lock);
+        while (!chunk->ready)
+            pthread_cond_wait(&ctx->cond, &ctx->lock);
+        pthread_mutex_unlock(&ctx->lock);
+        n = chunk->len;
+        if (n <= 0){
+            // leave the chunk as it is, the decoding thread is done
+            ctx->err |= n < 0;
+            ctx->eof = 1;
+            return 1;
+        }
+        memcpy(ctx->buf + ctx->len, chunk->data, n);
+        pthread_mutex_lock(&ctx->lock);
+        chunk->ready = 0;
+        pthread_cond_broadcast(&ctx->cond);
+        pthread_mutex_unlock(&ctx->lock);
+        ctx->next_chunk = (ctx->next_chunk + 1) % CREADER_CHUNKS;
+    }else{
+        n = creader_decode(ctx, ctx->buf + ctx->len, ctx->size - ctx->len - 1);
+        if (n <= 0){
+            ctx->err |= n < 0;
+            ctx->eof = 1;
+            return 1;
+        }
+    }
+    ctx->len += n;
+    return 0;
+}
+
+
+/**
+ * @brief Returns the next line of the input.
+ * @param ctx context returned by creader_init()
+ * @param line receives a pointer to the line
+ *
+ * The line is null-terminated (the newline is replaced by '\0') and points
+ * into the buffer of the reader, so it can be modified in place but it is
+ * only valid until the next call.
+ *
+ * @return length of the line (without the newline) or -1 at the end of input
+ */
+ssize_t creader_getline(creader_ctx * ctx, char ** line){
+    if (!ctx || !line)
+        return -1;
+    while (1){
+        char * start = ctx->buf + ctx->pos;
+        char * nl = memchr(start + ctx->scanned, '\n', ctx->len - ctx->pos - ctx->scanned);
+        if (nl){
+            *nl = '\0';
+            *line = start;
+            ctx->pos = nl - ctx->buf + 1;
+            ctx->scanned = 0;
+            return nl - start;
+        }
+        ctx->scanned = ctx->len - ctx->pos;
+        if (creader_fill(ctx)){
+            if (ctx->pos == ctx->len)
+                return -1;
+            // the last line has no newline
+            ctx->buf[ctx->len] = '\0';
+            *line = ctx->buf + ctx->pos;
+            ssize_t n = ctx->len - ctx->pos;
+            ctx->pos = ctx->len;
+            ctx->scanned = 0;
+            return n;
+        }
+    }
+}
+
+
+/**
+ * @brief Stops the decoding thread (if any) and frees the reader.
+ * @return 0 if all the input was read and decoded correctly, 1 otherwise
+ */
+int creader_free(creader_ctx * ctx){
+    if (!ctx)
+        return 1;
+    if (ctx->pipelined){
+        pthread_mutex_lock(&ctx->lock);
+        ctx->stop = 1;
+        pthread_cond_broadcast(&ctx->cond);
+        pthread_mutex_unlock(&ctx->lock);
+        pthread_join(ctx->producer, NULL);
+        pthread_mutex_destroy(&ctx->lock);
+        pthread_cond_destroy(&ctx->cond);
+    }
+    for (int i=0; i< CREADER_CHUNKS; ++i)
+        free(ctx->chunks[i].data);
+    if (ctx->zs){
+        inflateEnd(ctx->zs);
+        free(ctx->zs);
+    }
+#ifdef HAVE_ZSTD
+    if (ctx->zstd)
+        ZSTD_freeDStream((ZSTD_DStream*)ctx->zstd);
+#endif
+    int err = ctx->err;
+    free(ctx->in);
+    free(ctx->buf);
+    free(ctx);
+    return err;
+}
@@ -0,0 +1,570 @@
+///@file csketch.c
+
+#include <string.h>
+#include <math.h>
+#include <csketch.h>
+
+/*declare static functions*/
+static void topk_heap_swap(csketch_topk * ctx, size_t a, size_t b);
+static void topk_sift_down(csketch_topk * ctx, size_t i);
+static void topk_sift_up(csketch_topk * ctx, size_t i);
+static int64_t topk_find(csketch_topk * ctx, const char * key, uint64_t h);
+static void topk_index_insert(csketch_topk * ctx, size_t item, uint64_t h);
+static void topk_index_remove(csketch_topk * ctx, size_t item);
+static int topk_set_key(csketch_topk * ctx, size_t item, const char * key);
+static int topk_item_cmp(const void * a, const void * b);
+static int fpset_grow(csketch_fpset * ctx);
+/*****************************************/
+
+
+/**
+ * @brief 64-bit FNV-1a hash of a buffer
+ *
+ * This is the hash all the modules share for hash tables, cache keys and
+ * shards. It is fast but its low bits are weak, see csketch_hash().
+ */
+uint64_t csketch_fnv1a(const void * data, size_t len){
+    const unsigned char * p = (const unsigned char*) data;
+    uint64_t h = CSKETCH_FNV_OFFSET;
+    for (size_t i=0; i< len; ++i)
+        h = CSKETCH_FNV_STEP(h, p[i]);
+    return h;
+}
+
+
+/**
+ * @brief 64-bit FNV-1a hash of a null-terminated key
+ */
+uint64_t csketch_fnv1a_str(const char * key){
+    uint64_t h = CSKETCH_FNV_OFFSET;
+    while (*key)
+        h = CSKETCH_FNV_STEP(h, *key++);
+    return h;
+}
+
+
+/**
+ * @brief 64-bit hash of a null-terminated key (FNV-1a followed by a mixer)
+ *
+ * The final mixing step makes every bit of the result depend on every
+ * input byte, which HyperLogLog relies on.
+ */
+uint64_t csketch_hash(const char * key){
+    uint64_t h = csketch_fnv1a_str(key);
+    h ^= h >> 30;
+    h *= 0xbf58476d1ce4e5b9ULL;
+    h ^= h >> 27;
+    h *= 0x94d049bb133111ebULL;
+    h ^= h >> 31;
+    return h;
+}
+
+
+/**
+ * @brief Initializes a Space-Saving top-k sketch.
+ * @param capacity number of counters. Memory usage is fixed by this value.
+ *
+ * To get a good estimation of the top k keys, use a capacity several
+ * times bigger than k.
+ *
+ * @return A pointer to the sketch on success or NULL on failure
+ */
+csketch_topk * csketch_topk_init(size_t capacity){
+    if (capacity == 0)
+        return NULL;
+    csketch_topk * ctx = (csketch_topk*) calloc(1, sizeof(csketch_topk));
+    if (!ctx)
+        return NULL;
+    ctx->index_size = 1;
+    while (ctx->index_size < capacity * 2)
+        ctx->index_size <<= 1;
+    ctx->capacity = capacity;
+    ctx->items = (PCSKETCH_ITEM) calloc(capacity, sizeof(CSKETCH_ITEM));
+    ctx->key_size = (size_t*) calloc(capacity, sizeof(size_t));
+    ctx->hashes = (uint64_t*) calloc(capacity, sizeof(uint64_t));
+    ctx->heap = (size_t*) calloc(capacity, sizeof(size_t));
+    ctx->heap_pos = (size_t*) calloc(capacity, sizeof(size_t));
+    ctx->index = (int64_t*) malloc(ctx->index_size * sizeof(int64_t));
+    if (!ctx->items || !ctx->key_size || !ctx->hashes || !ctx->heap || !ctx->heap_pos || !ctx->index){
+        csketch_topk_free(ctx);
+        return NULL;
+    }
+    for (size_t i=0; i< ctx->index_size; ++i)
+        ctx->index[i] = -1;
+    return ctx;
+}
+
+
+/**
+ * @brief Frees the top-k sketch and all the monitored keys.
+ */
+void csketch_topk_free(csketch_topk * ctx){
+    if (!ctx)
+        return;
+    if (ctx->items)
+        for (size_t i=0; i< ctx->len; ++i)
+            free(ctx->items[i].key);
+    free(ctx->items);
+    free(ctx->key_size);
+    free(ctx->hashes);
+    free(ctx->heap);
+    free(ctx->heap_pos);
+    free(ctx->index);
+    free(ctx);
+    return;
+}
+
+
+static void topk_heap_swap(csketch_topk * ctx, size_t a, size_t b){
+    size_t tmp = ctx->heap[a];
+    ctx->heap[a] = ctx->heap[b];
+    ctx->heap[b] = tmp;
+    ctx->heap_pos[ctx->heap[a]] = a;
+    ctx->heap_pos[ctx->heap[b]] = b;
+}
+
+
+static void topk_sift_down(csketch_topk * ctx, size_t i){
+    while (1){
+        size_t l = 2 * i + 1, r = l + 1, m = i;
+        if (l < ctx->len && ctx->items[ctx->heap[l]].count < ctx->items[ctx->heap[m]].count)
+            m = l;
+        if (r < ctx->len && ctx->items[ctx->heap[r]].count < ctx->items[ctx->heap[m]].count)
+            m = r;
+        if (m == i)
+            return;
+        topk_heap_swap(ctx, i, m);
+        i = m;
+    }
+}
+
+
+static void topk_sift_up(csketch_topk * ctx, size_t i){
+    while (i > 0){
+        size_t parent = (i - 1) / 2;
+        if (ctx->items[ctx->heap[parent]].count <= ctx->items[ctx->heap[i]].count)
+            return;
+        topk_heap_swap(ctx, i, parent);
+        i = parent;
+    }
+}
+
+
+static int64_t topk_find(csketch_topk * ctx, const char * key, uint64_t h){
+    size_t mask = ctx->index_size - 1;
+    size_t pos = h & mask;
+    while (ctx->index[pos] != -1){
+        int64_t item = ctx->index[pos];
+        if (ctx->hashes[item] == h && strcmp(ctx->items[item].key, key) == 0)
+            return item;
+        pos = (pos + 1) & mask;
+    }
+    return -1;
+}
+
+
+static void topk_index_insert(csketch_topk * ctx, size_t item, uint64_t h){
+    size_t mask = ctx->index_size - 1;
+    size_t pos = h & mask;
+    while (ctx->index[pos] != -1)
+        pos = (pos + 1) & mask;
+    ctx->index[pos] = item;
+    ctx->hashes[item] = h;
+}
+
+
+static void topk_index_remove(csketch_topk * ctx, size_t item){
+    // linear probing with backward-shift deletion (no tombstones)
+    size_t mask = ctx->index_size - 1;
+    size_t i = ctx->hashes[item] & mask;
+    while (ctx->index[i] != (int64_t)item)
+        i = (i + 1) & mask;
+    size_t j = i;
+    while (1){
+        ctx->index[i] = -1;
+        while (1){
+            j = (j + 1) & mask;
+            if (ctx->index[j] == -1)
+                return;
+            size_t home = ctx->hashes[ctx->index[j]] & mask;
+            // can the entry at j be moved to i?
+            if (i <= j ? (home <= i || home > j) : (home <= i && home > j))
+                break;
+        }
+        ctx->index[i] = ctx->index[j];
+        i = j;
+    }
+}
+
+
+static int topk_set_key(csketch_topk * ctx, size_t item, const char * key){
+    size_t len = strlen(key) + 1;
+    if (ctx->key_size[item] < len){
+        char * tmp = (char*) realloc(ctx->items[item].key, len);
+        if (!tmp)
+            return 1;
+        ctx->items[item].key = tmp;
+        ctx->key_size[item] = len;
+    }
+    memcpy(ctx->items[item].key, key, len);
+    return 0;
+}
+
+
+/**
+ * @brief Adds n occurrences of the key to the sketch.
+ * @param ctx context returned by csketch_topk_init()
+ * @param key null-terminated key
+ * @param n number of occurrences
+ *
+ * @return 0 on success or 1 on failure
+ */
+int csketch_topk_add(csketch_topk * ctx, const char * key, uint64_t n){
+    if (!ctx || !key)
+        return 1;
+    uint64_t h = csketch_hash(key);
+    ctx->total += n;
+    int64_t found = topk_find(ctx, key, h);
+    if (found != -1){
+        ctx->items[found].count += n;
+        topk_sift_down(ctx, ctx->heap_pos[found]);
+        return 0;
+    }
+    size_t item;
+    if (ctx->len < ctx->capacity){
+        item = ctx->len;
+        if (topk_set_key(ctx, item, key))
+            return 1;
+        ctx->items[item].count = n;
+        ctx->items[item].error = 0;
+        ctx->heap[ctx->len] = item;
+        ctx->heap_pos[item] = ctx->len;
+        ctx->len++;
+        topk_index_insert(ctx, item, h);
+        topk_sift_up(ctx, ctx->heap_pos[item]);
+        return 0;
+    }
+    // replace the key with the minimum count (the index still has the old hash on failure)
+    item = ctx->heap[0];
+    if (topk_set_key(ctx, item, key))
+        return 1;
+    topk_index_remove(ctx, item);
+    ctx->items[item].error = ctx->items[item].count;
+    ctx->items[item].count += n;
+    topk_index_insert(ctx, item, h);
+    topk_sift_down(ctx, 0);
+    return 0;
+}
+
+
+static int topk_item_cmp(const void * a, const void * b){
+    const CSKETCH_ITEM * x = (const CSKETCH_ITEM*) a;
+    const CSKETCH_ITEM * y = (const CSKETCH_ITEM*) b;
+    if (x->count != y->count)
+        return x->count > y->count?-1:1;
+    return strcmp(x->key, y->key);
+}
+
+
+/**
+ * @brief Returns the k keys with the highest estimated counts.
+ * @param ctx context returned by csketch_topk_init()
+ * @param k number of keys to return. Pass 0 to get all the monitored keys.
+ * @param out_len receives the number of items in the returned array
+ *
+ * The keys still belong to the sketch. The caller must only free() the
+ * returned array.
+ *
+ * @return An array sorted by descending count or NULL on failure
+ */
+PCSKETCH_ITEM csketch_topk_list(csketch_topk * ctx, size_t k, size_t * out_len){
+    if (out_len)
+        *out_len = 0;
+    if (!ctx || ctx->len == 0)
+        return NULL;
+    PCSKETCH_ITEM lst = (PCSKETCH_ITEM) malloc(ctx->len * sizeof(CSKETCH_ITEM));
+    if (!lst)
+        return NULL;
+    memcpy(lst, ctx->items, ctx->len * sizeof(CSKETCH_ITEM));
+    qsort(lst, ctx->len, sizeof(CSKETCH_ITEM), topk_item_cmp);
+    if (out_len)
+        *out_len = (k == 0 || k > ctx->len)?ctx->len:k;
+    return lst;
+}
+
+
+/**
+ * @brief Initializes a HyperLogLog sketch.
+ * @param precision number of index bits (between #CSKETCH_HLL_MIN_PRECISION
+ * and #CSKETCH_HLL_MAX_PRECISION). The sketch uses 2^precision bytes and the
+ * standard error of the estimation is about 1.04/sqrt(2^precision).
+ *
+ * @return A pointer to the sketch on success or NULL on failure
+ */
+csketch_hll * csketch_hll_init(int precision){
+    if (precision < CSKETCH_HLL_MIN_PRECISION || precision > CSKETCH_HLL_MAX_PRECISION)
+        return NULL;
+    csketch_hll * ctx = (csketch_hll*) malloc(sizeof(csketch_hll));
+    if (!ctx)
+        return NULL;
+    ctx->precision = precision;
+    ctx->registers = (uint8_t*) calloc((size_t)1 << precision, 1);
+    if (!ctx->registers){
+        free(ctx);
+        return NULL;
+    }
+    return ctx;
+}
+
+
+/**
+ * @brief Frees the HyperLogLog sketch.
+ */
+void csketch_hll_free(csketch_hll * ctx){
+    if (!ctx)
+        return;
+    free(ctx->registers);
+    free(ctx);
+    return;
+}
+
+
+/**
+ * @brief Adds a key to the HyperLogLog sketch.
+ * @return 0 on success or 1 on failure
+ */
+int csketch_hll_add(csketch_hll * ctx, const char * key){
+    if (!ctx || !key)
+        return 1;
+    uint64_t h = csketch_hash(key);
+    size_t idx = h >> (64 - ctx->precision);
+    // make sure we never count past the remaining bits
+    uint64_t w = (h << ctx->precision) | ((uint64_t)1 << (ctx->precision - 1));
+    uint8_t rank = __builtin_clzll(w) + 1;
+    if (rank > ctx->registers[idx])
+        ctx->registers[idx] = rank;
+    return 0;
+}
+
+
+/**
+ * @brief Merges src into dst so dst estimates the union of both streams.
+ * @return 0 on success or 1 if the sketches have different precisions
+ */
+int csketch_hll_merge(csketch_hll * dst, const csketch_hll * src){
+    if (!dst || !src || dst->precision != src->precision)
+        return 1;
+    size_t m = (size_t)1 << dst->precision;
+    for (size_t i=0; i< m; ++i)
+        if (src->registers[i] > dst->registers[i])
+            dst->registers[i] = src->registers[i];
+    return 0;
+}
+
+
+/**
+ * @brief Returns the estimated number of distinct keys added to the sketch.
+ */
+uint64_t csketch_hll_count(const csketch_hll * ctx){
+    if (!ctx)
+        return 0;
+    size_t m = (size_t)1 << ctx->precision;
+    double alpha;
+    switch (m){
+        case 16: alpha = 0.673; break;
+        case 32: alpha = 0.697; break;
+        case 64: alpha = 0.709; break;
+        default: alpha = 0.7213 / (1.0 + 1.079 / m); break;
+    }
+    double sum = 0.0;
+    size_t zeros = 0;
+    for (size_t i=0; i< m; ++i){
+        sum += ldexp(1.0, -ctx->registers[i]);
+        if (ctx->registers[i] == 0)
+            zeros++;
+    }
+    double estimate = alpha * m * m / sum;
+    // small range correction (linear counting)
+    if (estimate <= 2.5 * m && zeros)
+        estimate = m * log((double)m / zeros);
+    return (uint64_t)(estimate + 0.5);
+}
+
+
+/**
+ * @brief Initializes a fingerprint set.
+ * @param size initial number of slots. Pass 0 to use #CSKETCH_FPSET_INITIAL_SIZE.
+ *
+ * The table doubles whenever it becomes more than half full.
+ *
+ * @return A pointer to the set on success or NULL on failure
+ */
+csketch_fpset * csketch_fpset_init(size_t size){
+    size_t real_size = CSKETCH_FPSET_INITIAL_SIZE;
+    if (size){
+        real_size = 1;
+        while (real_size < size)
+            real_size <<= 1;
+    }
+    csketch_fpset * ctx = (csketch_fpset*) malloc(sizeof(csketch_fpset));
+    if (!ctx)
+        return NULL;
+    ctx->table = (uint64_t*) calloc(real_size, sizeof(uint64_t));
+    if (!ctx->table){
+        free(ctx);
+        return NULL;
+    }
+    ctx->size = real_size;
+    ctx->len = 0;
+    return ctx;
+}
+
+
+/**
+ * @brief Frees the fingerprint set.
+ */
+void csketch_fpset_free(csketch_fpset * ctx){
+    if (!ctx)
+        return;
+    free(ctx->table);
+    free(ctx);
+    return;
+}
+
+
+static int fpset_grow(csketch_fpset * ctx){
+    size_t new_size = ctx->size << 1;
+    uint64_t * table = (uint64_t*) calloc(new_size, sizeof(uint64_t));
+    if (!table)
+        return 1;
+    for (size_t i=0; i< ctx->size; ++i){
+        if (!ctx->table[i])
+            continue;
+        size_t pos = ctx->table[i] & (new_size - 1);
+        while (table[pos])
+            pos = (pos + 1) & (new_size - 1);
+        table[pos] = ctx->table[i];
+    }
+    free(ctx->table);
+    ctx->table = table;
+    ctx->size = new_size;
+    return 0;
+}
+
+
+/**
+ * @brief Adds the key to the set.
+ * @param ctx context returned by csketch_fpset_init()
+ * @param key null-terminated key
+ *
+ * The table grows before it gets more than half full. If that fails, keys
+ * are still added until the table is full.
+ *
+ * @return 1 if the key is new, 0 if it was already in the set and -1 on failure
+ */
+int csketch_fpset_add(csketch_fpset * ctx, const char * key){
+    if (!ctx || !key)
+        return -1;
+    uint64_t fp = csketch_hash(key);
+    if (fp == 0)        // 0 marks the empty slots
+        fp = 1;
+    size_t mask = ctx->size - 1;
+    size_t pos = fp & mask;
+    while (ctx->table[pos]){
+        if (ctx->table[pos] == fp)
+            return 0;
+        pos = (pos + 1) & mask;
+    }
+    if ((ctx->len + 1) * 2 > ctx->size){
+        if (fpset_grow(ctx) == 0){
+            mask = ctx->size - 1;
+            pos = fp & mask;
+            while (ctx->table[pos])
+                pos = (pos + 1) & mask;
+        }else if (ctx->len + 2 > ctx->size){
+            return -1;      // one slot always stays empty to end the probing
+        }
+    }
+    ctx->table[pos] = fp;
+    ctx->len++;
+    return 1;
+}
+
+
+/**
+ * @brief Initializes a Bloom filter.
+ * @param bytes size of the bit array in bytes
+ * @param hashes number of bits to set per key. Pass 0 to use #CSKETCH_BLOOM_HASHES.
+ *
+ * With 7 hashes, the false positive rate stays below 1% as long as
+ * there are at least 10 bits per distinct key.
+ *
+ * @return A pointer to the filter on success or NULL on failure
+ */
+csketch_bloom * csketch_bloom_init(size_t bytes, int hashes){
+    if (bytes == 0 || hashes < 0)
+        return NULL;
+    csketch_bloom * ctx = (csketch_bloom*) malloc(sizeof(csketch_bloom));
+    if (!ctx)
+        return NULL;
+    ctx->bits = (uint8_t*) calloc(bytes, 1);
+    if (!ctx->bits){
+        free(ctx);
+        return NULL;
+    }
+    ctx->nbits = (uint64_t)bytes * 8;
+    ctx->hashes = hashes?hashes:CSKETCH_BLOOM_HASHES;
+    return ctx;
+}
+
+
+/**
+ * @brief Frees the Bloom filter.
+ */
+void csketch_bloom_free(csketch_bloom * ctx){
+    if (!ctx)
+        return;
+    free(ctx->bits);
+    free(ctx);
+    return;
+}
+
+
+/**
+ * @brief Adds the key to the Bloom filter.
+ * @param ctx context returned by csketch_bloom_init()
+ * @param key null-terminated key
+ *
+ * The bit positions are derived from two 64-bit hashes (double hashing).
+ * Both are full 64-bit values, so positions above 2^32 are reached too and
+ * filters of any size keep their false positive rate.
+ *
+ * @return 1 if the key is new, 0 if it was (probably) seen before and -1 on failure
+ */
+int csketch_bloom_add(csketch_bloom * ctx, const char * key){
+    if (!ctx || !key)
+        return -1;
+    uint64_t h = csketch_fnv1a_str(key);
+    // two different mixers of the same FNV-1a hash (splitmix64 and murmur3)
+    uint64_t h1 = h ^ (h >> 30);
+    h1 *= 0xbf58476d1ce4e5b9ULL;
+    h1 ^= h1 >> 27;
+    h1 *= 0x94d049bb133111ebULL;
+    h1 ^= h1 >> 31;
+    uint64_t h2 = h ^ (h >> 33);
+    h2 *= 0xff51afd7ed558ccdULL;
+    h2 ^= h2 >> 33;
+    h2 *= 0xc4ceb9fe1a85ec53ULL;
+    h2 ^= h2 >> 33;
+    h2 |= 1;
+    int is_new = 0;
+    for (int i=0; i< ctx->hashes; ++i){
+        uint64_t bit = (h1 + i * h2) % ctx->nbits;
+        uint8_t mask = 1 << (bit & 7);
+        if (!(ctx->bits[bit >> 3] & mask)){
+            ctx->bits[bit >> 3] |= mask;
+            is_new = 1;
+        }
+    }
+    return is_new;
+}
@@ -3,19 +3,426 @@
 #include <stdlib.h>
 #include <cstrlib.h>
 #include <libctld.h>
-#include <url_parser.h>
+#include <csketch.h>
+#include <chost.h>
 #include <cmdparser.h>
-#include "psl_data.h"
-#include <idn2.h>
+#include <ccounter.h>
+#include <cwriter.h>
+#include <creader.h>
+#include <ccache.h>
+#include <unistd.h>
+#include <errno.h>
+#include <sys/stat.h>
+#include "psl_index.h"
 
 
 #define ISSTREQ(a,b)  (cstr_cmp(a,b)==0)
 #define BSETOPT(a,b,c) do{if(ISSTREQ(a,b)){c=1;}}while(0)
 
 #define CTLD_VERSION "0.1"
-#define PRINTIFSET(x) do{if(x){printf("%s", x);}}while(0)
 
+// appends len bytes of str to the output record, returns 1 if the record can not be allocated
+static int out_append_n(char ** out, size_t * size, size_t * len, const char * str, size_t str_len){
+    if (*len + str_len + 1 > *size){
+        size_t new_size = (*len + str_len + 1) * 2;
+        char * tmp = (char*) realloc(*out, new_size);
+        if (!tmp)
+            return 1;
+        *out = tmp;
+        *size = new_size;
+    }
+    if (str_len)
+        memcpy(*out + *len, str, str_len);
+    *len += str_len;
+    (*out)[*len] = '\0';
+    return 0;
+}
+
+// appends a null-terminated string (if any) to the output record
+static int out_append(char ** out, size_t * size, size_t * len, const char * str){
+    return out_append_n(out, size, len, str, str?strlen(str):0);
+}
+
+// appends a string as a quoted JSON string
+static int out_append_json(char ** out, size_t * size, size_t * len, const char * str){
+    char esc[8];
+    int err = out_append_n(out, size, len, "\"", 1);
+    while (str && *str){
+        const char * start = str;
+        while (*str && *str != '"' && *str != '\\' && (unsigned char)*str >= 0x20)
+            str++;
+        err |= out_append_n(out, size, len, start, str - start);
+        if (!*str)
+            break;
+        if (*str == '"' || *str == '\\'){
+            esc[0] = '\\';
+            esc[1] = *str;
+            err |= out_append_n(out, size, len, esc, 2);
+        }else{
+            snprintf(esc, sizeof(esc), "\\u%04x", (unsigned char)*str);
+            err |= out_append_n(out, size, len, esc, 6);
+        }
+        str++;
+    }
+    err |= out_append_n(out, size, len, "\"", 1);
+    return err;
+}
 
+// runs the lookup for a host name, IDN or URL (host is not modified)
+static ctld_result * lookup_host(ctld_ctx * ctx, const char * host, size_t len, int use_private, int print_err){
+    int status;
+    ctld_result * result = chost_lookup(ctx, host, len, use_private, &status);
+    if (print_err)
+        len = chost_trim(&host, len);
+    if (print_err && status == CHOST_IDN_FAILED)
+        fprintf(stderr, "ERROR: Can not parse IDN domain: %.*s\n", (int) len, host);
+    else if (print_err && status == CHOST_NO_MATCH)
+        fprintf(stderr, "ERROR: Can not parse: %.*s\n", (int) len, host);
+    return result;
+}
+
+// finds the n-th (starting from 1) field of a delimited record
+static char * find_field(char * record, size_t n, char delimiter, size_t * len){
+    char * start = record;
+    for (size_t i=1; i< n; ++i){
+        start = strchr(start, delimiter);
+        if (!start)
+            return NULL;
+        start++;
+    }
+    char * end = strchr(start, delimiter);
+    *len = end?(size_t)(end - start):strlen(start);
+    // simple CSV quoting: "host"
+    if (*len >= 2 && start[0] == '"' && start[*len - 1] == '"'){
+        start++;
+        *len -= 2;
+    }
+    return start;
+}
+
+static char * json_skip_ws(char * p){
+    while (*p == ' ' || *p == '\t' || *p == '\r' || *p == '\n')
+        p++;
+    return p;
+}
+
+// skips a JSON string starting at the opening quote, returns the closing quote
+static char * json_skip_string(char * p, int * escaped){
+    p++;
+    while (*p && *p != '"'){
+        if (*p == '\\'){
+            if (escaped)
+                *escaped = 1;
+            if (!*(++p))
+                return NULL;
+        }
+        p++;
+    }
+    return *p?p:NULL;
+}
+
+// skips any JSON value, returns the first character after the value
+static char * json_skip_value(char * p){
+    p = json_skip_ws(p);
+    if (*p == '"'){
+        p = json_skip_string(p, NULL);
+        return p?p + 1:NULL;
+    }
+    if (*p == '{' || *p == '['){
+        int depth = 0;
+        while (*p){
+            if (*p == '"'){
+                p = json_skip_string(p, NULL);
+                if (!p)
+                    return NULL;
+            }else if (*p == '{' || *p == '['){
+                depth++;
+            }else if (*p == '}' || *p == ']'){
+                if (--depth == 0)
+                    return p + 1;
+            }
+            p++;
+        }
+        return NULL;
+    }
+    // number, true, false or null
+    while (*p && *p != ',' && *p != '}' && *p != ']' && *p != ' ' && *p != '\t')
+        p++;
+    return p;
+}
+
+// finds the string value of a dotted key path (e.g. "query.name") in a JSON object
+static char * find_json_key(char * record, const char * path, size_t * len, int * escaped){
+    char * p = json_skip_ws(record);
+    const char * key = path;
+    while (1){
+        if (*p != '{')
+            return NULL;
+        const char * key_end = strchr(key, '.');
+        size_t key_len = key_end?(size_t)(key_end - key):strlen(key);
+        p = json_skip_ws(p + 1);
+        int found = 0;
+        while (*p == '"'){
+            char * name_end = json_skip_string(p, NULL);
+            if (!name_end)
+                return NULL;
+            found = ((size_t)(name_end - p - 1) == key_len && strncmp(p + 1, key, key_len) == 0);
+            p = json_skip_ws(name_end + 1);
+            if (*p != ':')
+                return NULL;
+            p = json_skip_ws(p + 1);
+            if (found)
+                break;
+            p = json_skip_value(p);
+            if (!p)
+                return NULL;
+            p = json_skip_ws(p);
+            if (*p == ',')
+                p = json_skip_ws(p + 1);
+        }
+        if (!found)
+            return NULL;
+        if (!key_end)
+            break;
+        key = key_end + 1;
+    }
+    if (*p != '"')
+        return NULL;
+    *escaped = 0;
+    char * end = json_skip_string(p, escaped);
+    if (!end)
+        return NULL;
+    *len = end - p - 1;
+    return p + 1;
+}
+
+static int hex_value(int c){
+    if (c >= '0' && c <= '9') return c - '0';
+    if (c >= 'a' && c <= 'f') return c - 'a' + 10;
+    if (c >= 'A' && c <= 'F') return c - 'A' + 10;
+    return -1;
+}
+
+// decodes a JSON string body (without quotes) into dst (dst must have len+1 bytes)
+static void json_unescape(const char * src, size_t len, char * dst){
+    const char * end = src + len;
+    while (src < end){
+        if (*src != '\\'){
+            *dst++ = *src++;
+            continue;
+        }
+        src++;
+        if (src >= end)
+            break;
+        switch (*src){
+            case 'b': *dst++ = '\b'; break;
+            case 'f': *dst++ = '\f'; break;
+            case 'n': *dst++ = '\n'; break;
+            case 'r': *dst++ = '\r'; break;
+            case 't': *dst++ = '\t'; break;
+            case 'u':{
+                unsigned int cp = 0;
+                int i;
+                for (i=1; i<= 4 && src + i < end && hex_value(src[i]) >= 0; ++i)
+                    cp = (cp << 4) | hex_value(src[i]);
+                src += i - 1;
+                // a \uXXXX escape never takes more bytes in UTF-8 than in JSON
+                if (cp < 0x80){
+                    *dst++ = cp;
+                }else if (cp < 0x800){
+                    *dst++ = 0xC0 | (cp >> 6);
+                    *dst++ = 0x80 | (cp & 0x3F);
+                }else{
+                    *dst++ = 0xE0 | (cp >> 12);
+                    *dst++ = 0x80 | ((cp >> 6) & 0x3F);
+                    *dst++ = 0x80 | (cp & 0x3F);
+                }
+                break;
+            }
+            default: *dst++ = *src; break;
+        }
+        src++;
+    }
+    *dst = '\0';
+}
+
+// appends the selected result columns to a delimited record
+static int append_columns(char ** out, size_t * size, size_t * len, ctld_result * result,
+                          int print_rd, int print_fqdn, int print_tld, char delimiter){
+    int err = 0;
+    if (print_rd){
+        err |= out_append_n(out, size, len, &delimiter, 1);
+        err |= out_append(out, size, len, result?result->registered_domain:NULL);
+    }
+    if (print_fqdn){
+        err |= out_append_n(out, size, len, &delimiter, 1);
+        err |= out_append(out, size, len, result?result->fqdn:NULL);
+    }
+    if (print_tld){
+        err |= out_append_n(out, size, len, &delimiter, 1);
+        err |= out_append(out, size, len, result?result->suffix:NULL);
+    }
+    return err;
+}
+
+// appends the selected result members to a JSON object (before the closing brace)
+static int append_json_members(char ** out, size_t * size, size_t * len, char * record, ctld_result * result,
+                               int print_rd, int print_fqdn, int print_tld){
+    char * close = strrchr(record, '}');
+    if (!close)
+        return out_append(out, size, len, record);
+    char * prev = close;
+    while (prev > record && (prev[-1] == ' ' || prev[-1] == '\t'))
+        prev--;
+    int need_comma = prev > record && prev[-1] != '{';
+    int err = out_append_n(out, size, len, record, close - record);
+    const char * names[] = {"ctld_rd", "ctld_fqdn", "ctld_tld"};
+    int selected[] = {print_rd, print_fqdn, print_tld};
+    const char * values[] = {result?result->registered_domain:NULL, result?result->fqdn:NULL, result?result->suffix:NULL};
+    for (int i=0; i< 3; ++i){
+        if (!selected[i])
+            continue;
+        if (need_comma)
+            err |= out_append_n(out, size, len, ",", 1);
+        need_comma = 1;
+        err |= out_append_json(out, size, len, names[i]);
+        err |= out_append_n(out, size, len, ":", 1);
+        if (values[i])
+            err |= out_append_json(out, size, len, values[i]);
+        else
+            err |= out_append_n(out, size, len, "null", 4);
+    }
+    err |= out_append(out, size, len, close);
+    return err;
+}
+
+#define FORMAT_TEXT 0
+#define FORMAT_JSONL 1
+#define FORMAT_BINARY 2
+
+// maximum length of a field in the binary format (0xFFFF means NULL)
+#define BINARY_MAX_FIELD 0xFFFE
+
+// appends one field of the binary format: u16 little-endian length and the bytes
+static int out_append_binary(char ** out, size_t * size, size_t * len, const char * str){
+    size_t str_len = str?strlen(str):0;
+    unsigned char hdr[2] = {0xFF, 0xFF};
+    if (str_len > BINARY_MAX_FIELD)
+        str_len = BINARY_MAX_FIELD;
+    if (str){
+        hdr[0] = str_len & 0xFF;
+        hdr[1] = (str_len >> 8) & 0xFF;
+    }
+    int err = out_append_n(out, size, len, (char*)hdr, 2);
+    err |= out_append_n(out, size, len, str, str_len);
+    return err;
+}
+
+// builds one output record in JSON-lines or binary format, returns 1 if it can not be allocated
+static int build_record(char ** out, size_t * size, size_t * len, int format, const char * input, ctld_result * result){
+    const char * names[] = {"input", "fqdn", "registered_domain", "domain", "suffix",
+                            "rule", "section", "rule_type", "icann_registered_domain", "icann_suffix"};
+    const char * rule_type = result->is_exception?"exception":(result->is_wildcard?"wildcard":"exact");
+    const char * values[] = {input, result->fqdn, result->registered_domain, result->domain, result->suffix,
+                             result->rule, result->is_private?"private":"icann", rule_type,
+                             result->icann_registered_domain, result->icann_suffix};
+    int nfields = sizeof(values) / sizeof(values[0]);
+    *len = 0;
+    int err = 0;
+    if (format == FORMAT_JSONL){
+        err |= out_append_n(out, size, len, "{", 1);
+        for (int i=0; i< nfields; ++i){
+            if (i)
+                err |= out_append_n(out, size, len, ",", 1);
+            err |= out_append_json(out, size, len, names[i]);
+            err |= out_append_n(out, size, len, ":", 1);
+            if (values[i])
+                err |= out_append_json(out, size, len, values[i]);
+            else
+                err |= out_append_n(out, size, len, "null", 4);
+        }
+        err |= out_append_n(out, size, len, "}\n", 2);
+        return err;
+    }
+    // u32 record length (filled at the end), u8 number of fields, then the fields
+    unsigned char hdr[5] = {0, 0, 0, 0, nfields};
+    err |= out_append_n(out, size, len, (char*)hdr, 5);
+    for (int i=0; i< nfields; ++i)
+        err |= out_append_binary(out, size, len, values[i]);
+    if (err)
+        return err;
+    size_t rec_len = *len - 4;
+    (*out)[0] = rec_len & 0xFF;
+    (*out)[1] = (rec_len >> 8) & 0xFF;
+    (*out)[2] = (rec_len >> 16) & 0xFF;
+    (*out)[3] = (rec_len >> 24) & 0xFF;
+    return 0;
+}
+
+// number of Space-Saving counters per requested top-k key
+#define TOPK_CAPACITY_FACTOR 8
+
+
+#define MAX_SHARDS 1024
+// memory for the output buffers of all the shards together
+#define SHARD_BUFFERS_TOTAL 0x4000000
+
+// picks the shard of a key (case-insensitive FNV-1a)
+static size_t shard_of(const char * key, size_t shards){
+    uint64_t h = CSKETCH_FNV_OFFSET;
+    if (!key)
+        return 0;
+    for (; *key; ++key)
+        h = CSKETCH_FNV_STEP(h, *key >= 'A' && *key <= 'Z'?*key + 'a' - 'A':*key);
+    h ^= h >> 33;
+    return h % shards;
+}
+
+// creates dir/part-NNNNN.ext files and one async writer for each of them,
+// all written by the threads of pool
+static cwriter_ctx ** open_shards(const char * dir, size_t shards, int format, cwriter_pool * pool, FILE *** files){
+    const char * ext = format == FORMAT_JSONL?"jsonl":(format == FORMAT_BINARY?"bin":"txt");
+    size_t buffer_size = SHARD_BUFFERS_TOTAL / shards / 2;
+    if (buffer_size > CWRITER_DEFAULT_SIZE)
+        buffer_size = CWRITER_DEFAULT_SIZE;
+    if (mkdir(dir, 0755) != 0 && errno != EEXIST){
+        perror("ERROR: Can not create the output directory");
+        return NULL;
+    }
+    cwriter_ctx ** writers = (cwriter_ctx**) calloc(shards, sizeof(cwriter_ctx*));
+    *files = (FILE**) calloc(shards, sizeof(FILE*));
+    size_t path_len = strlen(dir) + 32;
+    char * path = (char*) malloc(path_len);
+    if (!writers || !*files || !path){
+        free(writers);
+        free(*files);
+        free(path);
+        return NULL;
+    }
+    for (size_t i=0; i< shards; ++i){
+        snprintf(path, path_len, "%s/part-%05zu.%s", dir, i, ext);
+        (*files)[i] = fopen(path, "w");
+        if (!(*files)[i]){
+            perror(path);
+            break;
+        }
+        writers[i] = cwriter_init_pooled((*files)[i], buffer_size, pool);
+        if (!writers[i])
+            break;
+    }
+    free(path);
+    if (!writers[shards - 1]){
+        for (size_t i=0; i< shards; ++i){
+            cwriter_free(writers[i]);
+            if ((*files)[i])
+                fclose((*files)[i]);
+        }
+        free(writers);
+        free(*files);
+        return NULL;
+    }
+    return writers;
+}
 
 int main(int argc, char ** argv){
     // maybe replace it with getopt which is standard?
@@ -30,6 +437,22 @@ int main(int argc, char ** argv){
         {.short_option=0, .long_option = "private", .has_param = NO_PARAM, .help="Use private suffix list as well", .tag="use_private"},
         {.short_option=0, .long_option = "err", .has_param = NO_PARAM, .help="Print Errors only", .tag="print_err"},
         {.short_option=0, .long_option = "custom", .has_param = HAS_PARAM, .help="Add a comma-separated list of custom suffixes (no space)", .tag="custom_suffix"},
+        {.short_option=0, .long_option = "rules-file", .has_param = HAS_PARAM, .help="Add the rules of file <param> (PSL syntax) to the suffix list", .tag="rules_file"},
+        {.short_option=0, .long_option = "psl", .has_param = HAS_PARAM, .help="Use the public suffix list of file <param> instead of the embedded one (cached in $XDG_CACHE_HOME/ctld)", .tag="psl_file"},
+        {.short_option=0, .long_option = "count", .has_param = HAS_PARAM, .help="Count occurrences of tld, rd or domain and print count<TAB>key at the end", .tag="count_by"},
+        {.short_option=0, .long_option = "limit", .has_param = HAS_PARAM, .help="Only print the <param> most frequent keys (with --count)", .tag="count_limit"},
+        {.short_option=0, .long_option = "topk", .has_param = HAS_PARAM, .help="Estimate the <param> most frequent keys (rd or --count key) with bounded memory", .tag="topk"},
+        {.short_option=0, .long_option = "distinct", .has_param = NO_PARAM, .help="Estimate the number of distinct registered domains and suffixes", .tag="distinct"},
+        {.short_option=0, .long_option = "unique", .has_param = NO_PARAM, .help="Only print the first occurrence of each output record", .tag="unique"},
+        {.short_option=0, .long_option = "unique-bloom", .has_param = HAS_PARAM, .help="Like --unique but with a Bloom filter of <param> MB (approximate)", .tag="unique_bloom"},
+        {.short_option=0, .long_option = "field", .has_param = HAS_PARAM, .help="Read the host from field <param> (starting from 1) of each record and append the result columns", .tag="field"},
+        {.short_option=0, .long_option = "delimiter", .has_param = HAS_PARAM, .help="Field delimiter for --field (default is \\t)", .tag="delimiter"},
+        {.short_option=0, .long_option = "json-key", .has_param = HAS_PARAM, .help="Read the host from the (dotted) key <param> of each JSON record and add ctld_* members", .tag="json_key"},
+        {.short_option=0, .long_option = "format", .has_param = HAS_PARAM, .help="Output format: text (default), jsonl or binary", .tag="format"},
+        {.short_option=0, .long_option = "output-dir", .has_param = HAS_PARAM, .help="Write the output to files in directory <param> instead of stdout", .tag="output_dir"},
+        {.short_option=0, .long_option = "shards", .has_param = HAS_PARAM, .help="Number of output files in --output-dir (default is 1)", .tag="shards"},
+        {.short_option=0, .long_option = "shard-by", .has_param = HAS_PARAM, .help="Assign the records to the output files by rd (default) or tld", .tag="shard_by"},
+        {.short_option=0, .long_option = "threads", .has_param = HAS_PARAM, .help="Number of threads to decompress gzip/bgzf/zstd input and to write the --shards files (default is the number of CPUs)", .tag="threads"},
         {.short_option='h', .long_option = "help", .has_param = NO_PARAM, .help="Print this help message", .tag="print_help"},
         {.short_option='v', .long_option = "version", .has_param = NO_PARAM, .help="Print suffix", .tag="print_version"},
         {.short_option=0, .long_option = "", .has_param = NO_PARAM, .help="", .tag=NULL}
@@ -60,6 +483,137 @@ int main(int argc, char ** argv){
     if (arg_is_tag_set(pargs, "custom_suffix")){
         custom_suffix = strdup(arg_get_tag_value(pargs, "custom_suffix"));
     }
+    char * rules_file = NULL;
+    if (arg_is_tag_set(pargs, "rules_file")){
+        rules_file = strdup(arg_get_tag_value(pargs, "rules_file"));
+    }
+    char * psl_file = NULL;
+    if (arg_is_tag_set(pargs, "psl_file")){
+        psl_file = strdup(arg_get_tag_value(pargs, "psl_file"));
+    }
+    int count_by = 0;
+    size_t count_limit = 0;
+    size_t topk = 0;
+    int distinct = arg_is_tag_set(pargs, "distinct")?1:0;
+    int unique = arg_is_tag_set(pargs, "unique")?1:0;
+    size_t unique_bloom_mb = 0;
+    if (arg_is_tag_set(pargs, "unique_bloom")){
+        unique_bloom_mb = strtoul(arg_get_tag_value(pargs, "unique_bloom"), NULL, 10);
+        if (unique_bloom_mb == 0){
+            fprintf(stderr, "ERROR: --unique-bloom must be a positive number\n");
+            arg_free(pargs);
+            return 1;
+        }
+    }
+    if (arg_is_tag_set(pargs, "count_by")){
+        const char * by = arg_get_tag_value(pargs, "count_by");
+        if (strcmp(by, "tld") == 0)
+            count_by = CTLD_FIELD_SUFFIX;
+        else if (strcmp(by, "rd") == 0)
+            count_by = CTLD_FIELD_RD;
+        else if (strcmp(by, "domain") == 0)
+            count_by = CTLD_FIELD_DOMAIN;
+        else{
+            fprintf(stderr, "ERROR: --count must be one of tld, rd or domain\n");
+            arg_free(pargs);
+            return 1;
+        }
+    }
+    if (arg_is_tag_set(pargs, "count_limit")){
+        count_limit = strtoul(arg_get_tag_value(pargs, "count_limit"), NULL, 10);
+    }
+    if (arg_is_tag_set(pargs, "topk")){
+        topk = strtoul(arg_get_tag_value(pargs, "topk"), NULL, 10);
+        if (topk == 0){
+            fprintf(stderr, "ERROR: --topk must be a positive number\n");
+            arg_free(pargs);
+            return 1;
+        }
+        if (count_by == 0)
+            count_by = CTLD_FIELD_RD;
+    }
+    size_t field = 0;
+    char delimiter = '\t';
+    char * json_key = NULL;
+    if (arg_is_tag_set(pargs, "field")){
+        field = strtoul(arg_get_tag_value(pargs, "field"), NULL, 10);
+        if (field == 0){
+            fprintf(stderr, "ERROR: --field must be a positive number\n");
+            arg_free(pargs);
+            return 1;
+        }
+    }
+    if (arg_is_tag_set(pargs, "delimiter")){
+        const char * delim = arg_get_tag_value(pargs, "delimiter");
+        if (strcmp(delim, "\\t") == 0 || strcmp(delim, "tab") == 0)
+            delimiter = '\t';
+        else
+            delimiter = delim[0];
+    }
+    if (arg_is_tag_set(pargs, "json_key")){
+        json_key = strdup(arg_get_tag_value(pargs, "json_key"));
+    }
+    int format = FORMAT_TEXT;
+    if (arg_is_tag_set(pargs, "format")){
+        const char * fmt = arg_get_tag_value(pargs, "format");
+        if (strcmp(fmt, "text") == 0)
+            format = FORMAT_TEXT;
+        else if (strcmp(fmt, "jsonl") == 0)
+            format = FORMAT_JSONL;
+        else if (strcmp(fmt, "binary") == 0)
+            format = FORMAT_BINARY;
+        else{
+            fprintf(stderr, "ERROR: --format must be one of text, jsonl or binary\n");
+            arg_free(pargs);
+            return 1;
+        }
+        if (format != FORMAT_TEXT && (field || json_key)){
+            fprintf(stderr, "ERROR: --format can not be used with --field or --json-key\n");
+            arg_free(pargs);
+            return 1;
+        }
+    }
+    long threads = sysconf(_SC_NPROCESSORS_ONLN);
+    if (arg_is_tag_set(pargs, "threads")){
+        threads = strtol(arg_get_tag_value(pargs, "threads"), NULL, 10);
+        if (threads <= 0){
+            fprintf(stderr, "ERROR: --threads must be a positive number\n");
+            arg_free(pargs);
+            return 1;
+        }
+    }
+    if (threads < 1)
+        threads = 1;
+    char * output_dir = NULL;
+    size_t shards = 1;
+    int shard_by = CTLD_FIELD_RD;
+    if (arg_is_tag_set(pargs, "shards")){
+        shards = strtoul(arg_get_tag_value(pargs, "shards"), NULL, 10);
+        if (shards == 0 || shards > MAX_SHARDS){
+            fprintf(stderr, "ERROR: --shards must be between 1 and %d\n", MAX_SHARDS);
+            arg_free(pargs);
+            return 1;
+        }
+    }
+    if (arg_is_tag_set(pargs, "shard_by")){
+        const char * by = arg_get_tag_value(pargs, "shard_by");
+        if (strcmp(by, "rd") == 0)
+            shard_by = CTLD_FIELD_RD;
+        else if (strcmp(by, "tld") == 0)
+            shard_by = CTLD_FIELD_SUFFIX;
+        else{
+            fprintf(stderr, "ERROR: --shard-by must be rd or tld\n");
+            arg_free(pargs);
+            return 1;
+        }
+    }
+    if (arg_is_tag_set(pargs, "output_dir")){
+        output_dir = strdup(arg_get_tag_value(pargs, "output_dir"));
+    }else if (arg_is_tag_set(pargs, "shards") || arg_is_tag_set(pargs, "shard_by")){
+        fprintf(stderr, "ERROR: --shards and --shard-by need --output-dir\n");
+        arg_free(pargs);
+        return 1;
+    }
     // we don't need pargs anymore, we can free the memory
     // just make valgrind shutup
     arg_free(pargs);
@@ -74,164 +628,300 @@ int main(int argc, char ** argv){
         perror("Error opening input file");
         return 1;
     }
+    // compressed input is detected and decoded by the reader
+    creader_ctx * reader = creader_init(fp, 0, (int)threads);
+    if (!reader){
+        fprintf(stderr, "ERROR: Can not read the input (zstd input needs a build with HAVE_ZSTD=1)\n");
+        return 1;
+    }
     // set this as the default option
     if (print_rd == 0 && print_tld == 0 && print_fqdn == 0)
         print_rd = 1;
 
     char * l = NULL;
-    char * psl_data = (char*)malloc(psl_dat_len + 1);
-    if (!psl_data){
-        fprintf(stderr, "ERROR: malloc() failed!\n");
-        return 1;
+    // the rule index of the PSL is built at compile time; without --private
+    // the smaller index of the ICANN section is enough
+    ctld_ctx * ctx = NULL;
+    ccache_ctx * psl_cache = NULL;
+    if (psl_file){
+        // the index of the list is cached, so only the first run parses it
+        char * cache_dir = ccache_default_dir();
+        psl_cache = ccache_open(psl_file, use_private?CTLD_SECTION_ALL:CTLD_SECTION_ICANN, cache_dir);
+        free(cache_dir);
+        free(psl_file);
+        ctx = psl_cache?psl_cache->ctx:NULL;
+    }else{
+        ctx = use_private?ctld_load_index(psl_index, psl_index_len):ctld_load_index(psl_index_icann, psl_index_icann_len);
     }
-    memcpy(psl_data, psl_dat, psl_dat_len);
-    psl_data[psl_dat_len] = '\0';
-    ctld_ctx * ctx = ctld_parse_string((char*)psl_dat);
-    free(psl_data);
     if (!ctx){
         fprintf(stderr, "Can not create the context for public suffix list!\n");
         return 2;
     }
-    // add custom suffix if any
+    // add the rules of the rules file if any
+    if (rules_file){
+        int added = ctld_add_rules_from_file(ctx, rules_file);
+        free(rules_file);
+        if (added < 0){
+            fprintf(stderr, "ERROR: Can not load the rules file!\n");
+            return 2;
+        }
+    }
+    // add custom suffix if any: one rule per line, so the index is built once
     if (custom_suffix){
-        PSTR str = str_init(custom_suffix);
+        for (char * c = custom_suffix; *c; ++c){
+            if (*c == ',')
+                *c = '\n';
+        }
+        int added = ctld_add_rules_from_buffer(ctx, custom_suffix, strlen(custom_suffix));
         free(custom_suffix);
-        if (str){
-            char * stripped = NULL;
-            PSPLITLIST splt = str->str_split(str, ",", -1);
-            for (int i=0; i< splt->len; ++i){
-                str->str_setval(str, splt->list[i]);
-                stripped = str->str_strip(str, NULL);
-                if (stripped){
-                    ctld_add_custom_suffix(ctx, stripped);
-                    free(stripped);
-                    stripped = NULL;
-                }
-            }
-            str_free(str);
-            str_free_splitlist(splt);
+        if (added < 0){
+            fprintf(stderr, "ERROR: Can not add the custom suffixes!\n");
+            return 2;
         }
     }
-    size_t m = 0;
-    size_t n = 0;
+    ccounter_ctx * counter = NULL;
+    csketch_topk * topk_sketch = NULL;
+    csketch_hll * distinct_rd = NULL, * distinct_tld = NULL;
+    if (topk){
+        topk_sketch = csketch_topk_init(topk * TOPK_CAPACITY_FACTOR);
+        if (!topk_sketch){
+            fprintf(stderr, "ERROR: malloc() failed!\n");
+            return 1;
+        }
+    }else if (count_by){
+        counter = ccounter_init(0);
+        if (!counter){
+            fprintf(stderr, "ERROR: malloc() failed!\n");
+            return 1;
+        }
+    }
+    if (distinct){
+        distinct_rd = csketch_hll_init(CSKETCH_HLL_DEFAULT_PRECISION);
+        distinct_tld = csketch_hll_init(CSKETCH_HLL_DEFAULT_PRECISION);
+        if (!distinct_rd || !distinct_tld){
+            fprintf(stderr, "ERROR: malloc() failed!\n");
+            return 1;
+        }
+    }
+    csketch_fpset * unique_set = NULL;
+    csketch_bloom * unique_bloom = NULL;
+    if (unique_bloom_mb){
+        unique_bloom = csketch_bloom_init(unique_bloom_mb << 20, 0);
+        if (!unique_bloom){
+            fprintf(stderr, "ERROR: malloc() failed!\n");
+            return 1;
+        }
+    }else if (unique){
+        unique_set = csketch_fpset_init(0);
+        if (!unique_set){
+            fprintf(stderr, "ERROR: malloc() failed!\n");
+            return 1;
+        }
+    }
+    char * out = NULL;
+    size_t out_size = 0;
+    size_t out_len = 0;
+    int out_err = 0;
+    char * rec = NULL;
+    size_t rec_size = 0;
+    size_t rec_len = 0;
+    cwriter_ctx * writer = NULL;
+    // one writer per output file with --output-dir
+    cwriter_ctx ** shard_writers = NULL;
+    FILE ** shard_files = NULL;
+    cwriter_pool * shard_pool = NULL;
+    if (output_dir){
+        // a few threads (--threads) write the full buffers of all the shards
+        shard_pool = cwriter_pool_init(threads < (long) shards?(int) threads:(int) shards);
+        shard_writers = shard_pool?open_shards(output_dir, shards, format, shard_pool, &shard_files):NULL;
+        free(output_dir);
+        if (!shard_writers){
+            cwriter_pool_free(shard_pool);
+            fprintf(stderr, "ERROR: Can not create the output files!\n");
+            return 1;
+        }
+        writer = shard_writers[0];
+    }else{
+        writer = cwriter_init(stdout, 0);
+        // keep the large buffer for pipes and files, a terminal gets each record at once
+        if (writer && isatty(STDOUT_FILENO))
+            cwriter_set_line_buffered(writer, 1);
+    }
+    if (!writer){
+        fprintf(stderr, "ERROR: malloc() failed!\n");
+        return 1;
+    }
+    ssize_t n = 0;
     ctld_result * result = NULL;
-    struct parsed_url * purl = NULL;
-    int include_private = use_private;
-    char * idn_out = NULL;
-    int idn_result = 0;
-    char * input_buffer = NULL;
-    int should_encode = 0;
-    while ((n = getline(&l, &m, fp)) != -1){
-        idn_result = 0;
-        should_encode = 0;
-        idn_out = NULL;
+    char * json_buffer = NULL;
+    size_t json_buffer_size = 0;
+    while ((n = creader_getline(reader, &l)) != -1){
         if (n == 0){
             continue;
         }
-        int t = n;
-        while (t >= 0){
-            if (l[t-1] == 0x0D || l[t-1] == 0x20 || l[t-1] == 0x0A || l[t-1] == '.'){
-                l[t-1] = '\0';
-                t -= 1;
-            }else{
-                break;
+        if (field || json_key){
+            // keep the record as it is, just remove the line ending
+            while (n > 0 && (l[n-1] == 0x0D || l[n-1] == 0x0A))
+                l[--n] = '\0';
+            if (l[0] == '\0'){
+                continue;
             }
-        }
-        if (l[0] == '\0'){
-            continue;
-        }
-        purl = parse_url(l);
-        if (purl){
-            input_buffer = purl->host;
-            n = 0;
-            while(input_buffer[n]){
-                if ((unsigned char)input_buffer[n++] > 127){
-                    should_encode = 1;
-                    break;
+            size_t host_len = 0;
+            int escaped = 0;
+            char * host = field?find_field(l, field, delimiter, &host_len):find_json_key(l, json_key, &host_len, &escaped);
+            result = NULL;
+            if (host && escaped){
+                // only copy the host if it needs to be decoded
+                if (host_len + 1 > json_buffer_size){
+                    free(json_buffer);
+                    json_buffer_size = host_len + 1;
+                    json_buffer = (char*) malloc(json_buffer_size);
+                }
+                if (json_buffer){
+                    json_unescape(host, host_len, json_buffer);
+                    host = json_buffer;
+                    host_len = strlen(host);
                 }
             }
-            if (should_encode){
-                idn_result = idna_to_ascii_8z(input_buffer, &idn_out, IDN2_NONTRANSITIONAL);
-                parsed_url_free(purl);
-                input_buffer = idn_out;
-            }else{
-                input_buffer = purl->host;
+            if (host && host_len){
+                result = lookup_host(ctx, host, host_len, use_private, print_err);
+            }else if (print_err){
+                fprintf(stderr, "ERROR: Can not find the host in: %s\n", l);
             }
-            if (idn_result == IDN2_OK){
-                result = ctld_parse(ctx, input_buffer, include_private);
-                if (should_encode)
-                    free(input_buffer);
-                else
-                    parsed_url_free(purl);
-            }else{
-                if (print_err){
-                    fprintf(stderr, "ERROR: Can not parse IDN domain: %s\n", purl->host);
-                    if (should_encode)
-                        free(input_buffer);
-                    else
-                        parsed_url_free(purl);
-                    continue;
+            if (!print_err){
+                out_len = 0;
+                if (field){
+                    out_err = out_append_n(&out, &out_size, &out_len, l, n);
+                    out_err |= append_columns(&out, &out_size, &out_len, result, print_rd, print_fqdn, print_tld, delimiter);
+                }else{
+                    out_err = append_json_members(&out, &out_size, &out_len, l, result, print_rd, print_fqdn, print_tld);
                 }
             }
         }else{
-            n = 0;
-            while(l[n]){
-                if ((unsigned char)l[n++] > 127){
-                    should_encode = 1;
-                    break;
-                }
+            result = lookup_host(ctx, l, n, use_private, print_err);
+            if (!result){
+                continue;
             }
-            if (should_encode){
-                idn_result = idna_to_ascii_8z(l, &idn_out, IDN2_NONTRANSITIONAL);
-                input_buffer = idn_out;
-            }else{
-                input_buffer = l;
-            }
-            if (idn_result == IDN2_OK){
-                result = ctld_parse(ctx, input_buffer, include_private);
-
-                if (should_encode)
-                    free(input_buffer);
-            }else{
-                input_buffer = NULL;
-                if (print_err){
-                    fprintf(stderr, "ERROR: Can not parse IDN domain: %s\n", l);
-                    if (should_encode)
-                        free(input_buffer);
-                    continue;
+            if (!print_err){
+                out_len = 0;
+                out_err = 0;
+                int p = 0;
+                if (print_rd){
+                    out_err |= out_append(&out, &out_size, &out_len, result->registered_domain);
+                    p++;
+                }
+                if (print_fqdn){
+                    if (p)
+                        out_err |= out_append(&out, &out_size, &out_len, "\t");
+                    p++;
+                    out_err |= out_append(&out, &out_size, &out_len, result->fqdn);
+                }
+                if (print_tld){
+                    if (p)
+                        out_err |= out_append(&out, &out_size, &out_len, "\t");
+                    out_err |= out_append(&out, &out_size, &out_len, result->suffix);
+                    p++;
                 }
             }
         }
-        if (!result && print_err){
-            fprintf(stderr, "ERROR: Can not parse: %s\n", l);
+        if (counter || topk_sketch || distinct){
+            if (result && counter){
+                const char * key = ctld_result_field(result, count_by);
+                if (key)
+                    ccounter_add(counter, key, 1);
+            }
+            if (result && topk_sketch)
+                ctld_topk_add(topk_sketch, result, count_by);
+            if (result && distinct){
+                ctld_distinct_add(distinct_rd, result, CTLD_FIELD_RD);
+                ctld_distinct_add(distinct_tld, result, CTLD_FIELD_SUFFIX);
+            }
+            ctld_result_free(result);
+            result = NULL;
             continue;
-        }else if (!result && !print_err){
+        }
+        if (out_err){
+            fprintf(stderr, "ERROR: malloc() failed!\n");
+            ctld_result_free(result);
+            break;
+        }
+        // only print the first occurrence of each record
+        if (print_err || (unique_set && csketch_fpset_add(unique_set, out) == 0) ||
+                (unique_bloom && csketch_bloom_add(unique_bloom, out) == 0)){
+            ctld_result_free(result);
+            result = NULL;
             continue;
         }
-        int p = 0;
-        if (!print_err){
-            if (print_rd){
-                PRINTIFSET(result->registered_domain);
-                p++;
-            }
-            if (print_fqdn){
-                if (p)
-                    printf("\t");
-                p++;
-                PRINTIFSET(result->fqdn);
-            }
-            if (print_tld){
-                if (p)
-                    printf("\t");
-                PRINTIFSET(result->suffix);
-                p++;
+        if (shard_writers){
+            const char * key = result?ctld_result_field(result, shard_by):NULL;
+            if (result && !key)
+                key = result->suffix;   // the host is a suffix itself
+            writer = shard_writers[shard_of(key, shards)];
+        }
+        if (format == FORMAT_TEXT){
+            out[out_len++] = '\n';     // there is always room for the null character
+            cwriter_write(writer, out, out_len);
+        }else{
+            out_err = build_record(&rec, &rec_size, &rec_len, format, l, result);
+            if (out_err){
+                fprintf(stderr, "ERROR: malloc() failed!\n");
+                ctld_result_free(result);
+                break;
             }
-            printf("\n");
+            cwriter_write(writer, rec, rec_len);
         }
         ctld_result_free(result);
         result = NULL;
     }
-    free(l);
-    ctld_free(ctx);
+    int write_err = 0;
+    if (shard_writers){
+        for (size_t i=0; i< shards; ++i){
+            write_err |= cwriter_free(shard_writers[i]);
+            write_err |= fclose(shard_files[i]) != 0;
+        }
+        free(shard_writers);
+        free(shard_files);
+        cwriter_pool_free(shard_pool);
+    }else{
+        write_err = cwriter_free(writer);
+    }
+    if (write_err)
+        fprintf(stderr, "ERROR: Can not write the output\n");
+    if (counter){
+        size_t top_len = 0;
+        PCCOUNTER_ITEM top = ccounter_top(counter, count_limit, &top_len);
+        for (size_t i=0; i< top_len; ++i)
+            printf("%llu\t%s\n", (unsigned long long)top[i].count, top[i].key);
+        free(top);
+        ccounter_free(counter);
+    }
+    if (topk_sketch){
+        size_t top_len = 0;
+        PCSKETCH_ITEM top = csketch_topk_list(topk_sketch, topk, &top_len);
+        for (size_t i=0; i< top_len; ++i)
+            printf("%llu\t%s\n", (unsigned long long)top[i].count, top[i].key);
+        free(top);
+        csketch_topk_free(topk_sketch);
+    }
+    if (distinct){
+        printf("rd\t%llu\n", (unsigned long long)csketch_hll_count(distinct_rd));
+        printf("tld\t%llu\n", (unsigned long long)csketch_hll_count(distinct_tld));
+        csketch_hll_free(distinct_rd);
+        csketch_hll_free(distinct_tld);
+    }
+    csketch_fpset_free(unique_set);
+    csketch_bloom_free(unique_bloom);
+    free(out);
+    free(rec);
+    free(json_buffer);
+    free(json_key);
+    int read_err = creader_free(reader);
+    if (read_err)
+        fprintf(stderr, "ERROR: Can not read or decompress the whole input\n");
+    if (psl_cache)
+        ccache_free(psl_cache);
+    else
+        ctld_free(ctx);
     fclose(fp);
+    return read_err || write_err || out_err;
 }
@@ -0,0 +1,67 @@
+///@file ctld_gen.c
+// Builds the rule index of a PSL file and writes it as a C header, so the
+// index can be embedded in a program and used with ctld_load_index()
+// without parsing anything at startup. The header has two indexes:
+// psl_index (both sections) and psl_index_icann (ICANN section only) for
+// programs which never use the private section.
+//
+// Usage: ./bin/ctld_gen psl.dat include/psl_index.h
+//
+#include <stdio.h>
+#include <string.h>
+#include <stdint.h>
+#include <libctld.h>
+
+/*
+ * Writes the index of ctx as a static array (and its length) named name.
+ * 64-bit words keep the index aligned; the last word is padded with zeros.
+ */
+static void write_index(FILE * fp, const char * name, const ctld_ctx * ctx){
+    size_t len = 0;
+    const uint64_t * words = (const uint64_t*) ctld_index_data(ctx, &len);
+    fprintf(fp, "static const uint64_t %s[] = {\n", name);
+    for (size_t i=0; i< (len + 7) / 8; ++i){
+        uint64_t word = 0;
+        memcpy(&word, words + i, i * 8 + 8 <= len?8:len - i * 8);
+        fprintf(fp, "0x%016llxULL,%s", (unsigned long long) word, i % 4 == 3?"\n":" ");
+    }
+    fprintf(fp, "\n};\n\nstatic const size_t %s_len = %zu;\n\n", name, len);
+}
+
+int main(int argc, char ** argv){
+    if (argc != 3){
+        fprintf(stderr, "Usage: %s <psl-file> <output-header>\n", argv[0]);
+        return 1;
+    }
+    ctld_options options;
+    ctld_options_init(&options);
+    options.filename = argv[1];
+    ctld_ctx * ctx = ctld_ctx_create(&options);
+    options.sections = CTLD_SECTION_ICANN;
+    ctld_ctx * icann = ctx?ctld_ctx_create(&options):NULL;
+    if (!ctx || !icann){
+        fprintf(stderr, "ERROR: Can not parse %s\n", argv[1]);
+        ctld_free(ctx);
+        return 1;
+    }
+    FILE * fp = fopen(argv[2], "w");
+    if (!fp){
+        perror("ERROR");
+        ctld_free(ctx);
+        ctld_free(icann);
+        return 1;
+    }
+    fprintf(fp, "// generated from %s by ctld_gen, do not edit\n", argv[1]);
+    fprintf(fp, "#include <stdint.h>\n#include <stddef.h>\n\n");
+    write_index(fp, "psl_index", ctx);
+    write_index(fp, "psl_index_icann", icann);
+    int err = ferror(fp);
+    err = fclose(fp) || err;
+    ctld_free(ctx);
+    ctld_free(icann);
+    if (err){
+        fprintf(stderr, "ERROR: Can not write %s\n", argv[2]);
+        return 1;
+    }
+    return 0;
+}
@@ -0,0 +1,226 @@
+///@file ctld_sqlite.c
+// SQLite loadable extension on top of libctld (build it with "make sqlite").
+//
+//     .load ./bin/ctld_sqlite
+//     SELECT ctld_rd(host), count(*) FROM logs GROUP BY 1;
+//
+// Registers ctld_rd(), ctld_suffix(), ctld_domain() and ctld_is_private().
+// Each function takes the host (or URL) and an optional second argument
+// which enables the private section of the PSL (0 by default, like the
+// command line tool). ctld_is_private() always uses the private section.
+//
+#include <sqlite3ext.h>
+SQLITE_EXTENSION_INIT1
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <libctld.h>
+#include <csketch.h>
+#include <chost.h>
+#include "psl_index.h"
+
+#define CTLD_SQLITE_CACHE 4096          ///< number of results cached per connection (power of 2)
+#define CTLD_SQLITE_MAX_HOST 1024       ///< longer inputs (e.g. URLs with long queries) are looked up without the cache
+
+/**
+ * @details One cached lookup.
+ */
+typedef struct{
+    char * host;                ///< the argument as passed to the function, NULL if the slot is empty
+    int use_private;            ///< the private section was used for this lookup
+    ctld_result * result;       ///< the result (NULL if no rule matched)
+} ctld_sqlite_entry;
+
+/**
+ * @details State shared by the functions of one connection.
+ */
+typedef struct{
+    ctld_ctx * ctx;             ///< the PSL, one context per connection
+    int refs;                   ///< number of functions using this state
+    ctld_sqlite_entry cache[CTLD_SQLITE_CACHE];   ///< direct-mapped result cache
+} ctld_sqlite_conn;
+
+/****************Static declaration********************/
+static int ctld_sqlite_get(ctld_sqlite_conn * conn, const char * host, int use_private,
+                           const ctld_result ** result, ctld_result ** owned);
+static int ctld_sqlite_args(sqlite3_context * context, int argc, sqlite3_value ** argv,
+                            const char ** host, int * use_private);
+static void ctld_sqlite_text(sqlite3_context * context, int argc, sqlite3_value ** argv, int field);
+static void ctld_sqlite_rd(sqlite3_context * context, int argc, sqlite3_value ** argv);
+static void ctld_sqlite_suffix(sqlite3_context * context, int argc, sqlite3_value ** argv);
+static void ctld_sqlite_domain(sqlite3_context * context, int argc, sqlite3_value ** argv);
+static void ctld_sqlite_is_private(sqlite3_context * context, int argc, sqlite3_value ** argv);
+static void ctld_sqlite_release(void * data);
+
+
+/*
+ * Looks up a host through the cache. Log tables repeat the same hosts a
+ * lot, so each connection keeps the last result of every cache slot.
+ * Inputs longer than CTLD_SQLITE_MAX_HOST are looked up without the cache:
+ * their result is also stored in *owned, which the caller frees.
+ *
+ * Returns 0 on success (*result is NULL if no rule matched) and 1 if
+ * malloc() failed.
+ */
+static int ctld_sqlite_get(ctld_sqlite_conn * conn, const char * host, int use_private,
+                           const ctld_result ** result, ctld_result ** owned){
+    size_t len = strlen(host);
+    *owned = NULL;
+    if (len > CTLD_SQLITE_MAX_HOST){
+        *owned = chost_lookup(conn->ctx, host, len, use_private, NULL);
+        *result = *owned;
+        return 0;
+    }
+    uint64_t h = csketch_fnv1a(host, len) ^ use_private;
+    ctld_sqlite_entry * entry = &conn->cache[h & (CTLD_SQLITE_CACHE - 1)];
+    if (entry->host && entry->use_private == use_private && strcmp(entry->host, host) == 0){
+        *result = entry->result;
+        return 0;
+    }
+    char * copy = (char*) malloc(len + 1);
+    if (!copy)
+        return 1;
+    memcpy(copy, host, len + 1);
+    free(entry->host);
+    ctld_result_free(entry->result);
+    entry->host = copy;
+    entry->use_private = use_private;
+    entry->result = chost_lookup(conn->ctx, host, len, use_private, NULL);
+    *result = entry->result;
+    return 0;
+}
+
+
+/*
+ * Reads the arguments of a function. Returns 0 if the result is NULL
+ * (NULL host or an error already reported) and 1 otherwise.
+ */
+static int ctld_sqlite_args(sqlite3_context * context, int argc, sqlite3_value ** argv,
+                            const char ** host, int * use_private){
+    if (sqlite3_value_type(argv[0]) == SQLITE_NULL)
+        return 0;
+    *host = (const char*) sqlite3_value_text(argv[0]);
+    if (!*host){
+        sqlite3_result_error_nomem(context);
+        return 0;
+    }
+    if (argc > 1)
+        *use_private = sqlite3_value_int(argv[1]) != 0;
+    return 1;
+}
+
+
+static void ctld_sqlite_text(sqlite3_context * context, int argc, sqlite3_value ** argv, int field){
+    const char * host;
+    int use_private = 0;
+    if (!ctld_sqlite_args(context, argc, argv, &host, &use_private))
+        return;
+    const ctld_result * result;
+    ctld_result * owned;
+    if (ctld_sqlite_get((ctld_sqlite_conn*) sqlite3_user_data(context), host, use_private, &result, &owned)){
+        sqlite3_result_error_nomem(context);
+        return;
+    }
+    const char * value = ctld_result_field(result, field);
+    if (value)
+        sqlite3_result_text(context, value, -1, SQLITE_TRANSIENT);
+    ctld_result_free(owned);
+}
+
+
+static void ctld_sqlite_rd(sqlite3_context * context, int argc, sqlite3_value ** argv){
+    ctld_sqlite_text(context, argc, argv, CTLD_FIELD_RD);
+}
+
+
+static void ctld_sqlite_suffix(sqlite3_context * context, int argc, sqlite3_value ** argv){
+    ctld_sqlite_text(context, argc, argv, CTLD_FIELD_SUFFIX);
+}
+
+
+static void ctld_sqlite_domain(sqlite3_context * context, int argc, sqlite3_value ** argv){
+    ctld_sqlite_text(context, argc, argv, CTLD_FIELD_DOMAIN);
+}
+
+
+static void ctld_sqlite_is_private(sqlite3_context * context, int argc, sqlite3_value ** argv){
+    const char * host;
+    int use_private = 1;
+    if (!ctld_sqlite_args(context, 1, argv, &host, &use_private))
+        return;
+    const ctld_result * result;
+    ctld_result * owned;
+    if (ctld_sqlite_get((ctld_sqlite_conn*) sqlite3_user_data(context), host, 1, &result, &owned)){
+        sqlite3_result_error_nomem(context);
+        return;
+    }
+    if (result)
+        sqlite3_result_int(context, result->is_private);
+    ctld_result_free(owned);
+}
+
+
+/*
+ * Called by SQLite when a function is removed (or the connection is
+ * closed). The state goes away with the last function.
+ */
+static void ctld_sqlite_release(void * data){
+    ctld_sqlite_conn * conn = (ctld_sqlite_conn*) data;
+    if (--conn->refs > 0)
+        return;
+    for (size_t i=0; i< CTLD_SQLITE_CACHE; ++i){
+        free(conn->cache[i].host);
+        ctld_result_free(conn->cache[i].result);
+    }
+    ctld_free(conn->ctx);
+    free(conn);
+}
+
+
+/**
+ * @brief entry point of the extension, called by SQLite when the library is loaded.
+ */
+#ifdef _WIN32
+__declspec(dllexport)
+#endif
+int sqlite3_ctldsqlite_init(sqlite3 * db, char ** err, const sqlite3_api_routines * api){
+    SQLITE_EXTENSION_INIT2(api);
+    static const struct{
+        const char * name;
+        int argc;
+        void (*func)(sqlite3_context*, int, sqlite3_value**);
+    } functions[] = {
+        {"ctld_rd", 1, ctld_sqlite_rd}, {"ctld_rd", 2, ctld_sqlite_rd},
+        {"ctld_suffix", 1, ctld_sqlite_suffix}, {"ctld_suffix", 2, ctld_sqlite_suffix},
+        {"ctld_domain", 1, ctld_sqlite_domain}, {"ctld_domain", 2, ctld_sqlite_domain},
+        {"ctld_is_private", 1, ctld_sqlite_is_private},
+    };
+    ctld_sqlite_conn * conn = (ctld_sqlite_conn*) calloc(1, sizeof(ctld_sqlite_conn));
+    if (!conn)
+        return SQLITE_NOMEM;
+    // the rule index of the PSL is built at compile time, nothing to parse
+    conn->ctx = ctld_load_index(psl_index, psl_index_len);
+    if (!conn->ctx){
+        free(conn);
+        *err = sqlite3_mprintf("ctld: can not load the public suffix list");
+        return SQLITE_ERROR;
+    }
+    int flags = SQLITE_UTF8 | SQLITE_DETERMINISTIC;
+#ifdef SQLITE_INNOCUOUS
+    flags |= SQLITE_INNOCUOUS;
+#endif
+    conn->refs = 1;     // held until all the functions are registered
+    for (size_t i=0; i< sizeof(functions) / sizeof(functions[0]); ++i){
+        conn->refs++;
+        int rc = sqlite3_create_function_v2(db, functions[i].name, functions[i].argc, flags, conn,
+                                            functions[i].func, NULL, NULL, ctld_sqlite_release);
+        if (rc != SQLITE_OK){
+            // SQLite already called ctld_sqlite_release() for this function
+            ctld_sqlite_release(conn);
+            *err = sqlite3_mprintf("ctld: can not register %s()", functions[i].name);
+            return rc;
+        }
+    }
+    ctld_sqlite_release(conn);
+    return SQLITE_OK;
+}
@@ -0,0 +1,282 @@
+///@file cwriter.c
+
+#include <string.h>
+#include <cwriter.h>
+
+
+/**
+ * @brief Initializes a buffered writer.
+ * @param fp the stream to write to (the writer does not close it)
+ * @param size size of the buffer. Pass 0 to use #CWRITER_DEFAULT_SIZE.
+ *
+ * @return A pointer to the writer on success or NULL on failure
+ */
+cwriter_ctx * cwriter_init(FILE * fp, size_t size){
+    if (!fp)
+        return NULL;
+    cwriter_ctx * ctx = (cwriter_ctx*) malloc(sizeof(cwriter_ctx));
+    if (!ctx)
+        return NULL;
+    ctx->size = size?size:CWRITER_DEFAULT_SIZE;
+    ctx->buf = (char*) malloc(ctx->size);
+    if (!ctx->buf){
+        free(ctx);
+        return NULL;
+    }
+    ctx->fp = fp;
+    ctx->len = 0;
+    ctx->err = 0;
+    ctx->async = 0;
+    ctx->line_buffered = 0;
+    ctx->pending = NULL;
+    ctx->pending_len = 0;
+    ctx->pool = NULL;
+    ctx->owns_pool = 0;
+    ctx->next = NULL;
+    return ctx;
+}
+
+
+/**
+ * @brief a writing thread of a pool
+ */
+static void * cwriter_pool_thread(void * arg){
+    cwriter_pool * pool = (cwriter_pool*) arg;
+    pthread_mutex_lock(&pool->lock);
+    while (1){
+        while (!pool->head && !pool->stop)
+            pthread_cond_wait(&pool->work, &pool->lock);
+        if (!pool->head)
+            break;      // stop and nothing left to write
+        cwriter_ctx * ctx = pool->head;
+        pool->head = ctx->next;
+        if (!pool->head)
+            pool->tail = NULL;
+        size_t len = ctx->pending_len;
+        pthread_mutex_unlock(&pool->lock);
+        int failed = fwrite(ctx->pending, 1, len, ctx->fp) != len;
+        pthread_mutex_lock(&pool->lock);
+        if (failed)
+            ctx->err = 1;
+        ctx->pending_len = 0;
+        pthread_cond_broadcast(&pool->done);
+    }
+    pthread_mutex_unlock(&pool->lock);
+    return NULL;
+}
+
+
+/**
+ * @brief Starts a pool of writing threads.
+ * @param nthreads number of threads (at least 1)
+ *
+ * Threads which can not be started are skipped. If none starts, the writers
+ * of the pool write in the calling thread.
+ *
+ * @return A pointer to the pool on success or NULL on failure
+ */
+cwriter_pool * cwriter_pool_init(int nthreads){
+    if (nthreads < 1)
+        nthreads = 1;
+    cwriter_pool * pool = (cwriter_pool*) calloc(1, sizeof(cwriter_pool));
+    if (!pool)
+        return NULL;
+    pool->threads = (pthread_t*) malloc(nthreads * sizeof(pthread_t));
+    if (!pool->threads){
+        free(pool);
+        return NULL;
+    }
+    pthread_mutex_init(&pool->lock, NULL);
+    pthread_cond_init(&pool->work, NULL);
+    pthread_cond_init(&pool->done, NULL);
+    for (int i=0; i< nthreads; ++i){
+        if (pthread_create(&pool->threads[pool->nthreads], NULL, cwriter_pool_thread, pool) == 0)
+            pool->nthreads++;
+    }
+    return pool;
+}
+
+
+/**
+ * @brief Stops and frees the pool. Free its writers first.
+ */
+void cwriter_pool_free(cwriter_pool * pool){
+    if (!pool)
+        return;
+    pthread_mutex_lock(&pool->lock);
+    pool->stop = 1;
+    pthread_cond_broadcast(&pool->work);
+    pthread_mutex_unlock(&pool->lock);
+    for (int i=0; i< pool->nthreads; ++i)
+        pthread_join(pool->threads[i], NULL);
+    pthread_mutex_destroy(&pool->lock);
+    pthread_cond_destroy(&pool->work);
+    pthread_cond_destroy(&pool->done);
+    free(pool->threads);
+    free(pool);
+}
+
+
+/**
+ * @brief Initializes a buffered writer whose full buffers are written by
+ * the threads of a pool.
+ * @param fp the stream to write to (the writer does not close it)
+ * @param size size of each of the two buffers. Pass 0 to use #CWRITER_DEFAULT_SIZE.
+ * @param pool the writing threads, shared by any number of writers
+ *
+ * @return A pointer to the writer on success or NULL on failure
+ */
+cwriter_ctx * cwriter_init_pooled(FILE * fp, size_t size, cwriter_pool * pool){
+    if (!pool)
+        return NULL;
+    cwriter_ctx * ctx = cwriter_init(fp, size);
+    if (!ctx)
+        return NULL;
+    ctx->pending = (char*) malloc(ctx->size);
+    if (!ctx->pending){
+        cwriter_free(ctx);
+        return NULL;
+    }
+    ctx->pool = pool;
+    // without threads, write in the calling thread instead
+    ctx->async = pool->nthreads > 0;
+    return ctx;
+}
+
+
+/**
+ * @brief Initializes a buffered writer with its own writing thread.
+ * @param fp the stream to write to (the writer does not close it)
+ * @param size size of each of the two buffers. Pass 0 to use #CWRITER_DEFAULT_SIZE.
+ *
+ * @return A pointer to the writer on success or NULL on failure
+ */
+cwriter_ctx * cwriter_init_async(FILE * fp, size_t size){
+    if (!fp)
+        return NULL;
+    cwriter_pool * pool = cwriter_pool_init(1);
+    cwriter_ctx * ctx = cwriter_init_pooled(fp, size, pool);
+    if (!ctx){
+        cwriter_pool_free(pool);
+        return NULL;
+    }
+    ctx->owns_pool = 1;
+    return ctx;
+}
+
+
+/**
+ * @brief waits until the pool has written the pending buffer
+ */
+static int cwriter_wait(cwriter_ctx * ctx){
+    pthread_mutex_lock(&ctx->pool->lock);
+    while (ctx->pending_len)
+        pthread_cond_wait(&ctx->pool->done, &ctx->pool->lock);
+    int err = ctx->err;
+    pthread_mutex_unlock(&ctx->pool->lock);
+    return err;
+}
+
+
+/**
+ * @brief Writes everything in the buffer to the stream.
+ *
+ * An async writer only queues the buffer for its pool (after the previous
+ * buffer is written) and returns.
+ *
+ * @return 0 on success or 1 on failure
+ */
+int cwriter_flush(cwriter_ctx * ctx){
+    if (!ctx)
+        return 1;
+    if (ctx->async){
+        // queue the buffer for the pool and continue with the other one
+        if (cwriter_wait(ctx) || !ctx->len)
+            return ctx->err;
+        char * tmp = ctx->pending;
+        cwriter_pool * pool = ctx->pool;
+        pthread_mutex_lock(&pool->lock);
+        ctx->pending = ctx->buf;
+        ctx->pending_len = ctx->len;
+        ctx->next = NULL;
+        if (pool->tail)
+            pool->tail->next = ctx;
+        else
+            pool->head = ctx;
+        pool->tail = ctx;
+        pthread_cond_signal(&pool->work);
+        pthread_mutex_unlock(&pool->lock);
+        ctx->buf = tmp;
+        ctx->len = 0;
+        return 0;
+    }
+    if (ctx->len && fwrite(ctx->buf, 1, ctx->len, ctx->fp) != ctx->len)
+        ctx->err = 1;
+    ctx->len = 0;
+    return ctx->err;
+}
+
+
+/**
+ * @brief Makes the writer write the buffer (and flush the stream) each time
+ * a write ends with a new line, e.g. when the stream is a terminal.
+ */
+void cwriter_set_line_buffered(cwriter_ctx * ctx, int line_buffered){
+    if (ctx)
+        ctx->line_buffered = line_buffered != 0;
+}
+
+
+/**
+ * @brief Appends len bytes to the writer.
+ *
+ * Data bigger than the buffer is written directly to the stream.
+ *
+ * @return 0 on success or 1 on failure
+ */
+int cwriter_write(cwriter_ctx * ctx, const void * data, size_t len){
+    if (!ctx)
+        return 1;
+    if (ctx->len + len > ctx->size){
+        if (cwriter_flush(ctx))
+            return 1;
+        if (len > ctx->size){
+            if (ctx->async && cwriter_wait(ctx))
+                return 1;
+            if (fwrite(data, 1, len, ctx->fp) != len)
+                ctx->err = 1;
+            return ctx->err;
+        }
+    }
+    memcpy(ctx->buf + ctx->len, data, len);
+    ctx->len += len;
+    if (ctx->line_buffered && len && ((const char*) data)[len - 1] == '\n'){
+        if (cwriter_flush(ctx) || (ctx->async && cwriter_wait(ctx)))
+            return 1;
+        if (fflush(ctx->fp) != 0)
+            ctx->err = 1;
+        return ctx->err;
+    }
+    return 0;
+}
+
+
+/**
+ * @brief Flushes and frees the writer.
+ * @return 0 if all the data was written successfully or 1 on failure
+ */
+int cwriter_free(cwriter_ctx * ctx){
+    if (!ctx)
+        return 1;
+    int err = cwriter_flush(ctx);
+    if (ctx->async)
+        err |= cwriter_wait(ctx);
+    if (ctx->owns_pool)
+        cwriter_pool_free(ctx->pool);
+    if (fflush(ctx->fp) != 0)
+        err = 1;
+    free(ctx->pending);
+    free(ctx->buf);
+    free(ctx);
+    return err;
+}
@@ -1,25 +1,165 @@
 /// @file libctld.c
 //
+#define _GNU_SOURCE             // sched_getcpu() and the CPU affinity of threads
 #include <stdio.h>
 #include <string.h>
 #include <stdlib.h>
 #include <cstrlib.h>
 #include <cdict.h>
 #include <clist.h>
+#include <csketch.h>
+#include <cmphf.h>
 #include <libctld.h>
 #include <idn2.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <sched.h>
+#include <pthread.h>
+
+#define CTLD_MATCH_EXACT 1
+#define CTLD_MATCH_WILDCARD 2
+#define CTLD_MATCH_EXCEPTION 3
+
+// candidate keys up to this size are built on the stack
+#define CTLD_KEY_BUFFER 512
+// initial number of rules of a rule set
+#define CTLD_RULES_INITIAL_SIZE 1024
+// memory policy of mbind(2) (numaif.h), so libnuma is not needed
+#define CTLD_MPOL_PREFERRED 1
+// a NUMA replica is its context followed by its index, in one mapping
+#define CTLD_REPLICA_OFFSET ((sizeof(ctld_ctx) + 63) & ~(size_t) 63)
+
+// hash of the names of the index: FNV-1a over the lower-cased bytes, from the last one to the first
+#define CTLD_HASH_INIT CSKETCH_FNV_OFFSET
+#define CTLD_HASH_STEP(h, c) CSKETCH_FNV_STEP(h, cto_lower(c))
+
+// generic top-level labels which get a slot in the direct table of the index
+static const char * ctld_common_gtlds[] = {
+    "com", "net", "org", "info", "biz", "edu", "gov", "mil", "int", "arpa",
+    "xyz", "top", "online", "site", "shop", "store", "app", "dev", "club", "live",
+    "pro", "mobi", "name", "asia", "cloud", "blog", "tech", "space", "website", "icu",
+};
+
+/**
+ * @details internal result of matching a domain against the rules
+ */
+typedef struct ctld_match{
+    const char * name;          ///< labels of the rule that wins (without "*." or "!"), NULL if none
+    int is_private;             ///< 1 if the rule comes from the PRIVATE section
+    int kind;                   ///< one of CTLD_MATCH_EXACT, CTLD_MATCH_WILDCARD or CTLD_MATCH_EXCEPTION
+    int level;                  ///< number of labels the rule covers
+    const char * suffix;        ///< where the public suffix starts in the domain
+} ctld_match;
+
+
+/**
+ * @details one rule of a rule set (see ctld_rules)
+ */
+typedef struct ctld_rule_item{
+    char * name;                ///< lower-cased labels of the rule
+    uint8_t flags;              ///< CTLD_RULE_* flags (PRIVATE ones shifted)
+} ctld_rule_item;
+
+
+/**
+ * @details rules collected before building the index of a context
+ */
+typedef struct ctld_rules{
+    ctld_rule_item * items;     ///< the rules, a name can appear more than once
+    size_t len;                 ///< number of items
+    size_t size;                ///< allocated number of items
+} ctld_rules;
+
+
+/**
+ * @details one NUMA replica, copied by a thread running on its node
+ */
+typedef struct ctld_numa_copy{
+    const ctld_ctx * ctx;       ///< the context to copy
+    ctld_ctx * replica;         ///< where the copy goes (CTLD_REPLICA_OFFSET + the index)
+    cpu_set_t cpus;             ///< CPUs of the node
+} ctld_numa_copy;
+
+
+/**
+ * @details one thread of ctld_parse_parallel(). The chunks it still has to
+ * parse are packed in one word (next chunk << 32 | end chunk), taken from
+ * the front by the worker and stolen from the back by the others.
+ */
+typedef struct ctld_worker{
+    _Alignas(64) uint64_t range;        ///< chunks left, changed with atomic compare-and-swap only
+    ctld_ctx * ctx;                     ///< the context
+    const char ** hosts;                ///< all the hosts
+    size_t n;                           ///< number of hosts
+    int use_private_suffix;             ///< passed to each lookup
+    ctld_result ** out;                 ///< results of all the hosts
+    struct ctld_worker * workers;       ///< all the workers, to steal from
+    int nworkers;                       ///< number of workers
+    int id;                             ///< index of this worker in workers
+    long matched;                       ///< hosts with a result parsed by this worker
+    int failed;                         ///< 1 if malloc() failed
+} ctld_worker;
 
 
 /****************Static declaration********************/
 static void ctld_node_free(void* node);
-static void * ctld_node_copy(void* node);
 static ctld_ctx * ctld_init(void);
-static ctld_result * ctld_choose_best(PCLIST all_match, char * domain);
+static void ctld_consider(ctld_match * best, ctld_match * exception, const char * name, int is_private,
+                          int kind, int level, const char * suffix);
+static int ctld_find_rule(ctld_ctx * ctx, const ctld_overlay * overlay, const char * domain,
+                          int use_private_suffix, ctld_match * match, ctld_match * icann_match);
+static const ctld_index_entry * ctld_index_entries(const ctld_ctx * ctx);
+static const char * ctld_index_name(const ctld_ctx * ctx, const ctld_index_entry * entry);
+static int ctld_index_find(const ctld_ctx * ctx, const char * key, size_t len);
+static int ctld_index_probe(const ctld_ctx * ctx, uint64_t h, const char * key, size_t len);
+static int ctld_compact_cmp(const char * key, size_t len, const unsigned char * name, size_t name_len);
+static const unsigned char * ctld_compact_decode(const unsigned char * p, int first, unsigned char * name, size_t * len, int * flags);
+static int ctld_compact_probe(const ctld_ctx * ctx, const char * key, size_t len);
+static int ctld_tld_find(const ctld_ctx * ctx, const char * label, size_t len, uint64_t h, uint32_t * value);
+static uint32_t * ctld_tld_slot(ctld_index_header * index, const char * label);
+static void ctld_tld_build(ctld_index_header * index, const ctld_rules * rules);
+static const ctld_node * ctld_overlay_find(const ctld_overlay * overlay, const char * key, int * hidden);
+static uint64_t ctld_hash_nocase(const char * key);
+static ctld_overlay_rule * ctld_overlay_slot(const ctld_overlay * overlay, const char * key, uint64_t h);
+static int ctld_overlay_grow(ctld_overlay * overlay);
+static int ctld_overlay_set(ctld_overlay * overlay, const char * name, ctld_node * node);
+static int ctld_build_names(const ctld_match * match, const char * domain,
+                            char ** suffix, char ** registered_domain, char ** label_out);
+static ctld_result * ctld_build_result(const ctld_match * match, const ctld_match * icann_match, const char * domain);
+static const char * ctld_registered_start(ctld_ctx * ctx, const char * domain, int use_private_suffix);
 static int cstr_ccmp(const char * str1, const char * str2);
 static int cto_lower(int c);
-static char * ctld_read_file(char * filename);
+static char * ctld_map_file(const char * filename, size_t * len, int * mapped);
+static void ctld_unmap_file(char * data, size_t len, int mapped);
 
-static int ctld_parse_list(char * data, cdict_ctx* list_public, cdict_ctx* list_private);
+static int ctld_parse_list(const char * data, size_t len, ctld_ctx * ctx);
+static long ctld_rules_scan(ctld_rules * rules, const char * data, size_t len, const ctld_ctx * ctx, int marked);
+static int ctld_label_count(const char * name);
+static int ctld_numa_read_list(const char * path, unsigned char * set, int size);
+static size_t ctld_replica_size(const ctld_ctx * ctx);
+static void ctld_replica_fill(const ctld_ctx * ctx, ctld_ctx * replica);
+static void * ctld_numa_copy_thread(void * arg);
+static void ctld_replicas_free(ctld_ctx * ctx);
+static ctld_ctx * ctld_local_replica(ctld_ctx * ctx);
+static int ctld_worker_pop(ctld_worker * worker, uint32_t * chunk);
+static int ctld_worker_steal(ctld_worker * thief);
+static void * ctld_worker_run(void * arg);
+static int ctld_rules_push(ctld_rules * rules, char * name, uint8_t flags);
+static int ctld_rules_add(ctld_rules * rules, const char * rule, size_t len, int is_private, int unicode);
+static int ctld_rules_from_index(ctld_rules * rules, const ctld_ctx * ctx);
+static int ctld_rules_cmp(const void * a, const void * b);
+static int ctld_rules_build(ctld_rules * rules, ctld_ctx * ctx);
+static ctld_index_header * ctld_index_build_hash(const ctld_rules * rules, size_t start, size_t names_len, uint64_t seed);
+static ctld_index_header * ctld_index_build_compact(const ctld_rules * rules, size_t start, size_t names_len);
+static void ctld_rules_free(ctld_rules * rules);
+static int ctld_index_check(const void * data, size_t len);
+static int ctld_index_check_hash(const ctld_index_header * index);
+static int ctld_index_check_compact(const ctld_index_header * index);
+static int ctld_index_use(ctld_ctx * ctx, const ctld_index_header * index, int owned);
+static int ctld_line_has(const char * line, const char * eol, const char * needle);
 
 static void ctld_node_free(void* node){
     ctld_node *to_free = (ctld_node*) node;
@@ -28,10 +168,6 @@ static void ctld_node_free(void* node){
     return;
 }
 
-static void * ctld_node_copy(void* node){
-    return node;
-}
-
 
 static int cto_lower(int c){
     return c >= 'A' && c <= 'Z'? c + 'a' - 'A':c;
@@ -48,31 +184,17 @@ static int cstr_ccmp(const char * str1, const char * str2){
 }
 
 static ctld_ctx * ctld_init(void){
-    ctld_ctx * ctx = (ctld_ctx*) malloc(sizeof(ctld_ctx));
+    ctld_ctx * ctx = (ctld_ctx*) calloc(1, sizeof(ctld_ctx));
     if (!ctx){
         return NULL;
     }
     ctx->errcode = 0;
-    ctx->list_public = cdict_init(ctld_node_free, ctld_node_copy);
-    if (!ctx->list_public){
-        free(ctx);
-        return NULL;
-    }
-    ctx->list_private = cdict_init(ctld_node_free, ctld_node_copy);
-    if (!ctx->list_private){
-        cdict_free(ctx->list_public);
-        free(ctx);
-        return NULL;
-    }
+    ctx->max_depth = 0;
+    ctx->sections = CTLD_SECTION_ALL;
+    ctx->unicode_rules = 1;
     return ctx;
 }
 
-
-static ctld_node * ctld_search_in_list(cdict_ctx * lst, char * name){
-    // looking for a name in lst which is a dict
-    return cdict_get_nocase(lst, name);
-}
-
 static unsigned int scstr_count(const char * str, int ch){
     // counts the number of occurrence of ch in str
     // str must not be null
@@ -86,432 +208,1766 @@ static unsigned int scstr_count(const char * str, int ch){
     return cnt;
 }
 
-static char * ctld_read_file(char * filename){
-    FILE * f = fopen(filename, "r");
-    if (!f){
+static int ctld_label_count(const char * name){
+    return scstr_count(name, '.') + 1;
+}
+
+/*
+ * Maps a file in memory (read-only). Files which can not be mapped (pipes,
+ * empty files) are read into a buffer instead; mapped tells which one
+ * ctld_unmap_file() must undo. The data is not null-terminated.
+ *
+ * Returns the data or NULL on failure.
+ */
+static char * ctld_map_file(const char * filename, size_t * len, int * mapped){
+    int fd = open(filename, O_RDONLY);
+    if (fd < 0){
         perror("ERROR");
         return NULL;
     }
-    fseek(f, 0, SEEK_END);
-    long size = ftell(f);
-    fseek(f, 0, SEEK_SET);
-    char * data = (char*) malloc(size+1);
-    if (!data){
-#ifdef DEBUG
-        fprintf(stderr, "ERROR: malloc() failed\n");
-#endif
-        return NULL;
+    struct stat st;
+    char * data = NULL;
+    *len = 0;
+    *mapped = 0;
+    if (fstat(fd, &st) == 0 && S_ISREG(st.st_mode) && st.st_size > 0){
+        data = (char*) mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (data != MAP_FAILED){
+            *len = st.st_size;
+            *mapped = 1;
+            close(fd);
+            return data;
+        }
+        data = NULL;
+    }
+    size_t size = 0;
+    for (;;){
+        if (*len == size){
+            size = size?size * 2:65536;
+            char * tmp = (char*) realloc(data, size);
+            if (!tmp)
+                break;
+            data = tmp;
+        }
+        ssize_t n = read(fd, data + *len, size - *len);
+        if (n == 0){
+            close(fd);
+            return data?data:(char*) malloc(1);
+        }
+        if (n < 0)
+            break;
+        *len += n;
     }
-    size_t read = fread(data, 1, size, f);
-    if (read != size){
 #ifdef DEBUG
-        fprintf(stderr, "Can not read the file...\n");
+    fprintf(stderr, "Can not read the file...\n");
 #endif
-        return NULL;
-    }
-    data[size] = '\0';
-    fclose(f);
-    return data;
+    free(data);
+    close(fd);
+    return NULL;
 }
 
 
-static ctld_result * ctld_choose_best(PCLIST all_match, char * domain){
-    ctld_node * best = NULL;
-    ctld_node * item = NULL;
-    unsigned long int level = 0;
-    unsigned long int tmp_level = 0;
-    unsigned long int domain_len = strlen(domain);
-    unsigned long int tmp_len = 0;
-    for (int i=0; i<= all_match->last_item; ++i){
-        item = (ctld_node *)all_match->list[i];
-        tmp_len = strlen(item->name);
-        tmp_level = scstr_count(item->name, '.') + 1;
-        if (item->has_priority){   // get the one with the priority
-            best = item;
-            break;
-        }
-        if ( tmp_level> level || best == NULL){
-            if (item->name[0] == '*')   // we don't match as * will be empty
-                if (domain_len <= tmp_len - 2)
-                    continue;
-            level = tmp_level;
-            best = item;
-            continue;
+static void ctld_unmap_file(char * data, size_t len, int mapped){
+    if (mapped)
+        munmap(data, len);
+    else
+        free(data);
+}
+
+
+/*
+ * Reads a list of numbers like "0-3,8,10-11" (the format of the node and
+ * CPU lists in sysfs) and sets set[i] to 1 for each number i below size.
+ *
+ * Returns the highest number in the list + 1 (at most size) or -1 if the
+ * file can not be read.
+ */
+static int ctld_numa_read_list(const char * path, unsigned char * set, int size){
+    FILE * fp = fopen(path, "r");
+    if (!fp)
+        return -1;
+    char line[4096];
+    int count = 0;
+    memset(set, 0, size);
+    if (fgets(line, sizeof(line), fp)){
+        char * p = line;
+        while (*p >= '0' && *p <= '9'){
+            long first = strtol(p, &p, 10);
+            long last = first;
+            if (*p == '-')
+                last = strtol(p + 1, &p, 10);
+            for (long i=first; i<= last && i< size; ++i){
+                set[i] = 1;
+                if (i >= count)
+                    count = i + 1;
+            }
+            if (*p == ',')
+                p++;
         }
     }
-    if (!best || !best->name)
-        return NULL;
-    // we have one candidate
-    char * tmp = NULL;
-    tmp = best->name[0] == '*'?strdup(best->name + 2):strdup(best->name);
-    ctld_result * result = (ctld_result*) malloc(sizeof(ctld_result));
-    if (!result){
-        free(tmp);
-        return NULL;
-    }
-    result->suffix = NULL;
-    result->registered_domain = NULL;
-    result->fqdn = NULL;
-    result->domain = NULL;
-    PSTR str = str_init(tmp);
-    free(tmp);
-    PSTR str_domain = str_init(domain);
-    PSPLITLIST str_split = NULL;
-    int max_split;
-    // make sure to split based on dot but not the suffix part
-    max_split = str_domain->str_count(str_domain, ".") - str->str_count(str, ".");
-    str_split = str_domain->str_split(str_domain, ".", max_split);
-    if (best->has_priority){
-        // first part is domain name and the rest is tld
-        PSPLITLIST  str_tmp_split = str->str_split(str, ".", 1);
-        result->suffix = strdup(str_tmp_split->list[1]);
-        str->str_setval(str, result->suffix);
-        str_free_splitlist(str_tmp_split);
-    }else if (best->name[0] == '*'){
-        str->str_prepend_char(str, '.');
-        str->str_prepend_string(str, str_split->list[str_split->len -2]);
-        result->suffix = str->str_copy(str);
-    }else{
-        // suffix is exactly what it is
-        result->suffix = str->str_copy(str);
-    }
-    // now the suffix might be different and we need to re-split
-    str_free_splitlist(str_split);
-    max_split =  str_domain->str_count(str_domain, ".") - str->str_count(str, ".");
-    str_split = str_domain->str_split(str_domain, ".", max_split);
+    fclose(fp);
+    return count;
+}
 
-    result->domain = str_split->len <= 1?NULL:strdup(str_split->list[str_split->len -2]);
-    unsigned long int len_domain = 0, len_suffix = 0;
-    len_suffix = str->len;
-    str_free_splitlist(str_split);
 
-    str_free(str);
-    if (result->domain){
-        len_domain = strlen(result->domain);
-        result->registered_domain = (char*) malloc(len_domain + len_suffix + 2);
-    }
-    if (result->registered_domain){
-        memcpy(result->registered_domain, result->domain, len_domain);
-        memcpy(result->registered_domain + len_domain, (const char*)".", 1);
-        memcpy(result->registered_domain + len_domain + 1, result->suffix, len_suffix);
-        result->registered_domain[len_domain + len_suffix + 1] = '\0';
-    }
-    str_free(str_domain);
-    result->fqdn = result->domain?strdup(domain):NULL;
-    return result;
+/*
+ * Size of the mapping of a NUMA replica of ctx (whole pages).
+ */
+static size_t ctld_replica_size(const ctld_ctx * ctx){
+    size_t page = sysconf(_SC_PAGESIZE);
+    return (CTLD_REPLICA_OFFSET + ctx->index->size + page - 1) / page * page;
 }
 
-static int ctld_parse_list(char * data, cdict_ctx* list_public, cdict_ctx* list_private){
-    if (!data){
-#ifdef DEBUG
-        fprintf(stderr, "Can not get the data from file...\n");
-#endif
-        return 1;
-    }
-    PSTR str = str_init(NULL);
-    str->str_setval(str, data);
-    PSPLITLIST plst = str->str_split(str, "\n", -1);
-    if (!plst){
-#ifdef DEBUG
-        fprintf(stdout, "Can not split the list\n");
-#endif
-        return 1;
-    }
-    PSTR line = str_init(NULL);
-    str_free(str);
-    char * stripped_line = NULL;
-    int start_icann_part = 0;
-    int end_icann_part = 0;
-    int start_private_part = 0;
-    int end_private_part = 0;
-    char * tmp_str = NULL;
-    for (int i=0; i< plst->len; ++i){
-        line->str_setval(line, plst->list[i]);
-        stripped_line = line->str_rstrip(line, NULL);
-        line->str_setval(line, stripped_line);
-        free(stripped_line);
-        if (line->str_find(line, "===BEGIN ICANN DOMAINS===") != -1)
-            start_icann_part = 1;
-        if (line->str_find(line, "===END ICANN DOMAINS===") != -1)
-            end_icann_part = 1;
-        if (line->str_find(line, "===BEGIN PRIVATE DOMAINS===") != -1)
-            start_private_part = 1;
-        if (line->str_find(line, "===END PRIVATE DOMAINS===") != -1)
-            end_private_part = 1;
-        if (line->str_startswith(line, "//"))
-            continue;
-        if (strcmp(line->str, "") == 0)
-            continue;
-        // print only public list
-        if (start_private_part == 1 && end_private_part == 0){
-            struct ctld_node * new_node = (struct ctld_node*) malloc(sizeof(struct ctld_node));
-            if (!new_node){
-#ifdef DEBUG
-                fprintf(stderr, "ERROR: malloc() failed\n");
-#endif
-                continue;
-            }
-            new_node->is_private = 1;
-            new_node->has_priority = line->len && line->str[0] == '!'?1:0;
-            tmp_str = new_node->has_priority?line->str_copy(line):NULL;
-            new_node->name = tmp_str?strdup(tmp_str+1):line->str_copy(line);
-            cdict_set(list_private, new_node->name, (void*) new_node);
-            free(tmp_str);
-            // if we have IDNA, add another node to the list
-            int idna_result;
-            char * idna_out = NULL;
-            if ((idna_result = idna_to_ascii_8z(new_node->name, &idna_out, IDN2_NONTRANSITIONAL)) == 0){
-                if (idna_out && cstr_ccmp(idna_out, new_node->name) != 0){
-                    // here we have IDNA, we need to add a new node for this
-                    struct ctld_node * new_node_idna = (struct ctld_node*) malloc(sizeof(struct ctld_node));
-                    if (!new_node_idna){
-#ifdef DEBUG
-                        fprintf(stderr, "ERROR: malloc() failed\n");
-#endif  
-                        free(idna_out);
-                        continue;
-                    }
-                    new_node_idna->is_private = 1;
-                    new_node_idna->has_priority = line->len && line->str[0] == '!'?1:0;
-                    new_node_idna->name = strdup(idna_out);
-                    cdict_set(list_private, new_node_idna->name, (void*) new_node_idna);
-                    free(idna_out);
-                }else{
-                    if (idna_out){
-                        free(idna_out);
-                        idna_out = NULL;
-                    }
-                }
-            }
-            continue;
-        }
-        if(start_icann_part == 1 && end_icann_part == 0){
-            struct ctld_node * new_node = (struct ctld_node*) malloc(sizeof(struct ctld_node));
-            if (!new_node){
-#ifdef DEBUG
-                fprintf(stderr, "ERROR: malloc() failed\n");
-#endif
-                continue;
-            }
-            new_node->is_private = 0;
-            new_node->has_priority = line->len && line->str[0] == '!'?1:0;
-            tmp_str = new_node->has_priority?line->str_copy(line):NULL;
-            new_node->name = tmp_str?strdup(tmp_str+1):line->str_copy(line);
-            free(tmp_str);
-            cdict_set(list_public, new_node->name, (void*)new_node);
-            // if we have IDNA, add another node to the list
-            int idna_result;
-            char * idna_out = NULL;
-            if ((idna_result = idna_to_ascii_8z(new_node->name, &idna_out, IDN2_NONTRANSITIONAL)) == 0){
-                if (idna_out && cstr_ccmp(idna_out, new_node->name) != 0){
-                    // here we have IDNA, we need to add a new node for this
-                    struct ctld_node * new_node_idna = (struct ctld_node*) malloc(sizeof(struct ctld_node));
-                    if (!new_node_idna){
-#ifdef DEBUG
-                        fprintf(stderr, "ERROR: malloc() failed\n");
-#endif
-                        free(idna_out);
-                        continue;
-                    }
-                    new_node_idna->is_private = 0;
-                    new_node_idna->has_priority = line->len && line->str[0] == '!'?1:0;
-                    new_node_idna->name = strdup(idna_out);
-                    cdict_set(list_public, new_node_idna->name, (void*) new_node_idna);
-                    free(idna_out);
-                }else{
-                    if (idna_out){
-                        free(idna_out);
-                        idna_out = NULL;
-                    }
-                }
-            }
-            continue;
-        }
-    }
-    str_free_splitlist(plst);
-    str_free(line);
-    return 0;
+
+/*
+ * Copies the context and its index to replica. The copy has no replicas of
+ * its own and does not own its index (it goes away with the mapping).
+ */
+static void ctld_replica_fill(const ctld_ctx * ctx, ctld_ctx * replica){
+    ctld_index_header * index = (ctld_index_header*)((char*) replica + CTLD_REPLICA_OFFSET);
+    memcpy(index, ctx->index, ctx->index->size);
+    // only the configuration is copied, the replica has no errcode or copies of its own
+    memset(replica, 0, sizeof(ctld_ctx));
+    replica->layout = ctx->layout;
+    replica->sections = ctx->sections;
+    replica->unicode_rules = ctx->unicode_rules;
+    replica->hash_seed = ctx->hash_seed;
+    ctld_index_use(replica, index, 0);
 }
 
 
-/**
- * @brief Adds custom suffix to the public part of PSL
- * @param ctx Context returned by ctld_parse_file() or ctld_parse_string()
- * @param suffix your new suffix to add to the suffix list
- * 
- * Why you should add custom suffix to the list?
- * Sometimes the suffix is not in the PSL list (at least not in the public part)
- * but it has a separate WHOIS server. You may want to distinguish those suffixes
- * and treat them like they are public suffixes. In this case, you can use this 
- * function to add whatever suffix you want.
- *
- * @return 0 on success or other values on failure
- *
- * Possible error values:
- *  - 1 if context or suffix is NULL or empty
- *  - 2 if suffix already exists in the public part of PSL
- *  - 3 if allocation function(malloc()) failed
- *
+/*
+ * Runs on the CPUs of one node, so the pages of the copy are allocated
+ * there on the first write.
  */
-int ctld_add_custom_suffix(ctld_ctx * ctx, char * suffix){
-    if (!ctx || !suffix || strlen(suffix) == 0)
-        return 1;
-    if (cdict_get_nocase(ctx->list_public, suffix) != NULL)
-        return 2;       // we already have it
-    // we don't have it let's add it
-    // TODO:
-    struct ctld_node * new_node = (struct ctld_node*) malloc(sizeof(struct ctld_node));
-    if (!new_node){
-        return 3;
+static void * ctld_numa_copy_thread(void * arg){
+    ctld_numa_copy * copy = (ctld_numa_copy*) arg;
+    ctld_replica_fill(copy->ctx, copy->replica);
+    return NULL;
+}
+
+
+static void ctld_replicas_free(ctld_ctx * ctx){
+    if (ctx->replicas){
+        for (int node=0; node< ctx->replica_nodes; ++node){
+            if (ctx->replicas[node])
+                munmap(ctx->replicas[node], ctld_replica_size(ctx->replicas[node]));
+        }
     }
-    new_node->is_private = 0;
-    new_node->has_priority = 0;
-    new_node->name = strdup(suffix);
-    cdict_set(ctx->list_public, new_node->name, (void*) new_node);
-    return 0;
-}   
+    free(ctx->replicas);
+    free(ctx->cpu_node);
+    ctx->replicas = NULL;
+    ctx->replica_nodes = 0;
+    ctx->cpu_node = NULL;
+    ctx->cpu_count = 0;
+}
 
 
-/**
- * @brief free the memory used by ctld_result structure
- * 
- * This should be called by users to free the allocated memory.
- *
- * @param res the return result of the ctld_parse() API
- * @return Nothing
+/*
+ * Returns the replica of the NUMA node of the CPU running the calling
+ * thread (sched_getcpu() is a vDSO call, no system call), or ctx itself
+ * if that node has no replica.
  */
-void ctld_result_free(ctld_result* res){
-    if (!res)
-        return;
-    free(res->domain);
-    free(res->fqdn);
-    free(res->registered_domain);
-    free(res->suffix);
-    free(res);
-    return;
+static ctld_ctx * ctld_local_replica(ctld_ctx * ctx){
+    int cpu = sched_getcpu();
+    int node = cpu >= 0 && cpu < ctx->cpu_count?ctx->cpu_node[cpu]:0;
+    ctld_ctx * replica = node < ctx->replica_nodes?ctx->replicas[node]:NULL;
+    return replica?replica:ctx;
 }
 
 
-/**
- * @brief free the memory used by ctld context
- * 
- * This should be called by users to free the allocated memory.
- *
- * @param ctx the context created by ctld_parse_file()
- * @return Nothing
+static const ctld_index_entry * ctld_index_entries(const ctld_ctx * ctx){
+    return (const ctld_index_entry*)((const char*) ctx->index + ctx->index->entries);
+}
+
+
+static const char * ctld_index_name(const ctld_ctx * ctx, const ctld_index_entry * entry){
+    return (const char*) ctx->index + ctx->index->names + entry->name;
+}
+
+
+/*
+ * Returns the flags of the name (len bytes of key, case-insensitive) in the
+ * index or 0 if the index does not have it.
  */
-void ctld_free(ctld_ctx * ctx){
-    if (!ctx)
-        return;
-    if (ctx->list_public)
-        cdict_free(ctx->list_public);
-    if (ctx->list_private)
-        cdict_free(ctx->list_private);
-    free(ctx);
-    return;
+static int ctld_index_find(const ctld_ctx * ctx, const char * key, size_t len){
+    uint64_t h = CTLD_HASH_INIT;
+    for (size_t i=len; i-- > 0;)
+        h = CTLD_HASH_STEP(h, key[i]);
+    return ctld_index_probe(ctx, h, key, len);
 }
 
 
-/**
- * @brief parse the PSL data from a null-terminated memory.
- * 
- * the memory should be free by users if it needs to be freed.
- *
- * @param data A pointer to a null-terminated string containing PSL data.
- * @return a pointer to the ctld context which can be used in ctld_parse()
+/*
+ * Same as ctld_index_find() with the hash of the key already computed
+ * (see CTLD_HASH_STEP). The perfect hash function gives one slot, so there
+ * is one probe and at most one comparison.
  */
-ctld_ctx * ctld_parse_string(char * data){
-    ctld_ctx * ctx = ctld_init();
-    if (!ctx){
-        return NULL;
+static int ctld_index_probe(const ctld_ctx * ctx, uint64_t h, const char * key, size_t len){
+    if (ctx->index->layout == CTLD_LAYOUT_COMPACT)
+        return ctld_compact_probe(ctx, key, len);
+    if (!ctx->mph_n)
+        return 0;
+    const cmphf mph = {ctx->mph_n, ctx->mph_buckets, ctx->mph_seed, ctx->mph_disp};
+    const ctld_index_entry * entry = ctld_index_entries(ctx) + cmphf_lookup(&mph, h);
+    if (entry->hash != h || entry->len != len)
+        return 0;
+    const char * name = ctld_index_name(ctx, entry);
+    for (size_t i=0; i< len; ++i){
+        if (cto_lower(key[i]) != name[i])
+            return 0;
     }
-    ctx->errcode = 0;
-    if (ctld_parse_list(data, ctx->list_public, ctx->list_private)){
-#ifdef DEBUG
-        fprintf(stderr, "Something is wrong in parsing list...\n");
-#endif
-        return NULL;
+    return entry->flags;
+}
+
+
+/*
+ * Compares the key (len bytes, read backwards and lower-cased) with a
+ * reversed name of the compact layout, like strcmp().
+ */
+static int ctld_compact_cmp(const char * key, size_t len, const unsigned char * name, size_t name_len){
+    for (size_t i=0; i< len && i< name_len; ++i){
+        int c = (unsigned char) cto_lower(key[len - 1 - i]);
+        if (c != name[i])
+            return c - name[i];
     }
-    // now we have list_private and list_public
-    // print 10 public
-    return ctx;
+    return (len > name_len) - (len < name_len);
 }
 
 
+/*
+ * Decodes the front-coded name at p. name holds the previous name of the
+ * block (it is updated in place) and len its length. Returns the position
+ * of the next name and sets flags.
+ */
+static const unsigned char * ctld_compact_decode(const unsigned char * p, int first, unsigned char * name, size_t * len, int * flags){
+    size_t shared = first?0:*p++;
+    size_t rest = *p++;
+    memcpy(name + shared, p, rest);
+    *len = shared + rest;
+    *flags = p[rest];
+    return p + rest + 1;
+}
 
-/**
- * @brief parse PSL data by passing the filename.
- * 
- * @param filename A pointer to a null-terminated string contains the name of the file.
- * @return a pointer to the ctld context which can be used in ctld_parse()
+
+/*
+ * ctld_index_probe() for the compact layout: a binary search over the first
+ * names of the blocks and a scan of the block which can hold the key.
  */
-ctld_ctx * ctld_parse_file(char * filename){
-    char * data = ctld_read_file(filename);
-    ctld_ctx * ctx = ctld_init();
-    if (!ctx){
-        return NULL;
+static int ctld_compact_probe(const ctld_ctx * ctx, const char * key, size_t len){
+    const ctld_index_header * index = ctx->index;
+    const uint32_t * blocks = (const uint32_t*)((const char*) index + index->entries);
+    const unsigned char * names = (const unsigned char*) index + index->names;
+    uint32_t nblocks = (index->count + CTLD_COMPACT_BLOCK - 1) / CTLD_COMPACT_BLOCK;
+    if (!nblocks || len > CTLD_COMPACT_MAX_NAME)
+        return 0;
+    // the last block whose first name is not after the key
+    uint32_t lo = 0, hi = nblocks;
+    while (hi - lo > 1){
+        uint32_t mid = lo + (hi - lo) / 2;
+        const unsigned char * first = names + blocks[mid];
+        if (ctld_compact_cmp(key, len, first + 1, first[0]) < 0)
+            hi = mid;
+        else
+            lo = mid;
     }
-    ctx->errcode = 0;
-    if (ctld_parse_list(data, ctx->list_public, ctx->list_private)){
-#ifdef DEBUG
-        fprintf(stdout, "Something is wrong in parsing list...\n");
-#endif
-        return NULL;
+    unsigned char name[CTLD_COMPACT_MAX_NAME];
+    size_t name_len = 0;
+    int flags;
+    const unsigned char * p = names + blocks[lo];
+    uint32_t count = index->count - lo * CTLD_COMPACT_BLOCK;
+    if (count > CTLD_COMPACT_BLOCK)
+        count = CTLD_COMPACT_BLOCK;
+    for (uint32_t i=0; i< count; ++i){
+        p = ctld_compact_decode(p, i == 0, name, &name_len, &flags);
+        int cmp = ctld_compact_cmp(key, len, name, name_len);
+        if (cmp == 0)
+            return flags;
+        if (cmp < 0)
+            break;
     }
-    free(data);
-    // now we have list_private and list_public
-    // print 10 public
-    return ctx;
+    return 0;
 }
 
 
-/**
- * @brief check if the domain name contains illegal character
- * 
- * One needs to be very careful to use this function. some companies have illegal
- * characters like '_' in the subdomain part of the domain name. So only use this
- * function if you know what you are doing.
- *
- * @param domain A pointer to a null-terminated string (domain name)
- * @return 1 on success and 0 on failure
+/*
+ * Looks up a top-level label (len bytes, h is its hash) in the direct
+ * tables of the index. Returns 1 and sets value (see CTLD_TLD_*) if the
+ * tables cover the label and 0 if the index must be probed instead.
  */
-int ctld_is_domain_valid(char * domain){
-    // simple checks to see if the fully-qualified domain is valid
-    // the domain must have atleast one dot
-    // at least 4 characters
-    // no special character
-    // returns 1 if valid 0 if invalid
-    if (!domain)
-        return 0;
-    PSTR str = str_init(domain);
-    if (str->str_len(str) < 4){
-        str_free(str);
+static int ctld_tld_find(const ctld_ctx * ctx, const char * label, size_t len, uint64_t h, uint32_t * value){
+    const ctld_index_header * index = ctx->index;
+    if (!index->tld2)
         return 0;
+    if (len == 2){
+        unsigned int a = (unsigned int)(cto_lower(label[0]) - 'a');
+        unsigned int b = (unsigned int)(cto_lower(label[1]) - 'a');
+        if (a >= 26 || b >= 26)
+            return 0;
+        *value = ((const uint32_t*)((const char*) index + index->tld2))[a * 26 + b];
+        return 1;
     }
-    if (str->str_find(str, ".") == -1){
-        str_free(str);
+    if (len < 3 || len > CTLD_GTLD_MAX_LEN)
         return 0;
+    const ctld_gtld_slot * slot = (const ctld_gtld_slot*)((const char*) index + index->gtld)
+                                  + (cmphf_mix(h ^ index->gtld_seed) & (CTLD_GTLD_SLOTS - 1));
+    for (size_t i=0; i< len; ++i){
+        if (slot->name[i] != cto_lower(label[i]))
+            return 0;
     }
-    if (str->str_any_of_in(str, "!@#$%^&*()_+=\\/,|'\"")){
-        str_free(str);
+    if (slot->name[len] != '\0')
         return 0;
-    }
-    str_free(str);
+    *value = slot->value;
     return 1;
 }
 
 
-/**
- * @brief parse the passed domain name based on the PSL and returns the result structure.
+/*
+ * Looks up a key (a name or "*." followed by a name) in the overlay.
+ * hidden is set to 1 if the overlay defines or removes the key, which hides
+ * the same rule of the base context in both sections. Returns the rule of
+ * the overlay or NULL.
+ */
+static const ctld_node * ctld_overlay_find(const ctld_overlay * overlay, const char * key, int * hidden){
+    ctld_overlay_rule * rule = ctld_overlay_slot(overlay, key, ctld_hash_nocase(key));
+    *hidden = rule->name != NULL;
+    return rule->node;
+}
+
+
+/*
+ * Updates the best match (or the longest exception) with a new candidate.
+ * Longer rules win, an exception always wins and on a tie an exact rule
+ * beats a wildcard rule covering the same labels.
+ */
+static void ctld_consider(ctld_match * best, ctld_match * exception, const char * name, int is_private,
+                          int kind, int level, const char * suffix){
+    ctld_match * target = kind == CTLD_MATCH_EXCEPTION?exception:best;
+    if (kind == CTLD_MATCH_EXCEPTION){
+        if (level <= exception->level)
+            return;
+    }else if (!(level > best->level || (level == best->level && kind == CTLD_MATCH_EXACT && best->kind == CTLD_MATCH_WILDCARD))){
+        return;
+    }
+    target->name = name;
+    target->is_private = is_private;
+    target->kind = kind;
+    target->level = level;
+    target->suffix = suffix;
+}
+
+
+/*
+ * Walks the labels of the domain from right to left and finds the rule that
+ * wins based on the PSL algorithm. Only the rightmost ctx->max_depth labels
+ * can be covered by a rule, so the number of probes does not depend on
+ * the number of labels in the domain. Each suffix of the domain is looked
+ * up once in the index: its entry tells if the suffix is a rule, an
+ * exception or the parent of a wildcard rule, in both sections.
  *
- * @param ctx context created by calling ctld_parse_file() or ctld_parse_string()
- * @param domain the domain name you want to parse
- * @param use_private_suffix 0 means do not use private part of the PSL and 1 means 
- * using the private part of the PSL.
- * 
- * This is the main API of the library.
+ * The names of the index are hashed from right to left, so the hash of the
+ * growing suffix is updated with each new byte and every byte of the domain
+ * is read once by the walk; nothing is copied to probe the index.
  *
- * @return Returns an instance of ctld_result on success and NULL on failure.
+ * The same walk also finds the rule that wins when only the ICANN section is
+ * used (icann_match, can be NULL). Both are the same if use_private_suffix is 0.
+ *
+ * If overlay is not NULL, its rules are consulted before the rules of ctx.
+ * Suffixes added by ctld_add_custom_suffix() are indexed first. If ctx has
+ * NUMA replicas, the one of the node of the calling thread is used.
+ *
+ * Returns 1 if a rule matches and 0 otherwise.
+ */
+static int ctld_find_rule(ctld_ctx * ctx, const ctld_overlay * overlay, const char * domain,
+                          int use_private_suffix, ctld_match * match, ctld_match * icann_match){
+    if (ctx->replicas)
+        ctx = ctld_local_replica(ctx);
+    int sections = use_private_suffix?2:1;
+    int max_depth = overlay && overlay->max_depth > ctx->max_depth?overlay->max_depth:ctx->max_depth;
+    // [0] uses the ICANN section only, [1] uses both sections
+    ctld_match best[2] = {{NULL, 0, 0, 0, NULL}, {NULL, 0, 0, 0, NULL}};
+    ctld_match exception[2] = {{NULL, 0, 0, 0, NULL}, {NULL, 0, 0, 0, NULL}};
+    char stack_key[CTLD_KEY_BUFFER];
+    char * key = NULL;          // "*." keys are only built for the overlay
+    size_t domain_len = strlen(domain);
+    const char * end = domain + domain_len;
+    const char * tail = end;
+    const char * prev_tail = NULL;
+    int depth = 0;
+    uint64_t h = CTLD_HASH_INIT;     // hash of the suffix starting at tail
+    int use_overlay = overlay && overlay->len;
+    if (use_overlay){
+        key = domain_len + 3 > CTLD_KEY_BUFFER?(char*) malloc(domain_len + 3):stack_key;
+        if (!key)
+            return 0;
+        key[0] = '*';
+        key[1] = '.';
+    }
+    while (tail > domain && depth < max_depth){
+        // move to the start of the next label
+        prev_tail = tail;
+        if (tail < end){
+            tail--;             // the dot
+            h = CTLD_HASH_STEP(h, *tail);
+        }
+        while (tail > domain && *(tail - 1) != '.'){
+            tail--;
+            h = CTLD_HASH_STEP(h, *tail);
+        }
+        depth++;
+        int flags;
+        uint32_t tld;
+        if (depth == 1 && ctld_tld_find(ctx, tail, end - tail, h, &tld)){
+            // the direct tables also tell how deep the rules under this label go
+            int limit = (tld >> (use_private_suffix?CTLD_TLD_ALL_SHIFT:CTLD_TLD_ICANN_SHIFT)) & 0xf;
+            if (!use_overlay && limit != CTLD_TLD_NO_LIMIT && limit < max_depth)
+                max_depth = limit;
+            flags = tld & CTLD_TLD_FLAGS_MASK;
+        }else{
+            flags = ctld_index_probe(ctx, h, tail, end - tail);
+        }
+        // the label covered by a wildcard rule under this suffix: *.a.b.c
+        const char * label = NULL;
+        if (tail > domain && depth + 1 <= max_depth){
+            label = tail - 1;
+            while (label > domain && *(label - 1) != '.')
+                label--;
+        }
+        // a rule of the index has the same labels as the suffix (the case is fixed by ctld_build_result())
+        const char * name = tail;
+        if (use_overlay){
+            int hidden;
+            const ctld_node * node = ctld_overlay_find(overlay, tail, &hidden);
+            if (hidden)
+                flags &= ~((CTLD_RULE_EXACT | CTLD_RULE_EXCEPTION) * (1 | 1 << CTLD_RULE_PRIVATE_SHIFT));
+            if (node && node->is_private < sections){
+                int kind = node->has_priority?CTLD_MATCH_EXCEPTION:CTLD_MATCH_EXACT;
+                const char * suffix = kind == CTLD_MATCH_EXCEPTION?(prev_tail < end?prev_tail:NULL):tail;
+                for (int view=node->is_private; view< 2 && suffix; ++view)
+                    ctld_consider(&best[view], &exception[view], node->name, node->is_private, kind, depth, suffix);
+            }
+            if (label){
+                memcpy(key + 2, tail, end - tail + 1);
+                node = ctld_overlay_find(overlay, key, &hidden);
+                if (hidden)
+                    flags &= ~(CTLD_RULE_WILDCARD * (1 | 1 << CTLD_RULE_PRIVATE_SHIFT));
+                if (node && node->is_private < sections){
+                    for (int view=node->is_private; view< 2; ++view)
+                        ctld_consider(&best[view], &exception[view], node->name + 2, node->is_private,
+                                      CTLD_MATCH_WILDCARD, depth + 1, label);
+                }
+            }
+        }
+        for (int i=0; i< sections && flags; ++i){
+            int section_flags = (flags >> (i * CTLD_RULE_PRIVATE_SHIFT)) & (CTLD_RULE_EXACT | CTLD_RULE_WILDCARD | CTLD_RULE_EXCEPTION);
+            for (int view=i; view< 2 && section_flags; ++view){
+                if (section_flags & CTLD_RULE_EXACT)
+                    ctld_consider(&best[view], &exception[view], name, i, CTLD_MATCH_EXACT, depth, tail);
+                // an exception rule with one label can not be used
+                if ((section_flags & CTLD_RULE_EXCEPTION) && prev_tail < end)
+                    ctld_consider(&best[view], &exception[view], name, i, CTLD_MATCH_EXCEPTION, depth, prev_tail);
+                if ((section_flags & CTLD_RULE_WILDCARD) && label)
+                    ctld_consider(&best[view], &exception[view], name, i, CTLD_MATCH_WILDCARD, depth + 1, label);
+            }
+        }
+    }
+    if (key && key != stack_key)
+        free(key);
+    for (int view=0; view< 2; ++view){
+        if (exception[view].name)
+            best[view] = exception[view];
+    }
+    if (icann_match)
+        *icann_match = best[0];
+    if (!best[1].name)
+        return 0;
+    *match = best[1];
+    return 1;
+}
+
+
+/*
+ * Makes the suffix and the registered domain of the domain based on a
+ * match. The part of the suffix covered by the rule is lower-cased like the
+ * rule itself and the part covered by the wildcard comes from the domain.
+ * The registered domain (and the domain label) is NULL if the domain itself
+ * is a public suffix.
+ *
+ * Returns 0 on success and 1 if malloc() fails.
+ */
+static int ctld_build_names(const ctld_match * match, const char * domain,
+                            char ** suffix, char ** registered_domain, char ** label_out){
+    const char * name = match->name;
+    size_t len_suffix = strlen(match->suffix);
+    *suffix = NULL;
+    *registered_domain = NULL;
+    if (label_out)
+        *label_out = NULL;
+    if (match->kind == CTLD_MATCH_EXCEPTION){
+        // the suffix is the rule without its first label
+        name = strchr(name, '.');
+        name = name?name + 1:"";
+    }
+    size_t len_name = strlen(name);
+    *suffix = (char*) malloc(len_suffix + 1);
+    if (!*suffix)
+        return 1;
+    if (len_name <= len_suffix){
+        memcpy(*suffix, match->suffix, len_suffix - len_name);
+        for (size_t i=0; i< len_name; ++i)
+            (*suffix)[len_suffix - len_name + i] = cto_lower(name[i]);
+    }else{
+        memcpy(*suffix, match->suffix, len_suffix);
+    }
+    (*suffix)[len_suffix] = '\0';
+    if (match->suffix == domain)
+        return 0;      // the domain itself is a public suffix
+    // the label right before the suffix
+    const char * label = match->suffix - 1;
+    while (label > domain && *(label - 1) != '.')
+        label--;
+    size_t len_domain = match->suffix - 1 - label;
+    *registered_domain = (char*) malloc(len_domain + len_suffix + 2);
+    if (!*registered_domain)
+        return 1;
+    memcpy(*registered_domain, label, len_domain);
+    (*registered_domain)[len_domain] = '.';
+    memcpy(*registered_domain + len_domain + 1, *suffix, len_suffix + 1);
+    if (label_out){
+        *label_out = (char*) malloc(len_domain + 1);
+        if (!*label_out)
+            return 1;
+        memcpy(*label_out, label, len_domain);
+        (*label_out)[len_domain] = '\0';
+    }
+    return 0;
+}
+
+
+/*
+ * Makes the result structure based on the rule that wins (match) and the
+ * rule that wins in the ICANN section (icann_match).
+ */
+static ctld_result * ctld_build_result(const ctld_match * match, const ctld_match * icann_match, const char * domain){
+    ctld_result * result = (ctld_result*) calloc(1, sizeof(ctld_result));
+    if (!result)
+        return NULL;
+    if (ctld_build_names(match, domain, &result->suffix, &result->registered_domain, &result->domain)){
+        ctld_result_free(result);
+        return NULL;
+    }
+    if (result->domain){
+        result->fqdn = strdup(domain);
+        if (!result->fqdn){
+            ctld_result_free(result);
+            return NULL;
+        }
+    }
+    result->is_private = match->is_private;
+    result->is_wildcard = match->kind == CTLD_MATCH_WILDCARD;
+    result->is_exception = match->kind == CTLD_MATCH_EXCEPTION;
+    result->rule = (char*) malloc(strlen(match->name) + 3);
+    if (!result->rule){
+        ctld_result_free(result);
+        return NULL;
+    }
+    sprintf(result->rule, "%s%s", result->is_exception?"!":result->is_wildcard?"*.":"", match->name);
+    for (char * c = result->rule; *c; ++c)
+        *c = cto_lower(*c);
+    if (!icann_match->name)
+        return result;      // only a private rule matches
+    int failed = 0;
+    if (icann_match->name == match->name && icann_match->kind == match->kind && icann_match->suffix == match->suffix){
+        result->icann_suffix = strdup(result->suffix);
+        failed = !result->icann_suffix;
+        if (result->registered_domain){
+            result->icann_registered_domain = strdup(result->registered_domain);
+            failed = failed || !result->icann_registered_domain;
+        }
+    }else{
+        failed = ctld_build_names(icann_match, domain, &result->icann_suffix, &result->icann_registered_domain, NULL);
+    }
+    if (failed){
+        ctld_result_free(result);
+        return NULL;
+    }
+    return result;
+}
+
+/*
+ * Builds the index of ctx from a PSL (len bytes of data). Only the rules
+ * between the section markers count, like in the PSL file.
+ * Returns 0 on success and 1 on failure.
+ */
+static int ctld_parse_list(const char * data, size_t len, ctld_ctx * ctx){
+    if (!data){
+#ifdef DEBUG
+        fprintf(stderr, "Can not get the data from file...\n");
+#endif
+        return 1;
+    }
+    ctld_rules rules = {NULL, 0, 0};
+    // all the rules are known, build the index once
+    if (ctld_rules_scan(&rules, data, len, ctx, 1) < 0 || ctld_rules_build(&rules, ctx)){
+#ifdef DEBUG
+        fprintf(stderr, "ERROR: Can not build the rule index\n");
+#endif
+        ctld_rules_free(&rules);
+        return 1;
+    }
+    ctld_rules_free(&rules);
+    return 0;
+}
+
+
+/*
+ * Walks len bytes of rules in PSL syntax once, in place, and adds them to
+ * the set. Only the first word of a line is used; comments only matter
+ * for the section markers. If marked is 1 the rules outside the markers
+ * are ignored (the PSL file), otherwise they go to the ICANN section.
+ * Rules of the sections ctx does not load are skipped.
+ *
+ * Returns the number of rules added or -1 if malloc() fails.
+ */
+static long ctld_rules_scan(ctld_rules * rules, const char * data, size_t len, const ctld_ctx * ctx, int marked){
+    int outside = marked?-1:0;          // section of the rules outside the markers (-1: ignored)
+    int section = outside;
+    long added = 0;
+    const char * line = data;
+    const char * data_end = data + len;
+    while (line < data_end){
+        const char * eol = (const char*) memchr(line, '\n', data_end - line);
+        if (!eol)
+            eol = data_end;
+        const char * p = line;
+        while (p < eol && (*p == ' ' || *p == '\t'))
+            p++;
+        if (eol - p >= 2 && p[0] == '/' && p[1] == '/'){
+            // only the markers matter in the comments
+            if (memchr(p, '=', eol - p)){
+                if (ctld_line_has(p, eol, "===BEGIN ICANN DOMAINS==="))
+                    section = 0;
+                else if (ctld_line_has(p, eol, "===BEGIN PRIVATE DOMAINS==="))
+                    section = 1;
+                else if (ctld_line_has(p, eol, "===END ICANN DOMAINS===") || ctld_line_has(p, eol, "===END PRIVATE DOMAINS==="))
+                    section = outside;
+            }
+        }else if (p < eol && section >= 0 && (ctx->sections & (section?CTLD_SECTION_PRIVATE:CTLD_SECTION_ICANN))){
+            const char * end = p;
+            while (end < eol && *end != ' ' && *end != '\t' && *end != '\r')
+                end++;
+            int ret = ctld_rules_add(rules, p, end - p, section, ctx->unicode_rules);
+            if (ret == 3)
+                return -1;
+            if (ret == 0)
+                added++;
+        }
+        line = eol + 1;
+    }
+    return added;
+}
+
+
+/*
+ * Appends one rule to the set. The set takes the ownership of name.
+ * Returns 0 on success and 3 if malloc() fails.
+ */
+static int ctld_rules_push(ctld_rules * rules, char * name, uint8_t flags){
+    if (rules->len == rules->size){
+        size_t size = rules->size?rules->size * 2:CTLD_RULES_INITIAL_SIZE;
+        ctld_rule_item * items = (ctld_rule_item*) realloc(rules->items, size * sizeof(ctld_rule_item));
+        if (!items){
+            free(name);
+            return 3;
+        }
+        rules->items = items;
+        rules->size = size;
+    }
+    rules->items[rules->len].name = name;
+    rules->items[rules->len].flags = flags;
+    rules->len++;
+    return 0;
+}
+
+
+/*
+ * Adds one rule (the first len bytes of rule in PSL syntax) to the given
+ * section of the set, and its ASCII form if the rule is an IDNA. Only the
+ * ASCII form is kept if unicode is 0. Wildcard and exception rules are
+ * stored under their labels with a flag.
+ *
+ * Returns 0 on success, 1 if the rule is empty and 3 if malloc() fails.
+ */
+static int ctld_rules_add(ctld_rules * rules, const char * rule, size_t len, int is_private, int unicode){
+    uint8_t flags = CTLD_RULE_EXACT;
+    if (len && rule[0] == '!'){
+        flags = CTLD_RULE_EXCEPTION;
+        rule++;
+        len--;
+    }else if (len >= 2 && rule[0] == '*' && rule[1] == '.'){
+        flags = CTLD_RULE_WILDCARD;
+        rule += 2;
+        len -= 2;
+    }
+    if (len == 0 || len > UINT16_MAX)
+        return 1;
+    if (is_private)
+        flags <<= CTLD_RULE_PRIVATE_SHIFT;
+    char * name = (char*) malloc(len + 1);
+    if (!name)
+        return 3;
+    int ascii = 1;
+    for (size_t i=0; i< len; ++i){
+        name[i] = cto_lower(rule[i]);
+        ascii = ascii && (unsigned char) rule[i] < 0x80;
+    }
+    name[len] = '\0';
+    // the ASCII form of an ASCII rule is the rule itself
+    char * idna_out = NULL;
+    if (!ascii && idna_to_ascii_8z(name, &idna_out, IDN2_NONTRANSITIONAL) != 0)
+        idna_out = NULL;
+    if (idna_out && (cstr_ccmp(idna_out, name) == 0 || strlen(idna_out) > UINT16_MAX)){
+        free(idna_out);
+        idna_out = NULL;
+    }
+    if (idna_out && !unicode){
+        free(name);
+        name = idna_out;
+        idna_out = NULL;
+    }
+    if (ctld_rules_push(rules, name, flags)){
+        free(idna_out);
+        return 3;
+    }
+    if (idna_out && ctld_rules_push(rules, idna_out, flags))
+        return 3;
+    return 0;
+}
+
+
+/*
+ * Adds the rules already in the index of ctx to the set.
+ * Returns 0 on success and 3 if malloc() fails.
+ */
+static int ctld_rules_from_index(ctld_rules * rules, const ctld_ctx * ctx){
+    if (!ctx->index)
+        return 0;
+    const ctld_index_header * index = ctx->index;
+    if (index->layout == CTLD_LAYOUT_COMPACT){
+        const uint32_t * blocks = (const uint32_t*)((const char*) index + index->entries);
+        const unsigned char * p = NULL;
+        unsigned char name[CTLD_COMPACT_MAX_NAME];
+        size_t len = 0;
+        int flags;
+        for (uint32_t i=0; i< index->count; ++i){
+            if (i % CTLD_COMPACT_BLOCK == 0)
+                p = (const unsigned char*) index + index->names + blocks[i / CTLD_COMPACT_BLOCK];
+            p = ctld_compact_decode(p, i % CTLD_COMPACT_BLOCK == 0, name, &len, &flags);
+            char * copy = (char*) malloc(len + 1);
+            if (!copy)
+                return 3;
+            for (size_t j=0; j< len; ++j)
+                copy[j] = name[len - 1 - j];
+            copy[len] = '\0';
+            if (ctld_rules_push(rules, copy, flags))
+                return 3;
+        }
+        return 0;
+    }
+    const ctld_index_entry * entries = ctld_index_entries(ctx);
+    for (uint32_t i=0; i< index->count; ++i){
+        char * name = strdup(ctld_index_name(ctx, &entries[i]));
+        if (!name || ctld_rules_push(rules, name, entries[i].flags))
+            return 3;
+    }
+    return 0;
+}
+
+
+static int ctld_rules_cmp(const void * a, const void * b){
+    return strcmp(((const ctld_rule_item*) a)->name, ((const ctld_rule_item*) b)->name);
+}
+
+
+/*
+ * Builds the index of the set and replaces the index of ctx with it. The
+ * rules with the same labels are merged into one entry first. The index
+ * uses ctx->layout unless a name is too long for the compact layout.
+ *
+ * Returns 0 on success and 1 on failure.
+ */
+static int ctld_rules_build(ctld_rules * rules, ctld_ctx * ctx){
+    size_t n = 0;
+    if (rules->len)
+        qsort(rules->items, rules->len, sizeof(ctld_rule_item), ctld_rules_cmp);
+    for (size_t i=0; i< rules->len; ++i){
+        if (n && strcmp(rules->items[n - 1].name, rules->items[i].name) == 0){
+            rules->items[n - 1].flags |= rules->items[i].flags;
+            free(rules->items[i].name);
+            continue;
+        }
+        rules->items[n++] = rules->items[i];
+    }
+    rules->len = n;
+    size_t names_len = 0;
+    size_t longest = 0;
+    int max_depth = 0;
+    for (size_t i=0; i< n; ++i){
+        const char * name = rules->items[i].name;
+        size_t len = strlen(name);
+        names_len += len + 1;
+        if (len > longest)
+            longest = len;
+        // a wildcard rule has one more label than its entry
+        int depth = ctld_label_count(name) + (rules->items[i].flags & (CTLD_RULE_WILDCARD | CTLD_RULE_WILDCARD << CTLD_RULE_PRIVATE_SHIFT)?1:0);
+        if (depth > max_depth)
+            max_depth = depth;
+    }
+    // both layouts start with the header and the tables of the top-level labels
+    size_t tld2_offset = sizeof(ctld_index_header);
+    size_t gtld_offset = (tld2_offset + CTLD_TLD2_SIZE * sizeof(uint32_t) + 7) & ~(size_t)7;
+    size_t start = gtld_offset + CTLD_GTLD_SLOTS * sizeof(ctld_gtld_slot);
+    int layout = ctx->layout == CTLD_LAYOUT_COMPACT && longest <= CTLD_COMPACT_MAX_NAME?CTLD_LAYOUT_COMPACT:CTLD_LAYOUT_HASH;
+    ctld_index_header * index;
+    if (layout == CTLD_LAYOUT_COMPACT)
+        index = ctld_index_build_compact(rules, start, names_len);
+    else
+        index = ctld_index_build_hash(rules, start, names_len, ctx->hash_seed);
+    if (!index)
+        return 1;
+    index->magic = CTLD_INDEX_MAGIC;
+    index->version = CTLD_INDEX_VERSION;
+    index->count = (uint32_t) n;
+    index->max_depth = max_depth;
+    index->layout = layout;
+    index->tld2 = (uint32_t) tld2_offset;
+    index->gtld = (uint32_t) gtld_offset;
+    ctld_tld_build(index, rules);
+    if (ctld_index_use(ctx, index, 1)){
+        free(index);
+        return 1;
+    }
+    return 0;
+}
+
+
+/*
+ * Allocates an index with the hash layout for the (merged) set and fills
+ * everything after start: the displacements, the entries and the names.
+ * seed is the first seed tried for the perfect hash function.
+ * Returns NULL on failure.
+ */
+static ctld_index_header * ctld_index_build_hash(const ctld_rules * rules, size_t start, size_t names_len, uint64_t seed){
+    size_t n = rules->len;
+    uint32_t buckets = cmphf_buckets(n);
+    size_t disp_offset = start;
+    size_t entries_offset = (disp_offset + buckets * sizeof(uint32_t) + 7) & ~(size_t)7;
+    size_t names_offset = entries_offset + n * sizeof(ctld_index_entry);
+    size_t size = names_offset + names_len;
+    if (size > UINT32_MAX)
+        return NULL;
+    ctld_index_header * index = (ctld_index_header*) calloc(1, size);
+    uint64_t * hashes = (uint64_t*) malloc((n?n:1) * sizeof(uint64_t));
+    uint32_t * slots = (uint32_t*) malloc((n?n:1) * sizeof(uint32_t));
+    if (!index || !hashes || !slots){
+        free(index);
+        free(hashes);
+        free(slots);
+        return NULL;
+    }
+    for (size_t i=0; i< n; ++i){
+        const char * name = rules->items[i].name;
+        uint64_t h = CTLD_HASH_INIT;
+        for (size_t j=strlen(name); j-- > 0;)
+            h = CTLD_HASH_STEP(h, name[j]);
+        hashes[i] = h;
+    }
+    cmphf mph;
+    if (cmphf_build(&mph, hashes, (uint32_t) n, (uint32_t*)((char*) index + disp_offset), slots, seed)){
+        free(index);
+        free(hashes);
+        free(slots);
+        return NULL;
+    }
+    ctld_index_entry * entries = (ctld_index_entry*)((char*) index + entries_offset);
+    char * names = (char*) index + names_offset;
+    size_t pos = 0;
+    for (size_t i=0; i< n; ++i){
+        const char * name = rules->items[i].name;
+        size_t len = strlen(name);
+        ctld_index_entry * entry = &entries[slots[i]];
+        entry->hash = hashes[i];
+        entry->name = (uint32_t) pos;
+        entry->len = (uint16_t) len;
+        entry->flags = rules->items[i].flags;
+        memcpy(names + pos, name, len + 1);
+        pos += len + 1;
+    }
+    index->size = size;
+    index->seed = mph.seed;
+    index->buckets = buckets;
+    index->disp = (uint32_t) disp_offset;
+    index->entries = (uint32_t) entries_offset;
+    index->names = (uint32_t) names_offset;
+    index->names_len = (uint32_t) names_len;
+    free(hashes);
+    free(slots);
+    return index;
+}
+
+
+/*
+ * Allocates an index with the compact layout for the (merged) set and
+ * fills everything after start: the offsets of the blocks and the
+ * front-coded names. Every name must fit in CTLD_COMPACT_MAX_NAME bytes.
+ * Returns NULL on failure.
+ */
+static ctld_index_header * ctld_index_build_compact(const ctld_rules * rules, size_t start, size_t names_len){
+    size_t n = rules->len;
+    ctld_rule_item * items = (ctld_rule_item*) malloc((n?n:1) * sizeof(ctld_rule_item));
+    char * reversed = (char*) malloc(names_len + 1);
+    if (!items || !reversed){
+        free(items);
+        free(reversed);
+        return NULL;
+    }
+    size_t pos = 0;
+    for (size_t i=0; i< n; ++i){
+        const char * name = rules->items[i].name;
+        size_t len = strlen(name);
+        items[i].name = reversed + pos;
+        items[i].flags = rules->items[i].flags;
+        for (size_t j=0; j< len; ++j)
+            reversed[pos + j] = name[len - 1 - j];
+        reversed[pos + len] = '\0';
+        pos += len + 1;
+    }
+    if (n)
+        qsort(items, n, sizeof(ctld_rule_item), ctld_rules_cmp);
+    // the size of the front-coded names
+    size_t nblocks = (n + CTLD_COMPACT_BLOCK - 1) / CTLD_COMPACT_BLOCK;
+    size_t names_offset = start + nblocks * sizeof(uint32_t);
+    size_t coded_len = 0;
+    for (size_t i=0; i< n; ++i){
+        size_t len = strlen(items[i].name);
+        size_t shared = 0;
+        if (i % CTLD_COMPACT_BLOCK){
+            while (items[i].name[shared] && items[i].name[shared] == items[i - 1].name[shared])
+                shared++;
+            coded_len++;
+        }
+        coded_len += len - shared + 2;
+    }
+    size_t size = names_offset + coded_len;
+    ctld_index_header * index = size > UINT32_MAX?NULL:(ctld_index_header*) calloc(1, size);
+    if (!index){
+        free(items);
+        free(reversed);
+        return NULL;
+    }
+    uint32_t * blocks = (uint32_t*)((char*) index + start);
+    unsigned char * p = (unsigned char*) index + names_offset;
+    unsigned char * names = p;
+    for (size_t i=0; i< n; ++i){
+        size_t len = strlen(items[i].name);
+        size_t shared = 0;
+        if (i % CTLD_COMPACT_BLOCK == 0){
+            blocks[i / CTLD_COMPACT_BLOCK] = (uint32_t)(p - names);
+        }else{
+            while (items[i].name[shared] && items[i].name[shared] == items[i - 1].name[shared])
+                shared++;
+            *p++ = (unsigned char) shared;
+        }
+        *p++ = (unsigned char)(len - shared);
+        memcpy(p, items[i].name + shared, len - shared);
+        p += len - shared;
+        *p++ = items[i].flags;
+    }
+    index->size = size;
+    index->entries = (uint32_t) start;
+    index->names = (uint32_t) names_offset;
+    index->names_len = (uint32_t) coded_len;
+    free(items);
+    free(reversed);
+    return index;
+}
+
+
+/*
+ * Returns the slot of a top-level label in the direct tables of the index
+ * or NULL if the tables do not cover the label.
+ */
+static uint32_t * ctld_tld_slot(ctld_index_header * index, const char * label){
+    size_t len = strlen(label);
+    if (len == 2 && label[0] >= 'a' && label[0] <= 'z' && label[1] >= 'a' && label[1] <= 'z')
+        return (uint32_t*)((char*) index + index->tld2) + (label[0] - 'a') * 26 + (label[1] - 'a');
+    if (len < 3 || len > CTLD_GTLD_MAX_LEN)
+        return NULL;
+    uint64_t h = CTLD_HASH_INIT;
+    for (size_t i=len; i-- > 0;)
+        h = CTLD_HASH_STEP(h, label[i]);
+    ctld_gtld_slot * slot = (ctld_gtld_slot*)((char*) index + index->gtld) + (cmphf_mix(h ^ index->gtld_seed) & (CTLD_GTLD_SLOTS - 1));
+    return strcmp(slot->name, label) == 0?&slot->value:NULL;
+}
+
+
+/*
+ * Fills the direct tables of the top-level labels (see ctld_gtld_slot).
+ */
+static void ctld_tld_build(ctld_index_header * index, const ctld_rules * rules){
+    size_t count = sizeof(ctld_common_gtlds) / sizeof(ctld_common_gtlds[0]);
+    ctld_gtld_slot * gtld = (ctld_gtld_slot*)((char*) index + index->gtld);
+    // find a seed which puts every common label in its own slot
+    for (uint64_t attempt=1; ; ++attempt){
+        uint64_t used = 0;
+        size_t i;
+        index->gtld_seed = cmphf_mix(attempt);
+        for (i=0; i< count; ++i){
+            uint64_t h = CTLD_HASH_INIT;
+            for (size_t j=strlen(ctld_common_gtlds[i]); j-- > 0;)
+                h = CTLD_HASH_STEP(h, ctld_common_gtlds[i][j]);
+            uint64_t bit = 1ULL << (cmphf_mix(h ^ index->gtld_seed) & (CTLD_GTLD_SLOTS - 1));
+            if (used & bit)
+                break;
+            used |= bit;
+        }
+        if (i == count)
+            break;
+    }
+    for (size_t i=0; i< count; ++i){
+        uint64_t h = CTLD_HASH_INIT;
+        for (size_t j=strlen(ctld_common_gtlds[i]); j-- > 0;)
+            h = CTLD_HASH_STEP(h, ctld_common_gtlds[i][j]);
+        strcpy(gtld[cmphf_mix(h ^ index->gtld_seed) & (CTLD_GTLD_SLOTS - 1)].name, ctld_common_gtlds[i]);
+    }
+    for (size_t i=0; i< rules->len; ++i){
+        const char * name = rules->items[i].name;
+        const char * tld = strrchr(name, '.');
+        uint32_t * value = ctld_tld_slot(index, tld?tld + 1:name);
+        if (!value)
+            continue;
+        int flags = rules->items[i].flags;
+        if (!tld)
+            *value |= flags;
+        int labels = ctld_label_count(name);
+        int shifts[2] = {CTLD_TLD_ICANN_SHIFT, CTLD_TLD_ALL_SHIFT};
+        for (int k=0; k< 2; ++k){
+            // the ICANN depth only counts the ICANN rules
+            int section_flags = k?flags | flags >> CTLD_RULE_PRIVATE_SHIFT:flags;
+            if (!(section_flags & (CTLD_RULE_EXACT | CTLD_RULE_WILDCARD | CTLD_RULE_EXCEPTION)))
+                continue;
+            int depth = labels + (section_flags & CTLD_RULE_WILDCARD?1:0);
+            if (depth > CTLD_TLD_NO_LIMIT)
+                depth = CTLD_TLD_NO_LIMIT;
+            if (depth > (int)((*value >> shifts[k]) & 0xf))
+                *value = (*value & ~(0xfU << shifts[k])) | (uint32_t) depth << shifts[k];
+        }
+    }
+}
+
+
+static void ctld_rules_free(ctld_rules * rules){
+    for (size_t i=0; i< rules->len; ++i)
+        free(rules->items[i].name);
+    free(rules->items);
+    rules->items = NULL;
+    rules->len = 0;
+    rules->size = 0;
+}
+
+
+/*
+ * Checks that data holds a complete index which can be used as it is.
+ * Returns 0 if the index is valid and 1 otherwise.
+ */
+static int ctld_index_check(const void * data, size_t len){
+    const ctld_index_header * index = (const ctld_index_header*) data;
+    if (!data || len < sizeof(ctld_index_header) || ((uintptr_t) data & 7))
+        return 1;
+    if (index->magic != CTLD_INDEX_MAGIC || index->version != CTLD_INDEX_VERSION)
+        return 1;
+    if (index->size > len || index->size < sizeof(ctld_index_header))
+        return 1;
+    if (index->names + (uint64_t) index->names_len > index->size)
+        return 1;
+    if (index->tld2 && ((index->tld2 & 3) || index->tld2 + (uint64_t) CTLD_TLD2_SIZE * sizeof(uint32_t) > index->size))
+        return 1;
+    if (index->tld2 && ((index->gtld & 7) || index->gtld + (uint64_t) CTLD_GTLD_SLOTS * sizeof(ctld_gtld_slot) > index->size))
+        return 1;
+    if (index->layout == CTLD_LAYOUT_HASH)
+        return ctld_index_check_hash(index);
+    if (index->layout == CTLD_LAYOUT_COMPACT)
+        return ctld_index_check_compact(index);
+    return 1;
+}
+
+
+static int ctld_index_check_hash(const ctld_index_header * index){
+    if (index->buckets != cmphf_buckets(index->count))
+        return 1;
+    if ((index->disp & 3) || index->disp + (uint64_t) index->buckets * sizeof(uint32_t) > index->size)
+        return 1;
+    if ((index->entries & 7) || index->entries + (uint64_t) index->count * sizeof(ctld_index_entry) > index->size)
+        return 1;
+    const ctld_index_entry * entries = (const ctld_index_entry*)((const char*) index + index->entries);
+    const char * names = (const char*) index + index->names;
+    for (uint32_t i=0; i< index->count; ++i){
+        if ((uint64_t) entries[i].name + entries[i].len >= index->names_len || names[entries[i].name + entries[i].len] != '\0')
+            return 1;
+    }
+    return 0;
+}
+
+
+/*
+ * Decodes every block of a compact index without reading past the names.
+ */
+static int ctld_index_check_compact(const ctld_index_header * index){
+    uint32_t nblocks = (index->count + CTLD_COMPACT_BLOCK - 1) / CTLD_COMPACT_BLOCK;
+    if ((index->entries & 3) || index->entries + (uint64_t) nblocks * sizeof(uint32_t) > index->size)
+        return 1;
+    const uint32_t * blocks = (const uint32_t*)((const char*) index + index->entries);
+    const unsigned char * names = (const unsigned char*) index + index->names;
+    const unsigned char * end = names + index->names_len;
+    const unsigned char * p = names;
+    size_t len = 0;
+    for (uint32_t i=0; i< index->count; ++i){
+        size_t shared = 0;
+        if (i % CTLD_COMPACT_BLOCK == 0){
+            if (blocks[i / CTLD_COMPACT_BLOCK] >= index->names_len)
+                return 1;
+            p = names + blocks[i / CTLD_COMPACT_BLOCK];
+        }else{
+            // a name can not share more bytes than the previous one has
+            if (p >= end || *p > len)
+                return 1;
+            shared = *p++;
+        }
+        if (p >= end || (size_t)(end - p) < (size_t) *p + 2)
+            return 1;
+        len = shared + *p;
+        if (len > CTLD_COMPACT_MAX_NAME)
+            return 1;
+        p += *p + 2;
+    }
+    return 0;
+}
+
+
+/*
+ * Makes ctx use a (valid) index. The previous index is freed if ctx owns it.
+ * The index of a context with NUMA replicas is final: lookups may be
+ * running on the replicas, so it is not replaced.
+ *
+ * Returns 0 on success and 1 if ctx has replicas.
+ */
+static int ctld_index_use(ctld_ctx * ctx, const ctld_index_header * index, int owned){
+    if (ctx->replicas)
+        return 1;
+    if (ctx->owns_index)
+        free((void*) ctx->index);
+    ctx->index = index;
+    ctx->owns_index = owned;
+    // the compact layout has no hash function
+    ctx->mph_n = index->layout == CTLD_LAYOUT_HASH?index->count:0;
+    ctx->mph_buckets = index->buckets;
+    ctx->mph_seed = index->seed;
+    ctx->mph_disp = (const uint32_t*)((const char*) index + index->disp);
+    ctx->max_depth = index->max_depth;
+    return 0;
+}
+
+
+/*
+ * Returns 1 if needle appears between line and eol, 0 otherwise.
+ */
+static int ctld_line_has(const char * line, const char * eol, const char * needle){
+    size_t len = strlen(needle);
+    for (; line + len <= eol; ++line){
+        if (memcmp(line, needle, len) == 0)
+            return 1;
+    }
+    return 0;
+}
+
+
+/**
+ * @brief Adds many rules in PSL syntax to the context in one pass.
+ * @param ctx Context returned by ctld_parse_file() or ctld_parse_string()
+ * @param data null-terminated rules in the same format as the PSL file
+ *
+ * Every line holds one rule ("example.com", "*.example.com" or
+ * "!www.example.com"); only the first word of a line is used, and empty
+ * lines and lines starting with "//" are skipped. Rules go to the ICANN
+ * section unless they are between "===BEGIN PRIVATE DOMAINS===" and
+ * "===END PRIVATE DOMAINS===" comments, exactly like in the PSL. Adding
+ * a rule which already exists in its section changes nothing, and rules
+ * of a section the context does not load (see ctld_ctx_create()) are
+ * skipped.
+ *
+ * The data is scanned once without copying the lines, and the rule index
+ * is only rebuilt once at the end, so this is the way to load thousands of
+ * internal suffixes.
+ *
+ * @return number of rules added or -1 on failure (see ctx->errcode).
+ */
+int ctld_add_rules_from_string(ctld_ctx * ctx, const char * data){
+    if (!ctx || !data)
+        return -1;
+    return ctld_add_rules_from_buffer(ctx, data, strlen(data));
+}
+
+
+/**
+ * @brief Same as ctld_add_rules_from_string() for len bytes of data which
+ * do not need to be null-terminated (e.g. a file mapped in memory).
+ *
+ * @return number of rules added or -1 on failure (see ctx->errcode).
+ */
+int ctld_add_rules_from_buffer(ctld_ctx * ctx, const char * data, size_t len){
+    if (!ctx || (!data && len))
+        return -1;
+    if (ctx->replicas){
+        ctx->errcode = CTLD_CONTEXT_REPLICATED;
+        return -1;
+    }
+    ctld_rules rules = {NULL, 0, 0};
+    long added = -1;
+    if (!ctld_rules_from_index(&rules, ctx))
+        added = ctld_rules_scan(&rules, data, len, ctx, 0);
+    if (added < 0 || ctld_rules_build(&rules, ctx)){
+        ctld_rules_free(&rules);
+        ctx->errcode = CTLD_ERROR_MALLOC_FAILED;
+        return -1;
+    }
+    ctld_rules_free(&rules);
+    return (int) added;
+}
+
+
+/**
+ * @brief Adds the rules of a file in PSL syntax to the context in one pass.
+ * @param ctx Context returned by ctld_parse_file() or ctld_parse_string()
+ * @param filename name of the file
+ *
+ * See ctld_add_rules_from_string() for the format.
+ *
+ * @return number of rules added or -1 on failure (see ctx->errcode).
+ */
+int ctld_add_rules_from_file(ctld_ctx * ctx, char * filename){
+    if (!ctx || !filename)
+        return -1;
+    size_t len;
+    int mapped;
+    char * data = ctld_map_file(filename, &len, &mapped);
+    if (!data){
+        ctx->errcode = CTLD_READ_FILE_FAILED;
+        return -1;
+    }
+    int added = ctld_add_rules_from_buffer(ctx, data, len);
+    ctld_unmap_file(data, len, mapped);
+    return added;
+}
+
+
+/**
+ * @brief Adds custom suffix to the public part of PSL
+ * @param ctx Context returned by ctld_parse_file() or ctld_parse_string()
+ * @param suffix your new suffix to add to the suffix list
+ * 
+ * Why you should add custom suffix to the list?
+ * Sometimes the suffix is not in the PSL list (at least not in the public part)
+ * but it has a separate WHOIS server. You may want to distinguish those suffixes
+ * and treat them like they are public suffixes. In this case, you can use this 
+ * function to add whatever suffix you want.
+ *
+ * @return 0 on success or other values on failure
+ *
+ * Possible error values:
+ *  - 1 if context or suffix is NULL or empty
+ *  - 2 if suffix already exists in the public part of PSL
+ *  - 3 if allocation function(malloc()) failed
+ *  - 4 if the context has NUMA replicas (see ctld_ctx_replicate_numa())
+ *
+ * The rule index is rebuilt for every new suffix; use
+ * ctld_add_rules_from_string() to add many suffixes at once.
+ */
+int ctld_add_custom_suffix(ctld_ctx * ctx, char * suffix){
+    if (!ctx || !suffix || strlen(suffix) == 0)
+        return 1;
+    if (ctx->replicas)
+        return 4;
+    ctld_rules rules = {NULL, 0, 0};
+    int ret = ctld_rules_add(&rules, suffix, strlen(suffix), 0, ctx->unicode_rules);
+    if (ret){
+        ctld_rules_free(&rules);
+        return ret;
+    }
+    if (ctld_index_find(ctx, rules.items[0].name, strlen(rules.items[0].name)) & rules.items[0].flags){
+        ctld_rules_free(&rules);
+        return 2;       // we already have it
+    }
+    // we don't have it let's add it
+    if (ctld_rules_from_index(&rules, ctx) || ctld_rules_build(&rules, ctx)){
+        ctld_rules_free(&rules);
+        return 3;
+    }
+    ctld_rules_free(&rules);
+    return 0;
+}
+
+
+/**
+ * @brief free the memory used by ctld_result structure
+ * 
+ * This should be called by users to free the allocated memory.
+ *
+ * @param res the return result of the ctld_parse() API
+ * @return Nothing
+ */
+void ctld_result_free(ctld_result* res){
+    if (!res)
+        return;
+    free(res->domain);
+    free(res->fqdn);
+    free(res->registered_domain);
+    free(res->suffix);
+    free(res->rule);
+    free(res->icann_suffix);
+    free(res->icann_registered_domain);
+    free(res);
+    return;
+}
+
+
+/**
+ * @brief returns one of the fields of the result structure
+ *
+ * @param res the return result of the ctld_parse() API
+ * @param field one of CTLD_FIELD_SUFFIX, CTLD_FIELD_RD, CTLD_FIELD_DOMAIN or CTLD_FIELD_FQDN
+ * @return the selected field (which can be NULL) or NULL if field is unknown
+ */
+const char * ctld_result_field(const ctld_result * res, int field){
+    if (!res)
+        return NULL;
+    switch (field){
+        case CTLD_FIELD_SUFFIX: return res->suffix;
+        case CTLD_FIELD_RD: return res->registered_domain;
+        case CTLD_FIELD_DOMAIN: return res->domain;
+        case CTLD_FIELD_FQDN: return res->fqdn;
+    }
+    return NULL;
+}
+
+
+/**
+ * @brief adds one field of the result to a heavy-hitter (top-k) sketch
+ *
+ * Use csketch_topk_init() to create the sketch and csketch_topk_list() to get
+ * the most frequent values (e.g. the most frequent registered domains) with
+ * a fixed amount of memory.
+ *
+ * @param sketch context returned by csketch_topk_init()
+ * @param res the return result of the ctld_parse() API
+ * @param field one of the CTLD_FIELD_* values
+ * @return 0 on success, 1 on failure and 2 if the field is NULL in the result
+ */
+int ctld_topk_add(csketch_topk * sketch, const ctld_result * res, int field){
+    if (!sketch || !res)
+        return 1;
+    const char * key = ctld_result_field(res, field);
+    if (!key)
+        return 2;
+    return csketch_topk_add(sketch, key, 1);
+}
+
+
+/**
+ * @brief adds one field of the result to a distinct-count (HyperLogLog) sketch
+ *
+ * Use csketch_hll_init() to create the sketch and csketch_hll_count() to get
+ * the estimated number of distinct values (e.g. distinct suffixes).
+ *
+ * @param sketch context returned by csketch_hll_init()
+ * @param res the return result of the ctld_parse() API
+ * @param field one of the CTLD_FIELD_* values
+ * @return 0 on success, 1 on failure and 2 if the field is NULL in the result
+ */
+int ctld_distinct_add(csketch_hll * sketch, const ctld_result * res, int field){
+    if (!sketch || !res)
+        return 1;
+    const char * key = ctld_result_field(res, field);
+    if (!key)
+        return 2;
+    return csketch_hll_add(sketch, key);
+}
+
+
+/**
+ * @brief free the memory used by ctld context
+ * 
+ * This should be called by users to free the allocated memory.
+ *
+ * @param ctx the context created by ctld_parse_file()
+ * @return Nothing
+ */
+void ctld_free(ctld_ctx * ctx){
+    if (!ctx)
+        return;
+    ctld_replicas_free(ctx);
+    if (ctx->owns_index)
+        free((void*) ctx->index);
+    free(ctx);
+    return;
+}
+
+
+/**
+ * @brief parse the PSL data from a null-terminated memory.
+ * 
+ * the memory should be free by users if it needs to be freed.
+ *
+ * @param data A pointer to a null-terminated string containing PSL data.
+ * @return a pointer to the ctld context which can be used in ctld_parse()
+ */
+ctld_ctx * ctld_parse_string(char * data){
+    ctld_ctx * ctx = ctld_init();
+    if (!ctx){
+        return NULL;
+    }
+    ctx->errcode = 0;
+    if (ctld_parse_list(data, data?strlen(data):0, ctx)){
+#ifdef DEBUG
+        fprintf(stderr, "Something is wrong in parsing list...\n");
+#endif
+        ctld_free(ctx);
+        return NULL;
+    }
+    return ctx;
+}
+
+
+
+/**
+ * @brief parse PSL data by passing the filename.
+ * 
+ * @param filename A pointer to a null-terminated string contains the name of the file.
+ * @return a pointer to the ctld context which can be used in ctld_parse()
+ */
+ctld_ctx * ctld_parse_file(char * filename){
+    ctld_options options;
+    ctld_options_init(&options);
+    options.filename = filename;
+    return ctld_ctx_create(&options);
+}
+
+
+/**
+ * @brief sets the default options of ctld_ctx_create().
+ *
+ * The defaults load both sections of the list, index the Unicode and the
+ * ASCII form of IDNA rules and use the hash layout, which is what
+ * ctld_parse_file() does.
+ *
+ * @param options the options to initialize
+ * @return Nothing
+ */
+void ctld_options_init(ctld_options * options){
+    if (!options)
+        return;
+    memset(options, 0, sizeof(ctld_options));
+    options->sections = CTLD_SECTION_ALL;
+    options->unicode_rules = 1;
+    options->layout = CTLD_LAYOUT_HASH;
+}
+
+
+/**
+ * @brief creates a context with the given options.
+ *
+ * @param options options initialized by ctld_options_init() (NULL for the defaults)
+ *
+ * The rules come from options->data, or from options->filename if data is
+ * NULL. If both are NULL the context starts without rules and they can be
+ * added with ctld_add_rules_from_string() or ctld_add_rules_from_file().
+ * The options also apply to the rules added later.
+ *
+ * Loading only CTLD_SECTION_ICANN makes the context smaller and faster to
+ * build when the private section is never used; lookups with
+ * use_private_suffix then give the same results as without it. Without
+ * the Unicode form of IDNA rules (unicode_rules = 0), domains must be given
+ * in ASCII (punycode), like the command line tool does.
+ *
+ * The compact layout (CTLD_LAYOUT_COMPACT) keeps the whole PSL in less than
+ * 100 KB (instead of about 280 KB) but every probe is a binary search, so
+ * lookups are slower.
+ *
+ * @return a pointer to the ctld context or NULL on failure (bad options,
+ * unreadable file or allocation failure).
+ */
+ctld_ctx * ctld_ctx_create(const ctld_options * options){
+    ctld_options defaults;
+    if (!options){
+        ctld_options_init(&defaults);
+        options = &defaults;
+    }
+    if (options->layout != CTLD_LAYOUT_HASH && options->layout != CTLD_LAYOUT_COMPACT)
+        return NULL;
+    if (options->sections & ~CTLD_SECTION_ALL)
+        return NULL;
+    char * data = NULL;
+    size_t len = 0;
+    int mapped = 0;
+    if (!options->data && options->filename){
+        data = ctld_map_file(options->filename, &len, &mapped);
+        if (!data)
+            return NULL;
+    }
+    ctld_ctx * ctx = ctld_init();
+    if (!ctx){
+        if (data)
+            ctld_unmap_file(data, len, mapped);
+        return NULL;
+    }
+    ctx->layout = options->layout;
+    ctx->sections = options->sections;
+    ctx->unicode_rules = options->unicode_rules != 0;
+    ctx->hash_seed = options->hash_seed;
+    int failed;
+    if (data){
+        failed = ctld_parse_list(data, len, ctx);
+        ctld_unmap_file(data, len, mapped);
+    }else if (options->data){
+        failed = ctld_parse_list(options->data, options->len?options->len:strlen(options->data), ctx);
+    }else{
+        ctld_rules rules = {NULL, 0, 0};
+        failed = ctld_rules_build(&rules, ctx);
+    }
+    if (failed){
+        ctld_free(ctx);
+        return NULL;
+    }
+    return ctx;
+}
+
+
+/**
+ * @brief returns the number of bytes allocated by a context.
+ *
+ * @param ctx context created by any of the functions of the library
+ *
+ * The structure and the rule index count; an index given to
+ * ctld_load_index() belongs to the caller and is not counted (see
+ * ctld_index_data() for its size).
+ *
+ * @return the number of bytes or 0 if ctx is NULL.
+ */
+size_t ctld_ctx_memory_usage(const ctld_ctx * ctx){
+    if (!ctx)
+        return 0;
+    size_t size = sizeof(ctld_ctx) + (ctx->owns_index && ctx->index?ctx->index->size:0);
+    if (ctx->replicas){
+        size += ctx->replica_nodes * sizeof(ctld_ctx*) + ctx->cpu_count * sizeof(int);
+        for (int node=0; node< ctx->replica_nodes; ++node){
+            if (ctx->replicas[node])
+                size += ctld_replica_size(ctx->replicas[node]);
+        }
+    }
+    return size;
+}
+
+
+/**
+ * @brief places one read-only copy of the context on each NUMA node.
+ *
+ * @param ctx context created by any of the functions of the library
+ *
+ * On hosts with more than one NUMA node (socket), every lookup of a shared
+ * context from the other node pays the latency of the link between the
+ * sockets. After this call each node has its own copy of the rule index
+ * (and of the context) in its local memory, and lookups use the copy of
+ * the node of the CPU running the calling thread. The copies are bound to
+ * their node with mbind() and written by a thread running on the node, so
+ * they are placed even where mbind() is not allowed (first touch). Nodes
+ * and CPUs are read from /sys/devices/system/node; without it a single
+ * copy is made.
+ *
+ * The index is final afterwards: adding rules fails with
+ * CTLD_CONTEXT_REPLICATED, so add them first. Call this before sharing the
+ * context between threads: it must not run during a lookup.
+ * ctld_free() frees the copies.
+ *
+ * @return the number of copies (one per node) or -1 on failure, in which
+ * case the context keeps working without copies.
+ */
+int ctld_ctx_replicate_numa(ctld_ctx * ctx){
+    if (!ctx || !ctx->index)
+        return -1;
+    ctld_replicas_free(ctx);
+    unsigned char nodes[CTLD_NUMA_MAX_NODES];
+    int node_count = ctld_numa_read_list("/sys/devices/system/node/online", nodes, CTLD_NUMA_MAX_NODES);
+    if (node_count <= 0){
+        memset(nodes, 0, sizeof(nodes));
+        nodes[0] = 1;
+        node_count = 1;
+    }
+    ctx->replicas = (ctld_ctx**) calloc(node_count, sizeof(ctld_ctx*));
+    ctx->cpu_node = (int*) calloc(CPU_SETSIZE, sizeof(int));
+    if (!ctx->replicas || !ctx->cpu_node){
+        ctld_replicas_free(ctx);
+        return -1;
+    }
+    ctx->replica_nodes = node_count;
+    size_t size = ctld_replica_size(ctx);
+    int copies = 0;
+    for (int node=0; node< node_count; ++node){
+        if (!nodes[node])
+            continue;
+        ctld_numa_copy copy;
+        copy.ctx = ctx;
+        CPU_ZERO(&copy.cpus);
+        char path[64];
+        unsigned char cpus[CPU_SETSIZE];
+        snprintf(path, sizeof(path), "/sys/devices/system/node/node%d/cpulist", node);
+        int cpu_count = ctld_numa_read_list(path, cpus, CPU_SETSIZE);
+        for (int cpu=0; cpu< cpu_count; ++cpu){
+            if (!cpus[cpu])
+                continue;
+            CPU_SET(cpu, &copy.cpus);
+            ctx->cpu_node[cpu] = node;
+            if (cpu >= ctx->cpu_count)
+                ctx->cpu_count = cpu + 1;
+        }
+        void * mem = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (mem == MAP_FAILED){
+            ctld_replicas_free(ctx);
+            return -1;
+        }
+        // the pages are not touched yet, so the policy decides where they go
+        unsigned long mask = 1UL << node;
+        syscall(SYS_mbind, mem, size, CTLD_MPOL_PREFERRED, &mask, sizeof(mask) * 8 + 1, 0);
+        copy.replica = (ctld_ctx*) mem;
+        int started = 0;
+        pthread_t thread;
+        pthread_attr_t attr;
+        if (CPU_COUNT(&copy.cpus) > 0 && pthread_attr_init(&attr) == 0){
+            if (pthread_attr_setaffinity_np(&attr, sizeof(cpu_set_t), &copy.cpus) == 0)
+                started = pthread_create(&thread, &attr, ctld_numa_copy_thread, &copy) == 0;
+            pthread_attr_destroy(&attr);
+        }
+        if (started)
+            pthread_join(thread, NULL);
+        else
+            ctld_replica_fill(ctx, copy.replica);
+        mprotect(mem, size, PROT_READ);
+        ctx->replicas[node] = copy.replica;
+        copies++;
+    }
+    return copies;
+}
+
+
+/**
+ * @brief creates a context from a rule index without parsing anything.
+ *
+ * @param data the index, e.g. the one embedded at build time (include/psl_index.h),
+ * a file mapped in memory or the result of ctld_index_data(). It must be
+ * aligned to 8 bytes.
+ * @param len size of data in bytes
+ *
+ * The index is checked but not copied: data must stay valid and unchanged
+ * until ctld_free() is called. Adding rules to the context later builds a
+ * new index and leaves data untouched.
+ *
+ * @return a pointer to the ctld context or NULL if the index is not valid
+ * (or was built by another version of the library).
+ */
+ctld_ctx * ctld_load_index(const void * data, size_t len){
+    if (ctld_index_check(data, len))
+        return NULL;
+    ctld_ctx * ctx = ctld_init();
+    if (!ctx)
+        return NULL;
+    ctld_index_use(ctx, (const ctld_index_header*) data, 0);
+    ctx->layout = ctx->index->layout;
+    return ctx;
+}
+
+
+/**
+ * @brief returns the rule index of a context.
+ *
+ * @param ctx context created by calling ctld_parse_file(), ctld_parse_string() or ctld_load_index()
+ * @param len receives the size of the index in bytes
+ *
+ * The index is one position-independent block which can be written to a
+ * file (or compiled into a program) and given to ctld_load_index() later.
+ * It belongs to the context.
+ *
+ * @return the index or NULL if ctx or len is NULL.
+ */
+const void * ctld_index_data(const ctld_ctx * ctx, size_t * len){
+    if (!ctx || !len)
+        return NULL;
+    if (!ctx->index)
+        return NULL;
+    *len = ctx->index->size;
+    return ctx->index;
+}
+
+
+/**
+ * @brief check if the domain name contains illegal character
+ * 
+ * One needs to be very careful to use this function. some companies have illegal
+ * characters like '_' in the subdomain part of the domain name. So only use this
+ * function if you know what you are doing.
+ *
+ * @param domain A pointer to a null-terminated string (domain name)
+ * @return 1 on success and 0 on failure
+ */
+int ctld_is_domain_valid(char * domain){
+    // simple checks to see if the fully-qualified domain is valid
+    // the domain must have atleast one dot
+    // at least 4 characters
+    // no special character
+    // returns 1 if valid 0 if invalid
+    if (!domain)
+        return 0;
+    PSTR str = str_init(domain);
+    if (str->str_len(str) < 4){
+        str_free(str);
+        return 0;
+    }
+    if (str->str_find(str, ".") == -1){
+        str_free(str);
+        return 0;
+    }
+    if (str->str_any_of_in(str, "!@#$%^&*()_+=\\/,|'\"")){
+        str_free(str);
+        return 0;
+    }
+    str_free(str);
+    return 1;
+}
+
+
+/**
+ * @brief parse the passed domain name based on the PSL and returns the result structure.
+ *
+ * @param ctx context created by calling ctld_parse_file() or ctld_parse_string()
+ * @param domain the domain name you want to parse
+ * @param use_private_suffix 0 means do not use private part of the PSL and 1 means 
+ * using the private part of the PSL.
+ * 
+ * This is the main API of the library.
+ *
+ * Besides the suffix and the registered domain, the result tells which rule
+ * matched (ctld_result.rule, is_private, is_wildcard and is_exception) and
+ * where the boundaries are when only the ICANN section is used
+ * (icann_suffix and icann_registered_domain), so there is no need to call
+ * this function twice with and without use_private_suffix.
+ *
+ * @return Returns an instance of ctld_result on success and NULL on failure.
  */
 ctld_result * ctld_parse(ctld_ctx * ctx, char * domain, int use_private_suffix){
     if (!domain || !ctx)
@@ -519,69 +1975,653 @@ ctld_result * ctld_parse(ctld_ctx * ctx, char * domain, int use_private_suffix){
     // do we really care if the fqdn is correct or not?
     //if (ctld_is_domain_valid(domain) != 1)
     //    return NULL;
-    ctld_node * match_public, *match_private = NULL;
-    PSTR str = str_init(domain);
-    PSTR new_str = str_init(NULL);
-    // just search for a perfect match in list
-    PCLIST all_match = clist_init(ctld_node_free);
-
-    match_public = ctld_search_in_list(ctx->list_public, domain);
-    match_private = use_private_suffix?ctld_search_in_list(ctx->list_private, domain):NULL;
-    if (match_public)
-        clist_add_item(all_match, (void*)match_public);    
-    if (match_private && use_private_suffix)
-        clist_add_item(all_match, (void*) match_private); 
-    new_str->str_setval(new_str, "*.");
-    new_str->str_append_string(new_str, domain);
-    match_public = ctld_search_in_list(ctx->list_public, new_str->str);
-    match_private = use_private_suffix?ctld_search_in_list(ctx->list_private, new_str->str):NULL;
-    if (match_public)
-        clist_add_item(all_match, (void*) match_public);
-    if (match_private && use_private_suffix)
-        clist_add_item(all_match, (void*)match_private);    
-
-    PSPLITLIST str_split = str->str_split(str, ".", -1);
-    SPLITLIST new_split;
-    for (int i=1; i<str_split->len && str_split->len > 1; ++i){
-        new_split.len = str_split->len -i;
-        new_split.list = str_split->list + i;
-        new_str->str_join(new_str, &new_split, ".");
-        match_public = ctld_search_in_list(ctx->list_public, new_str->str);
-        match_private = use_private_suffix?ctld_search_in_list(ctx->list_private, new_str->str):NULL;
-        if (match_public)
-            clist_add_item(all_match, (void*) match_public);
-        if (use_private_suffix && match_private)
-            clist_add_item(all_match, (void*)match_private);    
-
-        new_str->str_prepend_string(new_str, "*.");
-        match_public = ctld_search_in_list(ctx->list_public, new_str->str);
-        match_private = use_private_suffix?ctld_search_in_list(ctx->list_private, new_str->str):NULL;
-        if (match_public)
-            clist_add_item(all_match, (void*) match_public);
-        if (use_private_suffix && match_private)
-            clist_add_item(all_match, (void*)match_private);    
-        
-    }
-    
-    str_free_splitlist(str_split);
-    str_free(new_str);
-    str_free(str);
-    if (!all_match || all_match->first_empty == 0){
-        free(all_match->list);
-        free(all_match);
+    ctld_match match, icann_match;
+    if (!ctld_find_rule(ctx, NULL, domain, use_private_suffix, &match, &icann_match)){
         ctx->errcode = CTLD_NO_MATCH_FOUND;
 #ifdef DEBUG
         fprintf(stdout, "Can not find a match for a given domain: %s\n", domain);
 #endif
         return NULL;
     }
-    ctld_result * result = ctld_choose_best(all_match, domain);
-    // we can not call clist_free() on all match as
-    // we have refernce not copy of the data
-    // we just need to free the list and the structure itself
-    // not the content inside the list
-    free(all_match->list);
-    free(all_match);
+    ctld_result * result = ctld_build_result(&match, &icann_match, domain);
     return result;   
 }
 
+
+/**
+ * @brief like ctld_parse() but never writes to the context.
+ *
+ * @param ctx context created by calling ctld_parse_file() or ctld_parse_string()
+ * @param domain the domain name you want to parse
+ * @param use_private_suffix 0 means do not use private part of the PSL and 1 means
+ * using the private part of the PSL.
+ *
+ * ctld_parse() reports a failed lookup in ctx->errcode, which is a race when
+ * several threads share the context. This function leaves errcode alone, so
+ * it can be called from any number of threads at once.
+ *
+ * @return Returns an instance of ctld_result on success and NULL if no rule
+ * matches or on failure.
+ */
+ctld_result * ctld_parse_r(ctld_ctx * ctx, const char * domain, int use_private_suffix){
+    if (!domain || !ctx)
+        return NULL;
+    ctld_match match, icann_match;
+    if (!ctld_find_rule(ctx, NULL, domain, use_private_suffix, &match, &icann_match))
+        return NULL;
+    return ctld_build_result(&match, &icann_match, domain);
+}
+
+
+
+/*
+ * Takes the next chunk of the worker. Returns 0 if it has none left.
+ */
+static int ctld_worker_pop(ctld_worker * worker, uint32_t * chunk){
+    uint64_t range = __atomic_load_n(&worker->range, __ATOMIC_ACQUIRE);
+    for (;;){
+        uint32_t next = range >> 32, end = (uint32_t) range;
+        if (next >= end)
+            return 0;
+        if (__atomic_compare_exchange_n(&worker->range, &range, (uint64_t)(next + 1) << 32 | end,
+                                        0, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)){
+            *chunk = next;
+            return 1;
+        }
+    }
+}
+
+
+/*
+ * Moves the back half of the chunks of another worker to the thief (whose
+ * own range is empty). Returns 0 if no worker had chunks left.
+ */
+static int ctld_worker_steal(ctld_worker * thief){
+    for (int k=1; k< thief->nworkers; ++k){
+        ctld_worker * victim = &thief->workers[(thief->id + k) % thief->nworkers];
+        uint64_t range = __atomic_load_n(&victim->range, __ATOMIC_ACQUIRE);
+        for (;;){
+            uint32_t next = range >> 32, end = (uint32_t) range;
+            if (next >= end)
+                break;
+            uint32_t half = end - (end - next + 1) / 2;
+            if (__atomic_compare_exchange_n(&victim->range, &range, (uint64_t) next << 32 | half,
+                                            0, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)){
+                // nobody changes an empty range, so a plain store is enough
+                __atomic_store_n(&thief->range, (uint64_t) half << 32 | end, __ATOMIC_RELEASE);
+                return 1;
+            }
+        }
+    }
+    return 0;
+}
+
+
+/*
+ * Parses the chunks of one worker, then steals chunks from the others until
+ * none is left.
+ */
+static void * ctld_worker_run(void * arg){
+    ctld_worker * worker = (ctld_worker*) arg;
+    uint32_t chunk;
+    for (;;){
+        if (!ctld_worker_pop(worker, &chunk)){
+            if (!ctld_worker_steal(worker))
+                break;
+            continue;
+        }
+        size_t first = (size_t) chunk * CTLD_PARALLEL_CHUNK;
+        size_t last = first + CTLD_PARALLEL_CHUNK < worker->n?first + CTLD_PARALLEL_CHUNK:worker->n;
+        for (size_t i=first; i< last; ++i){
+            ctld_match match, icann_match;
+            worker->out[i] = NULL;
+            // like ctld_parse_r(), but a failed allocation is told apart from no match
+            if (!worker->hosts[i] || !ctld_find_rule(worker->ctx, NULL, worker->hosts[i], worker->use_private_suffix,
+                                                     &match, &icann_match))
+                continue;
+            worker->out[i] = ctld_build_result(&match, &icann_match, worker->hosts[i]);
+            if (worker->out[i])
+                worker->matched++;
+            else
+                worker->failed = 1;
+        }
+    }
+    return NULL;
+}
+
+
+/**
+ * @brief parses an array of hosts on several threads.
+ *
+ * @param ctx context created by any of the functions of the library
+ * @param hosts array of n domain names (NULL entries are skipped)
+ * @param n number of hosts
+ * @param use_private_suffix 0 means do not use private part of the PSL and 1 means
+ * using the private part of the PSL.
+ * @param out array of n pointers which receives the result of each host,
+ * NULL if no rule matches (free each one with ctld_result_free())
+ * @param nthreads number of threads, 0 for one per online CPU (at most
+ * CTLD_PARALLEL_MAX_THREADS)
+ *
+ * The hosts are cut in chunks of CTLD_PARALLEL_CHUNK and each thread starts
+ * with an equal share of the chunks. A thread which runs out of chunks
+ * steals half of the chunks left to another one, so a share with many
+ * long hosts does not leave the other threads idle. The calling thread is
+ * one of the workers. The context is only read and must not change during
+ * the call; with ctld_ctx_replicate_numa() each thread uses the copy of its
+ * node.
+ *
+ * @return number of hosts with a result or -1 if an argument is invalid or
+ * malloc() fails (out is then filled with NULL).
+ */
+long ctld_parse_parallel(ctld_ctx * ctx, const char ** hosts, size_t n, int use_private_suffix,
+                         ctld_result ** out, int nthreads){
+    if (!ctx || !hosts || !out || nthreads < 0)
+        return -1;
+    size_t nchunks = (n + CTLD_PARALLEL_CHUNK - 1) / CTLD_PARALLEL_CHUNK;
+    if (nchunks > UINT32_MAX)
+        return -1;
+    if (nchunks == 0)
+        return 0;
+    if (nthreads == 0)
+        nthreads = (int) sysconf(_SC_NPROCESSORS_ONLN);
+    if (nthreads < 1)
+        nthreads = 1;
+    if (nthreads > CTLD_PARALLEL_MAX_THREADS)
+        nthreads = CTLD_PARALLEL_MAX_THREADS;
+    if ((size_t) nthreads > nchunks)
+        nthreads = (int) nchunks;
+    ctld_worker workers[nthreads];
+    pthread_t tids[nthreads];
+    for (int i=0; i< nthreads; ++i){
+        uint64_t first = nchunks * i / nthreads;
+        uint64_t end = nchunks * (i + 1) / nthreads;
+        workers[i] = (ctld_worker){first << 32 | end, ctx, hosts, n, use_private_suffix, out, workers, nthreads, i, 0, 0};
+    }
+    int started[nthreads];
+    for (int i=1; i< nthreads; ++i)
+        started[i] = pthread_create(&tids[i], NULL, ctld_worker_run, &workers[i]) == 0;
+    // the chunks of a thread which did not start are stolen by the others
+    ctld_worker_run(&workers[0]);
+    long matched = workers[0].matched;
+    int failed = workers[0].failed;
+    for (int i=1; i< nthreads; ++i){
+        if (started[i])
+            pthread_join(tids[i], NULL);
+        matched += workers[i].matched;
+        failed |= workers[i].failed;
+    }
+    if (failed){
+        for (size_t i=0; i< n; ++i){
+            ctld_result_free(out[i]);
+            out[i] = NULL;
+        }
+        return -1;
+    }
+    return matched;
+}
+
+
+/*
+ * Returns a pointer to the first byte of the registered domain inside the
+ * domain itself (the label right before the suffix) or NULL if the domain
+ * is a public suffix or no rule matches.
+ */
+static const char * ctld_registered_start(ctld_ctx * ctx, const char * domain, int use_private_suffix){
+    ctld_match match;
+    if (!ctld_find_rule(ctx, NULL, domain, use_private_suffix, &match, NULL))
+        return NULL;
+    if (match.suffix == domain)
+        return NULL;
+    const char * label = match.suffix - 1;
+    while (label > domain && *(label - 1) != '.')
+        label--;
+    return label;
+}
+
+
+/**
+ * @brief checks if the domain itself is a public suffix.
+ *
+ * @param ctx context created by calling ctld_parse_file() or ctld_parse_string()
+ * @param domain the domain name to check
+ * @param use_private_suffix 0 means do not use private part of the PSL and 1 means
+ * using the private part of the PSL.
+ *
+ * Unlike ctld_parse(), nothing is allocated: the rules are looked up once
+ * and only the position of the suffix inside the domain is checked.
+ *
+ * @return 1 if the domain is a public suffix, 0 if it is not (or no rule
+ * matches) and -1 if an argument is NULL.
+ */
+int ctld_is_public_suffix(ctld_ctx * ctx, const char * domain, int use_private_suffix){
+    if (!ctx || !domain)
+        return -1;
+    ctld_match match;
+    if (!ctld_find_rule(ctx, NULL, domain, use_private_suffix, &match, NULL))
+        return 0;
+    return match.suffix == domain;
+}
+
+
+/**
+ * @brief checks if two domain names have the same registered domain (same-site check).
+ *
+ * @param ctx context created by calling ctld_parse_file() or ctld_parse_string()
+ * @param domain1 first domain name
+ * @param domain2 second domain name
+ * @param use_private_suffix 0 means do not use private part of the PSL and 1 means
+ * using the private part of the PSL.
+ *
+ * The registered domains are compared in place (case-insensitive) and
+ * nothing is allocated. A domain which is itself a public suffix (or does
+ * not match any rule) has no registered domain and is never the same site
+ * as anything.
+ *
+ * @return 1 if both have the same registered domain, 0 if not and -1 if an
+ * argument is NULL.
+ */
+int ctld_same_registered_domain(ctld_ctx * ctx, const char * domain1, const char * domain2, int use_private_suffix){
+    if (!ctx || !domain1 || !domain2)
+        return -1;
+    const char * rd1 = ctld_registered_start(ctx, domain1, use_private_suffix);
+    if (!rd1)
+        return 0;
+    const char * rd2 = ctld_registered_start(ctx, domain2, use_private_suffix);
+    if (!rd2)
+        return 0;
+    return cstr_ccmp(rd1, rd2) == 0;
+}
+
+
+/**
+ * @brief batched form of ctld_same_registered_domain().
+ *
+ * @param ctx context created by calling ctld_parse_file() or ctld_parse_string()
+ * @param domains1 array of n domain names
+ * @param domains2 array of n domain names, domains1[i] is compared with domains2[i]
+ * @param n number of pairs
+ * @param use_private_suffix 0 means do not use private part of the PSL and 1 means
+ * using the private part of the PSL.
+ * @param out array of n integers which receives the result of each pair
+ * (1, 0 or -1 if one of the two names is NULL)
+ *
+ * @return number of pairs with the same registered domain or -1 if ctx,
+ * one of the arrays or out is NULL.
+ */
+long ctld_same_registered_domain_batch(ctld_ctx * ctx, const char ** domains1, const char ** domains2,
+                                       size_t n, int use_private_suffix, int * out){
+    if (!ctx || !domains1 || !domains2 || !out)
+        return -1;
+    long same = 0;
+    for (size_t i=0; i< n; ++i){
+        out[i] = ctld_same_registered_domain(ctx, domains1[i], domains2[i], use_private_suffix);
+        if (out[i] == 1)
+            same++;
+    }
+    return same;
+}
+
+
+/**
+ * @brief parses a whole string column in the Apache Arrow layout.
+ *
+ * @param ctx context created by calling ctld_parse_file() or ctld_parse_string()
+ * @param column the input column (utf8 or large_utf8) with one host per row
+ * @param use_private_suffix 0 means do not use private part of the PSL and 1 means
+ * using the private part of the PSL.
+ * @param suffix array of column->length spans which receives the suffix of each row (can be NULL)
+ * @param registered_domain array of column->length spans which receives the registered domain (can be NULL)
+ * @param domain array of column->length spans which receives the domain label (can be NULL)
+ *
+ * The output values are not copied: each span points into column->data,
+ * so the values keep the case of the input. Use ctld_column_gather() to
+ * turn the spans into a new Arrow column. Trailing dots and spaces are not
+ * part of the output. Null rows, empty rows and rows without a matching
+ * rule get null spans, and a host which is itself a public suffix only gets
+ * a suffix. Like ctld_parse(), the rows must be hosts (not URLs) in ASCII.
+ *
+ * Nothing is allocated per row: each host is copied into one reused buffer
+ * to terminate it.
+ *
+ * @return number of rows with a matching rule or -1 if an argument is
+ * invalid or malloc() fails.
+ */
+long ctld_parse_column(ctld_ctx * ctx, const ctld_column * column, int use_private_suffix,
+                       ctld_span * suffix, ctld_span * registered_domain, ctld_span * domain){
+    if (!ctx || !column || !column->offsets || !column->data || column->length < 0 || column->offset < 0)
+        return -1;
+    char stack_host[CTLD_KEY_BUFFER];
+    char * host = stack_host;
+    size_t host_size = sizeof(stack_host);
+    ctld_span none = {0, -1};
+    long matched = 0;
+    for (int64_t i=0; i< column->length; ++i){
+        int64_t row = column->offset + i;
+        if (suffix)
+            suffix[i] = none;
+        if (registered_domain)
+            registered_domain[i] = none;
+        if (domain)
+            domain[i] = none;
+        if (column->validity && !(column->validity[row >> 3] & (1 << (row & 7))))
+            continue;
+        int64_t start, end;
+        if (column->large_offsets){
+            start = ((const int64_t*) column->offsets)[row];
+            end = ((const int64_t*) column->offsets)[row + 1];
+        }else{
+            start = ((const int32_t*) column->offsets)[row];
+            end = ((const int32_t*) column->offsets)[row + 1];
+        }
+        while (end > start && (column->data[end - 1] == 0x20 || column->data[end - 1] == '.'))
+            end--;
+        if (end <= start)
+            continue;
+        size_t len = end - start;
+        if (len + 1 > host_size){
+            char * bigger = (char*) malloc(len + 1);
+            if (!bigger){
+                if (host != stack_host)
+                    free(host);
+                return -1;
+            }
+            if (host != stack_host)
+                free(host);
+            host = bigger;
+            host_size = len + 1;
+        }
+        memcpy(host, column->data + start, len);
+        host[len] = '\0';
+        end = start + strlen(host);     // a NUL byte ends the host
+        ctld_match match;
+        if (!ctld_find_rule(ctx, NULL, host, use_private_suffix, &match, NULL))
+            continue;
+        matched++;
+        int64_t suffix_start = start + (match.suffix - host);
+        if (suffix){
+            suffix[i].start = suffix_start;
+            suffix[i].len = end - suffix_start;
+        }
+        if (match.suffix == host)
+            continue;       // the host itself is a public suffix
+        const char * label = match.suffix - 1;
+        while (label > host && *(label - 1) != '.')
+            label--;
+        int64_t label_start = start + (label - host);
+        if (registered_domain){
+            registered_domain[i].start = label_start;
+            registered_domain[i].len = end - label_start;
+        }
+        if (domain){
+            domain[i].start = label_start;
+            domain[i].len = match.suffix - 1 - label;
+        }
+    }
+    if (host != stack_host)
+        free(host);
+    return matched;
+}
+
+
+/**
+ * @brief copies the values of spans into a new Arrow utf8 column.
+ *
+ * @param column the column passed to ctld_parse_column()
+ * @param spans column->length spans returned by ctld_parse_column()
+ * @param offsets receives column->length + 1 offsets into data
+ * @param data receives the bytes of the values. The output is never larger
+ * than the data of the input rows, so a buffer of that size is enough.
+ * @param validity receives the validity bitmap ((column->length + 7) / 8 bytes, can be NULL)
+ *
+ * @return number of bytes written to data or -1 if an argument is NULL or
+ * the output does not fit in int32_t offsets.
+ */
+int64_t ctld_column_gather(const ctld_column * column, const ctld_span * spans,
+                           int32_t * offsets, char * data, uint8_t * validity){
+    if (!column || !spans || !offsets || !data || column->length < 0)
+        return -1;
+    int64_t len = 0;
+    if (validity)
+        memset(validity, 0, (column->length + 7) / 8);
+    offsets[0] = 0;
+    for (int64_t i=0; i< column->length; ++i){
+        if (spans[i].len >= 0){
+            if (len + spans[i].len > INT32_MAX)
+                return -1;
+            memcpy(data + len, column->data + spans[i].start, spans[i].len);
+            len += spans[i].len;
+            if (validity)
+                validity[i >> 3] |= 1 << (i & 7);
+        }
+        offsets[i + 1] = (int32_t) len;
+    }
+    return len;
+}
+
+
+/*
+ * FNV-1a hash of the lower-cased key
+ */
+static uint64_t ctld_hash_nocase(const char * key){
+    uint64_t h = CSKETCH_FNV_OFFSET;
+    while (*key)
+        h = CSKETCH_FNV_STEP(h, cto_lower(*key++));
+    return h;
+}
+
+
+/*
+ * Returns the slot of the key in the overlay table: either the slot which
+ * holds the key or the empty slot where it should be inserted.
+ */
+static ctld_overlay_rule * ctld_overlay_slot(const ctld_overlay * overlay, const char * key, uint64_t h){
+    size_t mask = overlay->size - 1;
+    size_t pos = h & mask;
+    while (overlay->rules[pos].name){
+        if (overlay->rules[pos].hash == h && cstr_ccmp(overlay->rules[pos].name, key) == 0)
+            break;
+        pos = (pos + 1) & mask;
+    }
+    return &overlay->rules[pos];
+}
+
+
+/*
+ * Doubles the size of the overlay table. Returns 0 on success and 1 on failure.
+ */
+static int ctld_overlay_grow(ctld_overlay * overlay){
+    size_t new_size = overlay->size << 1;
+    ctld_overlay_rule * rules = (ctld_overlay_rule*) calloc(new_size, sizeof(ctld_overlay_rule));
+    if (!rules)
+        return 1;
+    for (size_t i=0; i< overlay->size; ++i){
+        if (!overlay->rules[i].name)
+            continue;
+        size_t pos = overlay->rules[i].hash & (new_size - 1);
+        while (rules[pos].name)
+            pos = (pos + 1) & (new_size - 1);
+        rules[pos] = overlay->rules[i];
+    }
+    free(overlay->rules);
+    overlay->rules = rules;
+    overlay->size = new_size;
+    return 0;
+}
+
+
+/*
+ * Sets the rule of a key in the overlay. node is NULL to remove the key.
+ * The overlay takes the ownership of node. Returns 0 on success and 3 on failure.
+ */
+static int ctld_overlay_set(ctld_overlay * overlay, const char * name, ctld_node * node){
+    uint64_t h = ctld_hash_nocase(name);
+    ctld_overlay_rule * rule = ctld_overlay_slot(overlay, name, h);
+    if (rule->name){
+        if (rule->node)
+            ctld_node_free(rule->node);
+        rule->node = node;
+        return 0;
+    }
+    rule->name = strdup(name);
+    if (!rule->name){
+        ctld_node_free(node);
+        return 3;
+    }
+    for (char * c = rule->name; *c; ++c)
+        *c = cto_lower(*c);
+    rule->hash = h;
+    rule->node = node;
+    overlay->len++;
+    if (overlay->len * 2 > overlay->size && ctld_overlay_grow(overlay))
+        return 3;
+    return 0;
+}
+
+
+/**
+ * @brief creates an empty overlay on top of a base context.
+ *
+ * @param base context created by calling ctld_parse_file() or ctld_parse_string()
+ *
+ * An overlay holds the rules of one tenant (added, removed or overridden
+ * rules) and only references the base context, so many overlays can share
+ * one copy of the PSL. The base context is never modified through the
+ * overlay and must outlive it.
+ *
+ * @return A pointer to the new overlay or NULL on failure.
+ */
+ctld_overlay * ctld_overlay_init(ctld_ctx * base){
+    if (!base)
+        return NULL;
+    ctld_overlay * overlay = (ctld_overlay*) calloc(1, sizeof(ctld_overlay));
+    if (!overlay)
+        return NULL;
+    overlay->size = CTLD_OVERLAY_INITIAL_SIZE;
+    overlay->rules = (ctld_overlay_rule*) calloc(overlay->size, sizeof(ctld_overlay_rule));
+    if (!overlay->rules){
+        free(overlay);
+        return NULL;
+    }
+    overlay->base = base;
+    return overlay;
+}
+
+
+/**
+ * @brief frees the overlay and its rules (but not the base context).
+ */
+void ctld_overlay_free(ctld_overlay * overlay){
+    if (!overlay)
+        return;
+    for (size_t i=0; i< overlay->size; ++i){
+        free(overlay->rules[i].name);
+        if (overlay->rules[i].node)
+            ctld_node_free(overlay->rules[i].node);
+    }
+    free(overlay->rules);
+    free(overlay);
+    return;
+}
+
+
+/**
+ * @brief adds a rule to the overlay.
+ *
+ * @param overlay overlay created by ctld_overlay_init()
+ * @param rule the rule in PSL syntax, e.g. "example.com", "*.example.com" or "!www.example.com"
+ * @param is_private 1 to add the rule to the PRIVATE section and 0 to add it to the ICANN section
+ *
+ * The rule overrides any rule of the base context with the same name (in
+ * both sections), including an exception rule with the same labels.
+ * An IDNA rule is added in both its Unicode and ASCII forms, like the rules
+ * of the PSL.
+ *
+ * @return 0 on success, 1 if the arguments are invalid and 3 if malloc() fails.
+ */
+int ctld_overlay_add_rule(ctld_overlay * overlay, const char * rule, int is_private){
+    if (!overlay || !rule)
+        return 1;
+    int exception = rule[0] == '!';
+    const char * name = exception?rule + 1:rule;
+    if (strlen(name) == 0)
+        return 1;
+    char * idna_out = NULL;
+    if (idna_to_ascii_8z(name, &idna_out, IDN2_NONTRANSITIONAL) != 0)
+        idna_out = NULL;
+    for (int i=0; i< 2; ++i){
+        const char * key = i?idna_out:name;
+        if (!key || (i && cstr_ccmp(idna_out, name) == 0))
+            continue;
+        struct ctld_node * node = (struct ctld_node*) malloc(sizeof(struct ctld_node));
+        if (!node || !(node->name = strdup(key))){
+            free(node);
+            free(idna_out);
+            return 3;
+        }
+        for (char * c = node->name; *c; ++c)
+            *c = cto_lower(*c);
+        node->is_private = is_private?1:0;
+        node->has_priority = exception;
+        if (ctld_overlay_set(overlay, key, node)){
+            free(idna_out);
+            return 3;
+        }
+        if (ctld_label_count(key) > overlay->max_depth)
+            overlay->max_depth = ctld_label_count(key);
+    }
+    free(idna_out);
+    return 0;
+}
+
+
+/**
+ * @brief removes a rule for the lookups done through the overlay.
+ *
+ * @param overlay overlay created by ctld_overlay_init()
+ * @param rule the rule in PSL syntax ("!" is ignored since an exception rule
+ * and a normal rule with the same labels can not exist together)
+ *
+ * The rule is hidden in both sections of the base context and removed
+ * from the overlay if it was added before.
+ *
+ * @return 0 on success, 1 if the arguments are invalid and 3 if malloc() fails.
+ */
+int ctld_overlay_remove_rule(ctld_overlay * overlay, const char * rule){
+    if (!overlay || !rule)
+        return 1;
+    const char * name = rule[0] == '!'?rule + 1:rule;
+    if (strlen(name) == 0)
+        return 1;
+    return ctld_overlay_set(overlay, name, NULL);
+}
+
+
+/**
+ * @brief parses the domain like ctld_parse() using the rules of the overlay
+ * and its base context.
+ *
+ * @param overlay overlay created by ctld_overlay_init()
+ * @param domain the domain name you want to parse
+ * @param use_private_suffix 0 means do not use private part of the PSL and 1 means
+ * using the private part of the PSL.
+ *
+ * Both layers are consulted during the same walk over the labels, so the
+ * cost is one extra probe per candidate key. The base context is not
+ * modified (errors are reported in overlay->errcode).
+ *
+ * @return Returns an instance of ctld_result on success and NULL on failure.
+ */
+ctld_result * ctld_overlay_parse(ctld_overlay * overlay, char * domain, int use_private_suffix){
+    if (!overlay || !domain)
+        return NULL;
+    ctld_match match, icann_match;
+    if (!ctld_find_rule(overlay->base, overlay, domain, use_private_suffix, &match, &icann_match)){
+        overlay->errcode = CTLD_NO_MATCH_FOUND;
+        return NULL;
+    }
+    ctld_result * result = ctld_build_result(&match, &icann_match, domain);
+    if (!result)
+        overlay->errcode = CTLD_ERROR_MALLOC_FAILED;
+    return result;
+}
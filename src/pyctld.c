@@ -0,0 +1,319 @@
+///@file pyctld.c
+// CPython extension module on top of libctld (build it with "make python").
+//
+//     import pyctld
+//     pyctld.parse("https://www.google.co.uk/")
+//     pyctld.parse_many(hosts, private=True)
+//     for line, result in pyctld.parse_file("urls.txt.gz"): ...
+//
+#define PY_SSIZE_T_CLEAN
+#include <Python.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <libctld.h>
+#include <chost.h>
+#include <creader.h>
+#include "psl_index.h"
+
+// the context is created once (from the embedded index) and only read afterwards
+static ctld_ctx * pyctld_ctx = NULL;
+
+static PyTypeObject pyctld_result_type;
+
+static PyStructSequence_Field pyctld_result_fields[] = {
+    {"fqdn", "fully-qualified domain name (None if the host is a public suffix)"},
+    {"registered_domain", "registered domain (None if the host is a public suffix)"},
+    {"domain", "the label right before the suffix"},
+    {"suffix", "public suffix"},
+    {"rule", "the PSL rule that matched"},
+    {"is_private", "True if the rule comes from the PRIVATE section"},
+    {NULL, NULL}
+};
+
+static PyStructSequence_Desc pyctld_result_desc = {
+    "pyctld.Result",
+    "Result of parsing one host",
+    pyctld_result_fields,
+    6
+};
+
+
+// hosts are looked up like the command line tool (chost_lookup()) without the GIL
+static ctld_result * pyctld_lookup(const char * input, int use_private){
+    return chost_lookup(pyctld_ctx, input, strlen(input), use_private, NULL);
+}
+
+
+static PyObject * pyctld_str_or_none(const char * str){
+    if (!str)
+        Py_RETURN_NONE;
+    return PyUnicode_FromString(str);
+}
+
+
+/*
+ * Makes a pyctld.Result from a ctld_result and frees it. Returns None for NULL.
+ */
+static PyObject * pyctld_make_result(ctld_result * result){
+    if (!result)
+        Py_RETURN_NONE;
+    PyObject * obj = PyStructSequence_New(&pyctld_result_type);
+    if (obj){
+        PyStructSequence_SET_ITEM(obj, 0, pyctld_str_or_none(result->fqdn));
+        PyStructSequence_SET_ITEM(obj, 1, pyctld_str_or_none(result->registered_domain));
+        PyStructSequence_SET_ITEM(obj, 2, pyctld_str_or_none(result->domain));
+        PyStructSequence_SET_ITEM(obj, 3, pyctld_str_or_none(result->suffix));
+        PyStructSequence_SET_ITEM(obj, 4, pyctld_str_or_none(result->rule));
+        PyStructSequence_SET_ITEM(obj, 5, PyBool_FromLong(result->is_private));
+        for (int i=0; i< 6; ++i){
+            if (!PyStructSequence_GET_ITEM(obj, i)){
+                Py_CLEAR(obj);
+                break;
+            }
+        }
+    }
+    ctld_result_free(result);
+    return obj;
+}
+
+
+static const char * pyctld_utf8(PyObject * obj){
+    if (PyUnicode_Check(obj))
+        return PyUnicode_AsUTF8(obj);
+    if (PyBytes_Check(obj))
+        return PyBytes_AS_STRING(obj);
+    PyErr_SetString(PyExc_TypeError, "hosts must be str or bytes");
+    return NULL;
+}
+
+
+PyDoc_STRVAR(pyctld_parse_doc,
+"parse(host, private=False)\n--\n\n"
+"Parses one host or URL. Returns a pyctld.Result or None if no rule matches.");
+
+static PyObject * pyctld_parse(PyObject * self, PyObject * args, PyObject * kwargs){
+    static char * kwlist[] = {"host", "private", NULL};
+    PyObject * host_obj;
+    int use_private = 0;
+    if (!PyArg_ParseTupleAndKeywords(args, kwargs, "O|p", kwlist, &host_obj, &use_private))
+        return NULL;
+    const char * host = pyctld_utf8(host_obj);
+    if (!host)
+        return NULL;
+    return pyctld_make_result(pyctld_lookup(host, use_private));
+}
+
+
+PyDoc_STRVAR(pyctld_parse_many_doc,
+"parse_many(hosts, private=False)\n--\n\n"
+"Parses a sequence of hosts or URLs in C without holding the GIL.\n"
+"Returns a list with a pyctld.Result (or None) for each host.");
+
+static PyObject * pyctld_parse_many(PyObject * self, PyObject * args, PyObject * kwargs){
+    static char * kwlist[] = {"hosts", "private", NULL};
+    PyObject * hosts_obj;
+    int use_private = 0;
+    if (!PyArg_ParseTupleAndKeywords(args, kwargs, "O|p", kwlist, &hosts_obj, &use_private))
+        return NULL;
+    // a tuple keeps the strings alive (and unchanged) while the GIL is released
+    PyObject * hosts = PySequence_Tuple(hosts_obj);
+    if (!hosts)
+        return NULL;
+    Py_ssize_t n = PyTuple_GET_SIZE(hosts);
+    const char ** names = (const char**) PyMem_Malloc((n?n:1) * sizeof(char*));
+    ctld_result ** results = (ctld_result**) PyMem_Calloc(n?n:1, sizeof(ctld_result*));
+    if (!names || !results){
+        PyMem_Free(names);
+        PyMem_Free(results);
+        Py_DECREF(hosts);
+        return PyErr_NoMemory();
+    }
+    for (Py_ssize_t i=0; i< n; ++i){
+        names[i] = pyctld_utf8(PyTuple_GET_ITEM(hosts, i));
+        if (!names[i]){
+            PyMem_Free(names);
+            PyMem_Free(results);
+            Py_DECREF(hosts);
+            return NULL;
+        }
+    }
+    Py_BEGIN_ALLOW_THREADS
+    for (Py_ssize_t i=0; i< n; ++i)
+        results[i] = pyctld_lookup(names[i], use_private);
+    Py_END_ALLOW_THREADS
+    PyObject * list = PyList_New(n);
+    for (Py_ssize_t i=0; i< n; ++i){
+        PyObject * item = list?pyctld_make_result(results[i]):NULL;
+        if (!list){
+            ctld_result_free(results[i]);
+            continue;
+        }
+        if (!item){
+            // free the rest of the results
+            Py_CLEAR(list);
+            continue;
+        }
+        PyList_SET_ITEM(list, i, item);
+    }
+    PyMem_Free(names);
+    PyMem_Free(results);
+    Py_DECREF(hosts);
+    return list;
+}
+
+
+/**
+ * @details Iterator returned by parse_file()
+ */
+typedef struct{
+    PyObject_HEAD
+    FILE * fp;                  ///< the file
+    creader_ctx * reader;       ///< line reader (handles compressed files)
+    int use_private;            ///< use the private section of the PSL
+} pyctld_file_iter;
+
+
+static void pyctld_file_iter_dealloc(pyctld_file_iter * self){
+    creader_free(self->reader);
+    if (self->fp)
+        fclose(self->fp);
+    Py_TYPE(self)->tp_free((PyObject*) self);
+}
+
+
+static PyObject * pyctld_file_iter_next(pyctld_file_iter * self){
+    char * line = NULL;
+    ssize_t n = -1;
+    ctld_result * result = NULL;
+    if (!self->reader)
+        return NULL;
+    // the reader is only used with the GIL held: another thread may call
+    // next() on the same iterator while the lookup runs
+    while ((n = creader_getline(self->reader, &line)) != -1){
+        while (n > 0 && (line[n-1] == '\r' || line[n-1] == ' '))
+            line[--n] = '\0';
+        if (n > 0)
+            break;
+    }
+    if (n == -1){
+        int err = creader_free(self->reader);
+        self->reader = NULL;
+        if (err)
+            PyErr_SetString(PyExc_OSError, "can not read or decompress the whole file");
+        return NULL;
+    }
+    // the line lives in the reader's buffer, so it is copied before the GIL is released
+    PyObject * line_obj = PyUnicode_DecodeUTF8(line, n, "replace");
+    const char * host = line_obj?PyUnicode_AsUTF8(line_obj):NULL;
+    if (!host){
+        Py_XDECREF(line_obj);
+        return NULL;
+    }
+    Py_BEGIN_ALLOW_THREADS
+    result = pyctld_lookup(host, self->use_private);
+    Py_END_ALLOW_THREADS
+    PyObject * result_obj = pyctld_make_result(result);
+    if (!result_obj){
+        Py_DECREF(line_obj);
+        return NULL;
+    }
+    PyObject * tuple = PyTuple_Pack(2, line_obj, result_obj);
+    Py_DECREF(line_obj);
+    Py_DECREF(result_obj);
+    return tuple;
+}
+
+
+static PyTypeObject pyctld_file_iter_type = {
+    PyVarObject_HEAD_INIT(NULL, 0)
+    .tp_name = "pyctld.FileIterator",
+    .tp_basicsize = sizeof(pyctld_file_iter),
+    .tp_dealloc = (destructor) pyctld_file_iter_dealloc,
+    .tp_flags = Py_TPFLAGS_DEFAULT,
+    .tp_doc = "Iterator over the (line, result) pairs of a file",
+    .tp_iter = PyObject_SelfIter,
+    .tp_iternext = (iternextfunc) pyctld_file_iter_next,
+};
+
+
+PyDoc_STRVAR(pyctld_parse_file_doc,
+"parse_file(path, private=False, threads=1)\n--\n\n"
+"Returns an iterator over the (line, result) pairs of a file with one host\n"
+"or URL per line. Empty lines are skipped and gzip, BGZF and zstd files are\n"
+"decompressed on the fly (threads is used for decompression).");
+
+static PyObject * pyctld_parse_file(PyObject * self, PyObject * args, PyObject * kwargs){
+    static char * kwlist[] = {"path", "private", "threads", NULL};
+    PyObject * path_obj;
+    int use_private = 0;
+    int threads = 1;
+    if (!PyArg_ParseTupleAndKeywords(args, kwargs, "O&|pi", kwlist, PyUnicode_FSConverter, &path_obj, &use_private, &threads))
+        return NULL;
+    FILE * fp = fopen(PyBytes_AS_STRING(path_obj), "rb");
+    if (!fp){
+        PyErr_SetFromErrnoWithFilenameObject(PyExc_OSError, path_obj);
+        Py_DECREF(path_obj);
+        return NULL;
+    }
+    Py_DECREF(path_obj);
+    creader_ctx * reader = creader_init(fp, 0, threads);
+    if (!reader){
+        fclose(fp);
+        PyErr_SetString(PyExc_OSError, "can not read the file (zstd needs a build with HAVE_ZSTD=1)");
+        return NULL;
+    }
+    pyctld_file_iter * it = PyObject_New(pyctld_file_iter, &pyctld_file_iter_type);
+    if (!it){
+        creader_free(reader);
+        fclose(fp);
+        return NULL;
+    }
+    it->fp = fp;
+    it->reader = reader;
+    it->use_private = use_private;
+    return (PyObject*) it;
+}
+
+
+static PyMethodDef pyctld_methods[] = {
+    {"parse", (PyCFunction)(void(*)(void)) pyctld_parse, METH_VARARGS | METH_KEYWORDS, pyctld_parse_doc},
+    {"parse_many", (PyCFunction)(void(*)(void)) pyctld_parse_many, METH_VARARGS | METH_KEYWORDS, pyctld_parse_many_doc},
+    {"parse_file", (PyCFunction)(void(*)(void)) pyctld_parse_file, METH_VARARGS | METH_KEYWORDS, pyctld_parse_file_doc},
+    {NULL, NULL, 0, NULL}
+};
+
+
+static struct PyModuleDef pyctld_module = {
+    PyModuleDef_HEAD_INIT,
+    "pyctld",
+    "Public Suffix List parser (libctld) for Python",
+    -1,
+    pyctld_methods
+};
+
+
+PyMODINIT_FUNC PyInit_pyctld(void){
+    if (!pyctld_ctx){
+        // the rule index of the PSL is built at compile time
+        pyctld_ctx = ctld_load_index(psl_index, psl_index_len);
+        if (!pyctld_ctx){
+            PyErr_SetString(PyExc_RuntimeError, "can not load the public suffix list");
+            return NULL;
+        }
+    }
+    if (pyctld_result_type.tp_name == NULL && PyStructSequence_InitType2(&pyctld_result_type, &pyctld_result_desc) < 0)
+        return NULL;
+    if (PyType_Ready(&pyctld_file_iter_type) < 0)
+        return NULL;
+    PyObject * m = PyModule_Create(&pyctld_module);
+    if (!m)
+        return NULL;
+    Py_INCREF(&pyctld_result_type);
+    if (PyModule_AddObject(m, "Result", (PyObject*) &pyctld_result_type) < 0){
+        Py_DECREF(&pyctld_result_type);
+        Py_DECREF(m);
+        return NULL;
+    }
+    return m;
+}
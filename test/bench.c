@@ -0,0 +1,202 @@
+#define _GNU_SOURCE
+#include <libctld.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sched.h>
+
+// Simple latency benchmark for ctld_parse().
+// Usage: ./bin/bench [iterations]
+
+static double now_ns(void){
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+static void bench_case(ctld_ctx * ctx, const char * name, char ** hosts, int nhosts, long iterations){
+    ctld_result * result;
+    double start = now_ns();
+    for (long i=0; i< iterations; ++i){
+        result = ctld_parse(ctx, hosts[i % nhosts], 1);
+        ctld_result_free(result);
+    }
+    double elapsed = now_ns() - start;
+    printf("%-32s %10.1f ns/lookup\n", name, elapsed / iterations);
+}
+
+// one thread of bench_threads(), pinned to one CPU
+typedef struct{
+    ctld_ctx * ctx;
+    char ** hosts;
+    int nhosts;
+    long iterations;
+    int cpu;
+} bench_thread_arg;
+
+static void * bench_thread(void * data){
+    bench_thread_arg * arg = (bench_thread_arg*) data;
+    cpu_set_t cpus;
+    CPU_ZERO(&cpus);
+    CPU_SET(arg->cpu, &cpus);
+    pthread_setaffinity_np(pthread_self(), sizeof(cpus), &cpus);
+    for (long i=0; i< arg->iterations; ++i)
+        ctld_result_free(ctld_parse(arg->ctx, arg->hosts[(i + arg->cpu * 7919) % arg->nhosts], 1));
+    return NULL;
+}
+
+// the same lookups on one thread per CPU; prints the average time of a lookup on one thread
+static void bench_threads(ctld_ctx * ctx, const char * name, char ** hosts, int nhosts, long iterations){
+    int nthreads = (int) sysconf(_SC_NPROCESSORS_ONLN);
+    if (nthreads < 1)
+        nthreads = 1;
+    pthread_t * threads = (pthread_t*) malloc(nthreads * sizeof(pthread_t));
+    bench_thread_arg * args = (bench_thread_arg*) malloc(nthreads * sizeof(bench_thread_arg));
+    double start = now_ns();
+    for (int i=0; i< nthreads; ++i){
+        args[i] = (bench_thread_arg){ctx, hosts, nhosts, iterations, i};
+        pthread_create(&threads[i], NULL, bench_thread, &args[i]);
+    }
+    for (int i=0; i< nthreads; ++i)
+        pthread_join(threads[i], NULL);
+    double elapsed = now_ns() - start;
+    printf("%-32s %10.1f ns/lookup (%d threads)\n", name, elapsed / iterations, nthreads);
+    free(threads);
+    free(args);
+}
+
+// makes a host with the given number of labels of the given size in front of suffix
+static char * make_host(int labels, int label_len, const char * suffix){
+    size_t len = (size_t)labels * (label_len + 1) + strlen(suffix) + 1;
+    char * host = (char*) malloc(len);
+    char * p = host;
+    for (int i=0; i< labels; ++i){
+        memset(p, 'a' + (i % 26), label_len);
+        p += label_len;
+        *p++ = '.';
+    }
+    strcpy(p, suffix);
+    return host;
+}
+
+// top-level labels roughly ordered by their share of real traffic
+static const char * zipf_tlds[] = {"com", "org", "net", "de", "uk", "ru", "br", "jp", "in", "it",
+                                   "fr", "au", "info", "io", "nl", "pl", "ca", "es", "cn", "edu",
+                                   "gov", "co", "xyz", "ch", "se", "tv", "me", "us", "online", "app",
+                                   "be", "dev", "kr", "mx", "top", "site", "no", "vn", "ir", "cz"};
+
+// makes n hosts whose top-level labels follow a Zipf distribution (s = 1.1)
+static char ** make_zipf_hosts(int n){
+    int ntlds = sizeof(zipf_tlds) / sizeof(zipf_tlds[0]);
+    double cdf[sizeof(zipf_tlds) / sizeof(zipf_tlds[0])];
+    double sum = 0;
+    for (int i=0; i< ntlds; ++i){
+        sum += 1 / pow(i + 1, 1.1);
+        cdf[i] = sum;
+    }
+    char ** hosts = (char**) malloc(n * sizeof(char*));
+    uint64_t state = 42;
+    for (int i=0; i< n; ++i){
+        state = state * 6364136223846793005ULL + 1442695040888963407ULL;
+        double u = (state >> 11) * (1.0 / 9007199254740992.0) * sum;
+        int k = 0;
+        while (k < ntlds - 1 && cdf[k] < u)
+            k++;
+        hosts[i] = (char*) malloc(64);
+        snprintf(hosts[i], 64, "www.site%d.%s", i % 1000, zipf_tlds[k]);
+    }
+    return hosts;
+}
+
+int main(int argc, char ** argv){
+    long iterations = argc > 1?atol(argv[1]):200000;
+    ctld_ctx * ctx = ctld_parse_file("psl.dat");
+    if (!ctx){
+        fprintf(stderr, "Can not load psl.dat\n");
+        return 1;
+    }
+    char * typical[] = {"www.google.com", "mail.bbc.co.uk", "a.b.example.ck", "foo.blogspot.com",
+                        "s3.ap-south-1.amazonaws.com", "www.cgs.act.edu.au", "xn--h1alffa9f.xn--p1ai", "city.kawasaki.jp"};
+    bench_case(ctx, "typical hosts", typical, sizeof(typical) / sizeof(typical[0]), iterations);
+
+    // adversarial inputs: the lookup cost must not grow with the number of labels
+    char * deep[4];
+    deep[0] = make_host(10, 1, "com");
+    deep[1] = make_host(50, 1, "com");
+    deep[2] = make_host(125, 1, "com");       // 253 bytes
+    deep[3] = make_host(125, 1, "ck");        // under a wildcard rule
+    bench_case(ctx, "10 labels", deep, 1, iterations);
+    bench_case(ctx, "50 labels", deep + 1, 1, iterations);
+    bench_case(ctx, "125 labels (253 bytes)", deep + 2, 1, iterations);
+    bench_case(ctx, "125 labels under *.ck", deep + 3, 1, iterations);
+
+    char * longest[1];
+    longest[0] = make_host(3, 63, "co.uk");
+    bench_case(ctx, "3 labels of 63 bytes", longest, 1, iterations);
+
+    // the same index without the direct tables of the top-level labels
+    size_t len;
+    const void * data = ctld_index_data(ctx, &len);
+    uint64_t * copy = (uint64_t*) malloc(len);
+    memcpy(copy, data, len);
+    ((ctld_index_header*) copy)->tld2 = 0;
+    ((ctld_index_header*) copy)->gtld = 0;
+    ctld_ctx * no_tables = ctld_load_index(copy, len);
+    int nzipf = 4096;
+    char ** zipf = make_zipf_hosts(nzipf);
+    bench_case(ctx, "zipf top-level labels", zipf, nzipf, iterations);
+    bench_case(no_tables, "zipf, no top-level tables", zipf, nzipf, iterations);
+
+    // the compact layout trades lookup speed for memory
+    ctld_options options;
+    ctld_options_init(&options);
+    options.filename = "psl.dat";
+    options.layout = CTLD_LAYOUT_COMPACT;
+    ctld_ctx * compact = ctld_ctx_create(&options);
+    size_t compact_len;
+    ctld_index_data(compact, &compact_len);
+    printf("index size: %zu bytes, compact: %zu bytes\n", len, compact_len);
+    bench_case(compact, "typical hosts, compact index", typical, sizeof(typical) / sizeof(typical[0]), iterations);
+    bench_case(compact, "zipf, compact index", zipf, nzipf, iterations);
+    ctld_free(compact);
+
+    // pinned threads on a shared index, then on one copy per NUMA node
+    bench_threads(ctx, "zipf, shared index", zipf, nzipf, iterations);
+
+    // ctld_parse_parallel() on a large array, with more threads each time
+    size_t nbatch = 1 << 20;
+    const char ** batch = (const char**) malloc(nbatch * sizeof(char*));
+    ctld_result ** results = (ctld_result**) malloc(nbatch * sizeof(ctld_result*));
+    for (size_t i=0; i< nbatch; ++i)
+        batch[i] = i % 64 == 0?deep[i / 64 % 4]:zipf[i % nzipf];
+    int ncpus = (int) sysconf(_SC_NPROCESSORS_ONLN);
+    for (int threads=1; threads<= ncpus; threads*=2){
+        double start = now_ns();
+        ctld_parse_parallel(ctx, batch, nbatch, 1, results, threads);
+        double elapsed = now_ns() - start;
+        printf("parse_parallel, %3d threads       %10.1f ns/host\n", threads, elapsed / nbatch);
+        for (size_t i=0; i< nbatch; ++i)
+            ctld_result_free(results[i]);
+    }
+    free(batch);
+    free(results);
+
+    int copies = ctld_ctx_replicate_numa(ctx);
+    printf("NUMA copies: %d\n", copies);
+    bench_threads(ctx, "zipf, NUMA replicas", zipf, nzipf, iterations);
+    for (int i=0; i< nzipf; ++i)
+        free(zipf[i]);
+    free(zipf);
+    ctld_free(no_tables);
+    free(copy);
+
+    for (int i=0; i< 4; ++i)
+        free(deep[i]);
+    free(longest[0]);
+    ctld_free(ctx);
+    return 0;
+}
@@ -1,6 +1,8 @@
 #include <libctld.h>
+#include <csketch.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <assert.h>
 #include <cunittest.h>
 
@@ -87,13 +89,558 @@ int test(){
     // let's add a custom suffix to see we can parse it
     ctld_add_custom_suffix(ctx, "imaginerysuffix");
     assert_expect(ctx, 0, "shit.test.domain.imaginerysuffix", "shit.test.domain.imaginerysuffix", "domain.imaginerysuffix", "domain", "imaginerysuffix");
+    // each suffix is indexed right away
+    char custom[32];
+    for (int i=0; i< 20; ++i){
+        snprintf(custom, sizeof(custom), "custom%d.example", i);
+        ASSERT_EQ_INT(ctld_add_custom_suffix(ctx, custom), 0);
+    }
+    ASSERT_EQ_INT(ctld_add_custom_suffix(ctx, "custom7.example"), 2);
+    assert_expect(ctx, 0, "a.b.custom19.example", "a.b.custom19.example", "b.custom19.example", "b", "custom19.example");
+    assert_expect(ctx, 0, "a.b.custom0.example", "a.b.custom0.example", "b.custom0.example", "b", "custom0.example");
     //free the memory (but it's not necessary!)
     ctld_free(ctx);
     return 0;
 }
 
+int test_sketch(){
+    ctld_ctx * ctx = ctld_parse_file("psl.dat");
+    ASSERT_NE_NULL(ctx);
+    csketch_topk * topk = csketch_topk_init(4);
+    csketch_hll * distinct = csketch_hll_init(CSKETCH_HLL_DEFAULT_PRECISION);
+    ASSERT_NE_NULL(topk);
+    ASSERT_NE_NULL(distinct);
+    char * records[] = {"a.google.com", "b.google.com", "www.theregister.co.uk", "mail.google.com", "example.ck", "c.google.com"};
+    for (int i=0; i< 6; ++i){
+        ctld_result * result = ctld_parse(ctx, records[i], 0);
+        ASSERT_NE_NULL(result);
+        ctld_topk_add(topk, result, CTLD_FIELD_RD);
+        ctld_distinct_add(distinct, result, CTLD_FIELD_SUFFIX);
+        ctld_result_free(result);
+    }
+    size_t len = 0;
+    PCSKETCH_ITEM lst = csketch_topk_list(topk, 1, &len);
+    ASSERT_EQ_INT(len, 1);
+    ASSERT_EQ_STR(lst[0].key, "google.com");
+    ASSERT_EQ_INT(lst[0].count, 4);
+    free(lst);
+    // com, co.uk, example.ck
+    ASSERT_EQ_INT(csketch_hll_count(distinct), 3);
+    // the bits of a 1 GB Bloom filter are used evenly, also above 2^32
+    csketch_bloom * bloom = csketch_bloom_init((size_t) 1 << 30, 0);
+    ASSERT_NE_NULL(bloom);
+    char key[32];
+    for (int i=0; i< 1000; ++i){
+        snprintf(key, sizeof(key), "host%d.example.com", i);
+        ASSERT_EQ_INT(csketch_bloom_add(bloom, key), 1);
+        ASSERT_EQ_INT(csketch_bloom_add(bloom, key), 0);
+    }
+    // 7000 bits are set, about half of them in the upper half
+    size_t high = 0;
+    for (size_t i=(size_t) 1 << 29; i< (size_t) 1 << 30; i += 8)
+        high += __builtin_popcountll(*(uint64_t*)(bloom->bits + i));
+    ASSERT_GT_INT(high, 3200);
+    ASSERT_LT_INT(high, 3800);
+    csketch_bloom_free(bloom);
+    csketch_topk_free(topk);
+    csketch_hll_free(distinct);
+    ctld_free(ctx);
+    return 0;
+}
+
+void assert_rule(ctld_ctx * ctld, int is_private, char * record, char * rule, int rule_private,
+                 int wildcard, int exception, char * icann_rd, char * icann_suffix){
+    ctld_result * result = ctld_parse(ctld, record, is_private);
+    ASSERT_NE_NULL(result);
+    ASSERT_EQ_STR(result->rule, rule);
+    ASSERT_EQ_INT(result->is_private, rule_private);
+    ASSERT_EQ_INT(result->is_wildcard, wildcard);
+    ASSERT_EQ_INT(result->is_exception, exception);
+    if (icann_rd)
+        ASSERT_EQ_STR(result->icann_registered_domain, icann_rd);
+    else
+        ASSERT_NULL(result->icann_registered_domain);
+    if (icann_suffix)
+        ASSERT_EQ_STR(result->icann_suffix, icann_suffix);
+    else
+        ASSERT_NULL(result->icann_suffix);
+    ctld_result_free(result);
+}
+
+int test_metadata(){
+    ctld_ctx * ctx = ctld_parse_file("psl.dat");
+    ASSERT_NE_NULL(ctx);
+    assert_rule(ctx, 1, "www.google.com", "com", 0, 0, 0, "google.com", "com");
+    assert_rule(ctx, 0, "foo.blogspot.com", "com", 0, 0, 0, "blogspot.com", "com");
+    assert_rule(ctx, 1, "foo.blogspot.com", "blogspot.com", 1, 0, 0, "blogspot.com", "com");
+    assert_rule(ctx, 1, "blogspot.com", "blogspot.com", 1, 0, 0, "blogspot.com", "com");
+    assert_rule(ctx, 1, "a.b.example.ck", "*.ck", 0, 1, 0, "b.example.ck", "example.ck");
+    assert_rule(ctx, 1, "www.ck", "!www.ck", 0, 0, 1, "www.ck", "ck");
+    assert_rule(ctx, 1, "com", "com", 0, 0, 0, NULL, "com");
+    ctld_free(ctx);
+    return 0;
+}
+
+int test_predicates(){
+    ctld_ctx * ctx = ctld_parse_file("psl.dat");
+    ASSERT_NE_NULL(ctx);
+    ASSERT_EQ_INT(ctld_is_public_suffix(ctx, "com", 0), 1);
+    ASSERT_EQ_INT(ctld_is_public_suffix(ctx, "co.uk", 0), 1);
+    ASSERT_EQ_INT(ctld_is_public_suffix(ctx, "google.com", 0), 0);
+    ASSERT_EQ_INT(ctld_is_public_suffix(ctx, "blogspot.com", 0), 0);
+    ASSERT_EQ_INT(ctld_is_public_suffix(ctx, "blogspot.com", 1), 1);
+    ASSERT_EQ_INT(ctld_is_public_suffix(ctx, "example.ck", 0), 1);
+    ASSERT_EQ_INT(ctld_is_public_suffix(ctx, "www.ck", 0), 0);
+    ASSERT_EQ_INT(ctld_is_public_suffix(ctx, NULL, 0), -1);
+    ASSERT_EQ_INT(ctld_same_registered_domain(ctx, "a.google.com", "b.GOOGLE.com", 0), 1);
+    ASSERT_EQ_INT(ctld_same_registered_domain(ctx, "google.com", "google.co.uk", 0), 0);
+    ASSERT_EQ_INT(ctld_same_registered_domain(ctx, "a.blogspot.com", "b.blogspot.com", 0), 1);
+    ASSERT_EQ_INT(ctld_same_registered_domain(ctx, "a.blogspot.com", "b.blogspot.com", 1), 0);
+    ASSERT_EQ_INT(ctld_same_registered_domain(ctx, "com", "com", 0), 0);
+    const char * left[] = {"www.theregister.co.uk", "x.example.ck", "www.ck", NULL};
+    const char * right[] = {"media.theregister.co.uk", "y.example.ck", "a.www.ck", "com"};
+    int out[4];
+    ASSERT_EQ_INT(ctld_same_registered_domain_batch(ctx, left, right, 4, 1, out), 2);
+    ASSERT_EQ_INT(out[0], 1);
+    ASSERT_EQ_INT(out[1], 0);
+    ASSERT_EQ_INT(out[2], 1);
+    ASSERT_EQ_INT(out[3], -1);
+    ctld_free(ctx);
+    return 0;
+}
+
+int test_overlay(){
+    ctld_ctx * ctx = ctld_parse_file("psl.dat");
+    ASSERT_NE_NULL(ctx);
+    ctld_overlay * tenant1 = ctld_overlay_init(ctx);
+    ctld_overlay * tenant2 = ctld_overlay_init(ctx);
+    ASSERT_NE_NULL(tenant1);
+    ASSERT_NE_NULL(tenant2);
+    ASSERT_EQ_INT(ctld_overlay_add_rule(tenant1, "Corp.Example.com", 0), 0);
+    ASSERT_EQ_INT(ctld_overlay_add_rule(tenant1, "*.dev.example.com", 1), 0);
+    ASSERT_EQ_INT(ctld_overlay_add_rule(tenant1, "!keep.dev.example.com", 1), 0);
+    ASSERT_EQ_INT(ctld_overlay_remove_rule(tenant1, "blogspot.com"), 0);
+    ASSERT_EQ_INT(ctld_overlay_remove_rule(tenant2, "*.ck"), 0);
+    ASSERT_NULL(ctld_overlay_parse(tenant2, "a.b.example.ck", 0));
+    ASSERT_EQ_INT(ctld_overlay_add_rule(tenant2, "ck", 0), 0);
+    ASSERT_EQ_INT(ctld_overlay_add_rule(tenant2, "co.uk", 1), 0);
+    ctld_result * result = ctld_overlay_parse(tenant1, "www.corp.example.com", 0);
+    ASSERT_NE_NULL(result);
+    ASSERT_EQ_STR(result->registered_domain, "www.corp.example.com");
+    ASSERT_EQ_STR(result->rule, "corp.example.com");
+    ctld_result_free(result);
+    result = ctld_overlay_parse(tenant1, "a.b.dev.example.com", 1);
+    ASSERT_NE_NULL(result);
+    ASSERT_EQ_STR(result->registered_domain, "a.b.dev.example.com");
+    ASSERT_EQ_INT(result->is_wildcard, 1);
+    ASSERT_EQ_INT(result->is_private, 1);
+    ASSERT_EQ_STR(result->icann_registered_domain, "example.com");
+    ctld_result_free(result);
+    result = ctld_overlay_parse(tenant1, "x.keep.dev.example.com", 1);
+    ASSERT_NE_NULL(result);
+    ASSERT_EQ_STR(result->registered_domain, "keep.dev.example.com");
+    ctld_result_free(result);
+    result = ctld_overlay_parse(tenant1, "foo.blogspot.com", 1);
+    ASSERT_NE_NULL(result);
+    ASSERT_EQ_STR(result->registered_domain, "blogspot.com");
+    ctld_result_free(result);
+    // tenant1 does not see the rules of tenant2 and the base is unchanged
+    assert_expect(ctx, 1, "foo.blogspot.com", "foo.blogspot.com", "foo.blogspot.com", "foo", "blogspot.com");
+    assert_expect(ctx, 0, "www.corp.example.com", "www.corp.example.com", "example.com", "example", "com");
+    result = ctld_overlay_parse(tenant2, "a.b.example.ck", 0);
+    ASSERT_NE_NULL(result);
+    ASSERT_EQ_STR(result->registered_domain, "example.ck");
+    ctld_result_free(result);
+    result = ctld_overlay_parse(tenant2, "www.bbc.co.uk", 0);
+    ASSERT_NE_NULL(result);
+    ASSERT_EQ_STR(result->registered_domain, "co.uk");
+    ctld_result_free(result);
+    result = ctld_overlay_parse(tenant2, "www.bbc.co.uk", 1);
+    ASSERT_NE_NULL(result);
+    ASSERT_EQ_STR(result->registered_domain, "bbc.co.uk");
+    ASSERT_EQ_INT(result->is_private, 1);
+    ctld_result_free(result);
+    result = ctld_overlay_parse(tenant1, "www.bbc.co.uk", 0);
+    ASSERT_NE_NULL(result);
+    ASSERT_EQ_STR(result->registered_domain, "bbc.co.uk");
+    ctld_result_free(result);
+    // many rules make the table grow
+    char rule[32];
+    for (int i=0; i< 100; ++i){
+        sprintf(rule, "t%d.example.org", i);
+        ASSERT_EQ_INT(ctld_overlay_add_rule(tenant2, rule, 0), 0);
+    }
+    result = ctld_overlay_parse(tenant2, "a.t42.example.org", 0);
+    ASSERT_NE_NULL(result);
+    ASSERT_EQ_STR(result->suffix, "t42.example.org");
+    ctld_result_free(result);
+    ctld_overlay_free(tenant1);
+    ctld_overlay_free(tenant2);
+    ctld_free(ctx);
+    return 0;
+}
+
+int test_index(){
+    ctld_ctx * ctx = ctld_parse_file("psl.dat");
+    ASSERT_NE_NULL(ctx);
+    size_t len = 0;
+    const void * data = ctld_index_data(ctx, &len);
+    ASSERT_NE_NULL((void*) data);
+    ASSERT_EQ_INT(((const ctld_index_header*) data)->magic, CTLD_INDEX_MAGIC);
+    uint64_t * copy = (uint64_t*) malloc(len + 8);
+    memcpy(copy, data, len);
+    ctld_ctx * loaded = ctld_load_index(copy, len);
+    ASSERT_NE_NULL(loaded);
+    ASSERT_EQ_INT(loaded->max_depth, ctx->max_depth);
+    assert_expect(loaded, 0, "www.google.co.uk", "www.google.co.uk", "google.co.uk", "google", "co.uk");
+    assert_expect(loaded, 0, "a.b.example.ck", "a.b.example.ck", "b.example.ck", "b", "example.ck");
+    assert_expect(loaded, 0, "www.ck", "www.ck", "www.ck", "www", "ck");
+    assert_expect(loaded, 1, "a.b.blogspot.com", "a.b.blogspot.com", "b.blogspot.com", "b", "blogspot.com");
+    // the suffix hash is updated byte by byte from the right, case-insensitive
+    assert_expect(loaded, 0, "WWW.Google.CO.UK", "www.google.co.uk", "google.co.uk", "google", "co.uk");
+    assert_expect(loaded, 0, "X.Y.Z.City.Kawasaki.JP", "x.y.z.city.kawasaki.jp", "city.kawasaki.jp", "city", "kawasaki.jp");
+    ASSERT_NULL(ctld_parse(loaded, "example.invalidtld", 1));
+    // top-level labels from the direct tables: two letters, common gTLDs and labels without rules
+    assert_expect(loaded, 0, "A.B.Example.COM", "a.b.example.com", "example.com", "example", "com");
+    assert_expect(loaded, 0, "www.Example.Online", "www.example.online", "example.online", "example", "online");
+    assert_expect(loaded, 1, "x.App.Web.App", "x.app.web.app", "app.web.app", "app", "web.app");
+    ASSERT_NULL(ctld_parse(loaded, "www.example.qz", 1));
+    ASSERT_NULL(ctld_parse(loaded, "www.example.zzz", 1));
+    ASSERT_GT_INT(((ctld_index_header*) copy)->tld2, 0);
+    // adding a rule builds a new index and leaves the loaded one untouched
+    ASSERT_EQ_INT(ctld_add_custom_suffix(loaded, "co.uk"), 2);
+    ASSERT_EQ_INT(ctld_add_custom_suffix(loaded, "invalidtld"), 0);
+    ASSERT_EQ_INT(ctld_add_custom_suffix(loaded, "invalidtld"), 2);
+    ASSERT_EQ_INT(loaded->owns_index, 1);
+    assert_expect(loaded, 0, "a.example.invalidtld", "a.example.invalidtld", "example.invalidtld", "example", "invalidtld");
+    ASSERT_EQ_INT(memcmp(copy, data, len), 0);
+    ctld_free(loaded);
+    // truncated, misaligned or corrupted indexes are rejected
+    ASSERT_NULL(ctld_load_index(copy, len - 1));
+    ASSERT_NULL(ctld_load_index((char*) copy + 1, len - 1));
+    ((ctld_index_header*) copy)->version++;
+    ASSERT_NULL(ctld_load_index(copy, len));
+    ((ctld_index_header*) copy)->version--;
+    ((ctld_index_header*) copy)->names_len = (uint32_t) len;
+    ASSERT_NULL(ctld_load_index(copy, len));
+    memcpy(copy, data, len);
+    ((ctld_index_header*) copy)->gtld++;
+    ASSERT_NULL(ctld_load_index(copy, len));
+    // without the direct tables every label goes through the hash index
+    ((ctld_index_header*) copy)->tld2 = 0;
+    ((ctld_index_header*) copy)->gtld = 0;
+    loaded = ctld_load_index(copy, len);
+    ASSERT_NE_NULL(loaded);
+    assert_expect(loaded, 0, "A.B.Example.COM", "a.b.example.com", "example.com", "example", "com");
+    assert_expect(loaded, 0, "www.google.co.uk", "www.google.co.uk", "google.co.uk", "google", "co.uk");
+    assert_expect(loaded, 1, "x.App.Web.App", "x.app.web.app", "app.web.app", "app", "web.app");
+    ASSERT_NULL(ctld_parse(loaded, "www.example.qz", 1));
+    ctld_free(loaded);
+    free(copy);
+    // an empty list gives an empty index
+    ctld_ctx * empty = ctld_parse_string("");
+    ASSERT_NE_NULL(empty);
+    ASSERT_NULL(ctld_parse(empty, "www.google.com", 1));
+    ASSERT_EQ_INT(ctld_add_rules_from_string(empty, "com\n*.ck\n!www.ck\n"), 3);
+    assert_expect(empty, 0, "www.google.com", "www.google.com", "google.com", "google", "com");
+    assert_expect(empty, 0, "www.ck", "www.ck", "www.ck", "www", "ck");
+    ctld_free(empty);
+    ctld_free(ctx);
+    return 0;
+}
+
+int test_compact(){
+    ctld_options options;
+    ctld_options_init(&options);
+    options.filename = "psl.dat";
+    options.layout = CTLD_LAYOUT_COMPACT;
+    ctld_ctx * ctx = ctld_ctx_create(&options);
+    ASSERT_NE_NULL(ctx);
+    options.layout = 42;
+    ASSERT_NULL(ctld_ctx_create(&options));
+    size_t len = 0;
+    const void * data = ctld_index_data(ctx, &len);
+    ASSERT_EQ_INT(((const ctld_index_header*) data)->layout, CTLD_LAYOUT_COMPACT);
+    ASSERT_LT_INT(len, 150 * 1024);
+    assert_expect(ctx, 0, "WWW.Google.CO.UK", "www.google.co.uk", "google.co.uk", "google", "co.uk");
+    assert_expect(ctx, 0, "a.b.example.ck", "a.b.example.ck", "b.example.ck", "b", "example.ck");
+    assert_expect(ctx, 0, "www.ck", "www.ck", "www.ck", "www", "ck");
+    assert_expect(ctx, 1, "a.b.blogspot.com", "a.b.blogspot.com", "b.blogspot.com", "b", "blogspot.com");
+    assert_expect(ctx, 0, "X.Y.Z.City.Kawasaki.JP", "x.y.z.city.kawasaki.jp", "city.kawasaki.jp", "city", "kawasaki.jp");
+    ASSERT_NULL(ctld_parse(ctx, "example.invalidtld", 1));
+    // the index can be copied and loaded like the default one
+    uint64_t * copy = (uint64_t*) malloc(len);
+    memcpy(copy, data, len);
+    ctld_ctx * loaded = ctld_load_index(copy, len);
+    ASSERT_NE_NULL(loaded);
+    assert_expect(loaded, 1, "x.App.Web.App", "x.app.web.app", "app.web.app", "app", "web.app");
+    // new rules keep the layout
+    ASSERT_EQ_INT(ctld_add_custom_suffix(loaded, "co.uk"), 2);
+    ASSERT_EQ_INT(ctld_add_custom_suffix(loaded, "invalidtld"), 0);
+    size_t new_len;
+    ASSERT_EQ_INT(((const ctld_index_header*) ctld_index_data(loaded, &new_len))->layout, CTLD_LAYOUT_COMPACT);
+    assert_expect(loaded, 0, "a.example.invalidtld", "a.example.invalidtld", "example.invalidtld", "example", "invalidtld");
+    assert_expect(loaded, 0, "www.google.co.uk", "www.google.co.uk", "google.co.uk", "google", "co.uk");
+    ctld_free(loaded);
+    // a block which points past the names is rejected
+    ((uint32_t*)((char*) copy + ((ctld_index_header*) copy)->entries))[1] = ((ctld_index_header*) copy)->names_len;
+    ASSERT_NULL(ctld_load_index(copy, len));
+    free(copy);
+    ctld_free(ctx);
+    return 0;
+}
+
+int test_options(){
+    ctld_options options;
+    ctld_options_init(&options);
+    ASSERT_EQ_INT(options.sections, CTLD_SECTION_ALL);
+    ASSERT_EQ_INT(options.layout, CTLD_LAYOUT_HASH);
+    options.filename = "psl.dat";
+    ctld_ctx * all = ctld_ctx_create(&options);
+    ASSERT_NE_NULL(all);
+    // ICANN section only, ASCII form of the IDNA rules only
+    options.sections = CTLD_SECTION_ICANN;
+    options.unicode_rules = 0;
+    options.hash_seed = 12345;
+    ctld_ctx * icann = ctld_ctx_create(&options);
+    ASSERT_NE_NULL(icann);
+    ASSERT_LT_INT(ctld_ctx_memory_usage(icann), ctld_ctx_memory_usage(all));
+    assert_expect(icann, 1, "a.b.blogspot.com", "a.b.blogspot.com", "blogspot.com", "blogspot", "com");
+    assert_expect(icann, 0, "www.google.co.uk", "www.google.co.uk", "google.co.uk", "google", "co.uk");
+    assert_expect(icann, 0, "a.xn--55qx5d.cn", "a.xn--55qx5d.cn", "a.xn--55qx5d.cn", "a", "xn--55qx5d.cn");
+    assert_expect(all, 0, "a.公司.cn", "a.公司.cn", "a.公司.cn", "a", "公司.cn");
+    assert_expect(icann, 0, "a.公司.cn", "a.公司.cn", "公司.cn", "公司", "cn");
+    // the skipped section stays skipped when rules are added
+    ASSERT_EQ_INT(ctld_add_rules_from_string(icann, "// ===BEGIN PRIVATE DOMAINS===\nexample.com\n"), 0);
+    ctld_free(icann);
+    // the rules can also come from memory or be added later
+    options.filename = NULL;
+    options.data = "// ===BEGIN ICANN DOMAINS===\ncom\n// ===END ICANN DOMAINS===\n";
+    ctld_ctx * data = ctld_ctx_create(&options);
+    ASSERT_NE_NULL(data);
+    assert_expect(data, 0, "www.google.com", "www.google.com", "google.com", "google", "com");
+    ctld_free(data);
+    ctld_ctx * empty = ctld_ctx_create(NULL);
+    ASSERT_NE_NULL(empty);
+    ASSERT_NULL(ctld_parse(empty, "www.google.com", 1));
+    ASSERT_EQ_INT(ctld_add_rules_from_string(empty, "com\n"), 1);
+    assert_expect(empty, 0, "www.google.com", "www.google.com", "google.com", "google", "com");
+    ctld_free(empty);
+    // bad options and missing files
+    options.data = NULL;
+    options.filename = "no-such-file.dat";
+    ASSERT_NULL(ctld_ctx_create(&options));
+    options.filename = "psl.dat";
+    options.sections = 4;
+    ASSERT_NULL(ctld_ctx_create(&options));
+    // a loaded index is not counted
+    size_t len;
+    const void * index = ctld_index_data(all, &len);
+    ctld_ctx * loaded = ctld_load_index(index, len);
+    ASSERT_EQ_INT(ctld_ctx_memory_usage(loaded), sizeof(ctld_ctx));
+    ASSERT_EQ_INT(ctld_ctx_memory_usage(all), sizeof(ctld_ctx) + len);
+    ctld_free(loaded);
+    ctld_free(all);
+    return 0;
+}
+
+int test_buffer(){
+    // not null-terminated, CRLF lines, rules outside the markers and trailing words
+    const char psl[] = "ignored.example\r\n// ===BEGIN ICANN DOMAINS===\r\ncom\r\n  co.uk trailing words\r\n"
+                       "// comment\r\n*.ck\r\n!www.ck\r\n// ===END ICANN DOMAINS===\r\n"
+                       "// ===BEGIN PRIVATE DOMAINS===\r\nblogspot.com\r\n// ===END PRIVATE DOMAINS===\r\nXXXX";
+    ctld_options options;
+    ctld_options_init(&options);
+    options.data = psl;
+    options.len = sizeof(psl) - 5;
+    ctld_ctx * ctx = ctld_ctx_create(&options);
+    ASSERT_NE_NULL(ctx);
+    ASSERT_EQ_INT(ctx->index->count, 5);
+    assert_expect(ctx, 0, "www.google.co.uk", "www.google.co.uk", "google.co.uk", "google", "co.uk");
+    assert_expect(ctx, 0, "a.b.example.ck", "a.b.example.ck", "b.example.ck", "b", "example.ck");
+    assert_expect(ctx, 0, "www.ck", "www.ck", "www.ck", "www", "ck");
+    assert_expect(ctx, 1, "a.b.blogspot.com", "a.b.blogspot.com", "b.blogspot.com", "b", "blogspot.com");
+    ASSERT_NULL(ctld_parse(ctx, "a.ignored.example", 1));
+    // the same scanner adds rules; outside the markers they go to the ICANN section
+    const char rules[] = "corp.example\n// ===BEGIN PRIVATE DOMAINS===\nusers.example.net\nYYYY";
+    ASSERT_EQ_INT(ctld_add_rules_from_buffer(ctx, rules, sizeof(rules) - 6), 2);
+    assert_expect(ctx, 0, "a.b.corp.example", "a.b.corp.example", "b.corp.example", "b", "corp.example");
+    assert_expect(ctx, 1, "a.users.example.net", "a.users.example.net", "a.users.example.net", "a", "users.example.net");
+    ASSERT_EQ_INT(ctld_add_rules_from_buffer(ctx, NULL, 0), 0);
+    ASSERT_EQ_INT(ctld_add_rules_from_buffer(ctx, NULL, 1), -1);
+    ctld_free(ctx);
+    return 0;
+}
+
+int test_numa(){
+    ctld_ctx * ctx = ctld_parse_file("psl.dat");
+    ASSERT_NE_NULL(ctx);
+    size_t before = ctld_ctx_memory_usage(ctx);
+    int copies = ctld_ctx_replicate_numa(ctx);
+    ASSERT_GT_INT(copies, 0);
+    ASSERT_NE_NULL(ctx->replicas);
+    ASSERT_GT_INT(ctld_ctx_memory_usage(ctx), before);
+    // lookups go to the copy of the local node and give the same results
+    assert_expect(ctx, 0, "www.google.co.uk", "www.google.co.uk", "google.co.uk", "google", "co.uk");
+    assert_expect(ctx, 1, "a.b.blogspot.com", "a.b.blogspot.com", "b.blogspot.com", "b", "blogspot.com");
+    assert_expect(ctx, 0, "a.b.www.ck", "a.b.www.ck", "www.ck", "www", "ck");
+    // the index of a replicated context is final
+    ASSERT_EQ_INT(ctld_add_custom_suffix(ctx, "corp.example"), 4);
+    ASSERT_EQ_INT(ctld_add_rules_from_string(ctx, "corp.example\n"), -1);
+    ASSERT_EQ_INT(ctx->errcode, CTLD_CONTEXT_REPLICATED);
+    ASSERT_NE_NULL(ctx->replicas);
+    ASSERT_EQ_INT(ctx->replicas[0]->errcode, 0);
+    ASSERT_NULL(ctx->replicas[0]->replicas);
+    ASSERT_NULL(ctld_parse_r(ctx, "a.b.corp.example", 0));
+    ASSERT_EQ_INT(ctld_ctx_replicate_numa(ctx), copies);
+    ASSERT_EQ_INT(ctld_ctx_replicate_numa(NULL), -1);
+    ctld_free(ctx);
+    return 0;
+}
+
+int test_parallel(){
+    ctld_ctx * ctx = ctld_parse_file("psl.dat");
+    ASSERT_NE_NULL(ctx);
+    const char * samples[] = {"www.google.com", "a.b.blogspot.com", "mail.bbc.co.uk", NULL, "a.b.www.ck",
+                              "nosuchtld", "x.y.z.city.kawasaki.jp", "", "a.b.c.d.e.f.g.h.i.j.com"};
+    size_t nsamples = sizeof(samples) / sizeof(samples[0]);
+    size_t n = 10007;       // not a multiple of CTLD_PARALLEL_CHUNK
+    const char ** hosts = (const char**) malloc(n * sizeof(char*));
+    ctld_result ** expected = (ctld_result**) malloc(n * sizeof(ctld_result*));
+    ctld_result ** out = (ctld_result**) malloc(n * sizeof(ctld_result*));
+    ASSERT_NE_NULL(hosts);
+    ASSERT_NE_NULL(expected);
+    ASSERT_NE_NULL(out);
+    long matched = 0;
+    for (size_t i=0; i< n; ++i){
+        hosts[i] = samples[i % nsamples];
+        expected[i] = hosts[i]?ctld_parse(ctx, (char*) hosts[i], 1):NULL;
+        matched += expected[i] != NULL;
+    }
+    int threads[] = {1, 3, 8, 0};
+    for (size_t t=0; t< sizeof(threads) / sizeof(threads[0]); ++t){
+        ASSERT_EQ_INT(ctld_parse_parallel(ctx, hosts, n, 1, out, threads[t]), matched);
+        for (size_t i=0; i< n; ++i){
+            ASSERT_EQ_INT(out[i] != NULL, expected[i] != NULL);
+            if (out[i]){
+                ASSERT_EQ_STR(out[i]->suffix, expected[i]->suffix);
+                ASSERT_EQ_STR(out[i]->rule, expected[i]->rule);
+                ASSERT_EQ_INT(out[i]->registered_domain != NULL, expected[i]->registered_domain != NULL);
+                if (out[i]->registered_domain)
+                    ASSERT_EQ_STR(out[i]->registered_domain, expected[i]->registered_domain);
+            }
+            ctld_result_free(out[i]);
+        }
+    }
+    // ctld_parse_r() gives the same results and leaves errcode alone
+    ctx->errcode = 0;
+    for (size_t i=0; i< nsamples; ++i){
+        ctld_result * res = ctld_parse_r(ctx, hosts[i], 1);
+        ASSERT_EQ_INT(res != NULL, expected[i] != NULL);
+        if (res)
+            ASSERT_EQ_STR(res->suffix, expected[i]->suffix);
+        ctld_result_free(res);
+    }
+    ASSERT_EQ_INT(ctx->errcode, 0);
+    ASSERT_EQ_INT(ctld_parse_parallel(ctx, hosts, 0, 1, out, 4), 0);
+    ASSERT_EQ_INT(ctld_parse_parallel(NULL, hosts, n, 1, out, 4), -1);
+    ASSERT_EQ_INT(ctld_parse_parallel(ctx, hosts, n, 1, out, -1), -1);
+    for (size_t i=0; i< n; ++i)
+        ctld_result_free(expected[i]);
+    free(expected);
+    free(out);
+    free(hosts);
+    ctld_free(ctx);
+    return 0;
+}
+
+int test_column(){
+    ctld_ctx * ctx = ctld_parse_file("psl.dat");
+    ASSERT_NE_NULL(ctx);
+    // rows: "www.Google.co.uk", null, "co.uk", "x.y.ck.", "", "nope.invalidtld", "a.b.blogspot.com"
+    const char * data = "www.Google.co.ukco.ukx.y.ck.nope.invalidtlda.b.blogspot.com";
+    int32_t offsets[] = {0, 16, 16, 21, 28, 28, 43, 59};
+    uint8_t validity[] = {0x7D};
+    ctld_column column = {7, 0, validity, offsets, 0, data};
+    ctld_span suffix[7], rd[7], domain[7];
+    ASSERT_EQ_INT(ctld_parse_column(ctx, &column, 1, suffix, rd, domain), 4);
+    ASSERT_EQ_INT(suffix[0].start, 11);
+    ASSERT_EQ_INT(suffix[0].len, 5);
+    ASSERT_EQ_INT(rd[0].start, 4);
+    ASSERT_EQ_INT(rd[0].len, 12);
+    ASSERT_EQ_INT(domain[0].len, 6);
+    ASSERT_EQ_INT(suffix[1].len, -1);
+    ASSERT_EQ_INT(suffix[2].len, 5);
+    ASSERT_EQ_INT(rd[2].len, -1);
+    ASSERT_EQ_INT(domain[2].len, -1);
+    ASSERT_EQ_INT(rd[3].start, 21);
+    ASSERT_EQ_INT(rd[3].len, 6);
+    ASSERT_EQ_INT(suffix[4].len, -1);
+    ASSERT_EQ_INT(suffix[5].len, -1);
+    ASSERT_EQ_INT(rd[6].start, 45);
+    ASSERT_EQ_INT(rd[6].len, 14);
+    int32_t out_offsets[8];
+    char out_data[59];
+    uint8_t out_validity[1];
+    ASSERT_EQ_INT(ctld_column_gather(&column, rd, out_offsets, out_data, out_validity), 32);
+    ASSERT_EQ_INT(out_validity[0], 0x49);
+    ASSERT_EQ_INT(out_offsets[1], 12);
+    ASSERT_EQ_INT(out_offsets[7], 32);
+    out_data[32] = '\0';
+    ASSERT_EQ_STR(out_data, "Google.co.ukx.y.ckb.blogspot.com");
+    // large_utf8 with an array offset, ICANN section only
+    int64_t large_offsets[] = {0, 16, 16, 21, 28, 28, 43, 59};
+    ctld_column slice = {3, 4, NULL, large_offsets, 1, data};
+    ASSERT_EQ_INT(ctld_parse_column(ctx, &slice, 0, NULL, rd, NULL), 1);
+    ASSERT_EQ_INT(rd[0].len, -1);
+    ASSERT_EQ_INT(rd[1].len, -1);
+    ASSERT_EQ_INT(rd[2].start, 47);
+    ASSERT_EQ_INT(rd[2].len, 12);
+    ASSERT_EQ_INT(ctld_parse_column(ctx, NULL, 0, suffix, rd, domain), -1);
+    ctld_free(ctx);
+    return 0;
+}
+
+int test_rules(){
+    ctld_ctx * ctx = ctld_parse_file("psl.dat");
+    ASSERT_NE_NULL(ctx);
+    char * rules = "// internal suffixes\n"
+                   "  corp.example   some comment\n"
+                   "\n"
+                   "*.dev.EXAMPLE.com\r\n"
+                   "!keep.dev.example.com\n"
+                   "// ===BEGIN PRIVATE DOMAINS===\n"
+                   "users.example.net\n"
+                   "// ===END PRIVATE DOMAINS===\n"
+                   "a.b.c.d.e.f.example.org";
+    ASSERT_EQ_INT(ctld_add_rules_from_string(ctx, rules), 5);
+    ASSERT_EQ_INT(ctx->max_depth, 8);
+    assert_expect(ctx, 0, "www.corp.example", "www.corp.example", "www.corp.example", "www", "corp.example");
+    assert_expect(ctx, 0, "x.y.dev.example.com", "x.y.dev.example.com", "x.y.dev.example.com", "x", "y.dev.example.com");
+    assert_expect(ctx, 0, "x.keep.dev.example.com", "x.keep.dev.example.com", "keep.dev.example.com", "keep", "dev.example.com");
+    assert_expect(ctx, 0, "www.users.example.net", "www.users.example.net", "example.net", "example", "net");
+    assert_expect(ctx, 1, "www.users.example.net", "www.users.example.net", "www.users.example.net", "www", "users.example.net");
+    assert_expect(ctx, 0, "z.a.b.c.d.e.f.example.org", "z.a.b.c.d.e.f.example.org", "z.a.b.c.d.e.f.example.org", "z", "a.b.c.d.e.f.example.org");
+    ASSERT_EQ_INT(ctld_add_rules_from_string(ctx, NULL), -1);
+    ASSERT_EQ_INT(ctld_add_rules_from_file(ctx, "does-not-exist.dat"), -1);
+    ctld_free(ctx);
+    return 0;
+}
+
 int main(int argc, char ** argv){
     assert(test() == 0);
+    assert(test_sketch() == 0);
+    assert(test_metadata() == 0);
+    assert(test_predicates() == 0);
+    assert(test_overlay() == 0);
+    assert(test_rules() == 0);
+    assert(test_column() == 0);
+    assert(test_index() == 0);
+    assert(test_compact() == 0);
+    assert(test_options() == 0);
+    assert(test_buffer() == 0);
+    assert(test_numa() == 0);
+    assert(test_parallel() == 0);
     printf("*** All tests passed successfully!\n");
     return 0;
 }
@@ -14,3 +14,67 @@ test $(echo "http://xn--npth-5q5a1g.nạpthẻ.vn/app" | ./bin/ctld --rd) == 'xn
 test $(echo "nạpthẻ.vn" | ./bin/ctld --rd) == 'xn--npth-5q5a1g.vn' || echo $FAIL
 test $(echo "xn--npth-5q5a1g.nạpthẻ.vn" | ./bin/ctld --rd) == 'xn--npth-5q5a1g.vn' || echo $FAIL
 test $(echo "google.com." | ./bin/ctld --rd) == 'google.com' || echo $FAIL
+# the private section is only loaded with --private
+test "$(echo "a.b.blogspot.com" | ./bin/ctld --rd --tld)" == $'blogspot.com\tcom' || echo $FAIL
+test "$(echo "a.b.blogspot.com" | ./bin/ctld --rd --tld --private)" == $'b.blogspot.com\tblogspot.com' || echo $FAIL
+
+test "$(printf "a.google.com\nb.google.com\nwww.bbc.co.uk\nfoo.com\n" | ./bin/ctld --count=tld)" == $'3\tcom\n1\tco.uk' || echo $FAIL
+test "$(printf "a.google.com\nb.google.com\nwww.bbc.co.uk\nfoo.com\n" | ./bin/ctld --count=rd --limit=1)" == $'2\tgoogle.com' || echo $FAIL
+test "$(printf "a.google.com\nb.google.com\nwww.bbc.co.uk\nfoo.com\n" | ./bin/ctld --topk=1)" == $'2\tgoogle.com' || echo $FAIL
+test "$(printf "a.google.com\nb.google.com\nwww.bbc.co.uk\nfoo.com\n" | ./bin/ctld --distinct)" == $'rd\t3\ntld\t2' || echo $FAIL
+test "$(printf "a.google.com\nb.google.com\nwww.bbc.co.uk\nfoo.com\n" | ./bin/ctld --unique --tld)" == $'com\nco.uk' || echo $FAIL
+test "$(printf "a.google.com\nb.google.com\nwww.bbc.co.uk\nfoo.com\n" | ./bin/ctld --unique-bloom=1)" == $'google.com\nbbc.co.uk\nfoo.com' || echo $FAIL
+test "$(printf "1\thttps://www.google.com/a\tx\n" | ./bin/ctld --field=2 --tld)" == $'1\thttps://www.google.com/a\tx\tcom' || echo $FAIL
+test "$(printf "a,mail.bbc.co.uk\n" | ./bin/ctld --field=2 --delimiter=,)" == 'a,mail.bbc.co.uk,bbc.co.uk' || echo $FAIL
+test "$(printf '{"q":{"name":"a.b.google.com"}}\n' | ./bin/ctld --json-key=q.name)" == '{"q":{"name":"a.b.google.com"},"ctld_rd":"google.com"}' || echo $FAIL
+test "$(echo "www.google.com" | ./bin/ctld --format=jsonl)" == '{"input":"www.google.com","fqdn":"www.google.com","registered_domain":"google.com","domain":"google","suffix":"com","rule":"com","section":"icann","rule_type":"exact","icann_registered_domain":"google.com","icann_suffix":"com"}' || echo $FAIL
+test "$(echo "com" | ./bin/ctld --format=binary | xxd -p | tr -d '\n')" == '2b0000000a0300636f6dffffffffffff0300636f6d0300636f6d05006963616e6e05006578616374ffff0300636f6d' || echo $FAIL
+
+test "$(printf "a.b.foo.example\nx.bar.example\n" | ./bin/ctld --custom=foo.example,bar.example)" == $'b.foo.example\nx.bar.example' || echo $FAIL
+
+RULES=$(mktemp)
+printf '// internal suffixes\ncorp.example\n*.dev.example.com\n!keep.dev.example.com\n// ===BEGIN PRIVATE DOMAINS===\nusers.example.net\n// ===END PRIVATE DOMAINS===\n' > $RULES
+test "$(printf "a.corp.example\nx.y.dev.example.com\nx.keep.dev.example.com\na.users.example.net\n" | ./bin/ctld --rules-file=$RULES --private)" == $'a.corp.example\nx.y.dev.example.com\nkeep.dev.example.com\na.users.example.net' || echo $FAIL
+test "$(echo "a.users.example.net" | ./bin/ctld --rules-file=$RULES)" == 'example.net' || echo $FAIL
+rm -f $RULES
+
+# --psl uses another list; its index is cached and mapped by the next runs
+PSL=$(mktemp)
+CACHE=$(mktemp -d)
+printf '// ===BEGIN ICANN DOMAINS===\ncom\n*.ck\n// ===END ICANN DOMAINS===\n// ===BEGIN PRIVATE DOMAINS===\nblogspot.com\n// ===END PRIVATE DOMAINS===\n' > $PSL
+test "$(printf "a.b.google.com\nx.y.ck\n" | XDG_CACHE_HOME=$CACHE ./bin/ctld --psl=$PSL)" == $'google.com\nx.y.ck' || echo $FAIL
+test "$(ls $CACHE/ctld | wc -l)" == '1' || echo $FAIL
+test "$(printf "a.b.google.com\nx.y.ck\n" | XDG_CACHE_HOME=$CACHE ./bin/ctld --psl=$PSL)" == $'google.com\nx.y.ck' || echo $FAIL
+test "$(echo "a.b.blogspot.com" | XDG_CACHE_HOME=$CACHE ./bin/ctld --psl=$PSL --private)" == 'b.blogspot.com' || echo $FAIL
+printf '// ===BEGIN ICANN DOMAINS===\nuk\nco.uk\n// ===END ICANN DOMAINS===\n' > $PSL
+test "$(echo "bbc.co.uk" | XDG_CACHE_HOME=$CACHE ./bin/ctld --psl=$PSL)" == 'bbc.co.uk' || echo $FAIL
+test "$(ls $CACHE/ctld | wc -l)" == '3' || echo $FAIL
+rm -rf $PSL $CACHE
+
+test "$(printf "www.google.com\nmail.bbc.co.uk\n" | gzip -c | ./bin/ctld --threads=1)" == $'google.com\nbbc.co.uk' || echo $FAIL
+test "$( (printf "www.google.com\n" | gzip -c; printf "mail.bbc.co.uk" | gzip -c) | ./bin/ctld --threads=2)" == $'google.com\nbbc.co.uk' || echo $FAIL
+BGZF='1f8b08040000000000ff06004243020037002b2f2fd74bcfcf4fcf49d54bcecfe5ca4dccccd14b4a4a0672f44ab3b90011e270001e0000001f8b08040000000000ff0600424302001b0003000000000000000000'
+test "$(echo $BGZF | xxd -r -p | ./bin/ctld --threads=1)" == $'google.com\nbbc.co.uk' || echo $FAIL
+test "$(echo $BGZF | xxd -r -p | ./bin/ctld --threads=4)" == $'google.com\nbbc.co.uk' || echo $FAIL
+if echo $BGZF | xxd -r -p | head -c 40 | ./bin/ctld --threads=4 > /dev/null 2>&1; then echo $FAIL; fi
+
+OUTDIR=$(mktemp -d)
+printf "a.google.com\nb.google.com\nwww.bbc.co.uk\nfoo.com\nmail.google.com\n" | ./bin/ctld --output-dir=$OUTDIR --shards=4
+test "$(ls $OUTDIR | wc -l)" == '4' || echo $FAIL
+test "$(cat $OUTDIR/* | sort | uniq -c | awk '{print $1 $2}' | tr '\n' ' ')" == '1bbc.co.uk 1foo.com 3google.com ' || echo $FAIL
+test "$(grep -l google.com $OUTDIR/* | wc -l)" == '1' || echo $FAIL
+rm -rf $OUTDIR
+
+# the SQLite extension is only tested if it is built (make sqlite)
+if [ -f ./bin/ctld_sqlite.so ] && command -v sqlite3 > /dev/null; then
+    test "$(sqlite3 :memory: '.load ./bin/ctld_sqlite' "select ctld_rd('a.b.google.co.uk'), ctld_suffix('x.y.ck'), ctld_domain('www.google.com'), ctld_is_private('a.blogspot.com'), ctld_rd('a.b.blogspot.com', 1), ctld_rd(NULL) is null;")" == 'google.co.uk|y.ck|google|1|b.blogspot.com|1' || echo $FAIL
+    # inputs longer than the cached ones (URLs with a long query) are looked up too
+    test "$(sqlite3 :memory: '.load ./bin/ctld_sqlite' "select ctld_rd('https://www.example.co.uk/?q=' || replace(hex(zeroblob(1100)), '00', 'a')), ctld_is_private('https://a.b.blogspot.com/?q=' || hex(zeroblob(1100)));")" == 'example.co.uk|1' || echo $FAIL
+fi
+
+# the python module is only tested if it is built (make python)
+# (for the python it was built for, see PYTHON in the Makefile)
+PYEXT=$(${PYTHON:-python3} -c "import sysconfig; print(sysconfig.get_config_var('EXT_SUFFIX'))" 2> /dev/null)
+if [ -n "$PYEXT" ] && [ -f "./bin/pyctld$PYEXT" ]; then
+    PYTHONPATH=./bin ${PYTHON:-python3} ./pytest/test_pyctld.py > /dev/null || echo $FAIL
+fi